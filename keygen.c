@@ -1,50 +1,220 @@
 // Louisa Katlubeck
 // CS 344 
 // Keygen creates a file of a user-specified key length. The characters are any of the 27 allowed
-// characters (all capital letters and the space), using the UNIX rand() randomization. After outputting the 
-// user-specified length, the program outputs a final newline character.
+// characters (all capital letters and the space), drawn from the kernel's CSPRNG with getrandom(). Random bytes
+// are mapped onto the alphabet with rejection sampling (bytes of 243 and up are thrown away, since 243 = 9 * 27)
+// so every character is equally likely. After outputting the user-specified length, the program outputs a final
+// newline character. Output is built and written in large blocks instead of one character at a time.
 // Any errors are output to stderr. 
-// The format for the program is: keygen keylength
+// The format for the program is: keygen keylength [-o outputfile [-t threads]] [--binary] [--container]
+// With -o the key is written to outputfile instead of stdout, and with -t the file is split into regions that
+// are generated in parallel, each thread writing its own region with pwrite().
+// With --binary (or -b) the key is keylength raw random bytes of every value, for the clients' binary mode, and no
+// newline follows it.
+// With --container (or -c, which needs -o) the key is written as a pad container (see otp_padfile.h): a header
+// and an index in front of the symbols, and a checksum for every segment, so the clients and daemons can start
+// using it at any offset and notice a damaged or truncated pad. Each block generated is one segment.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/random.h>
+#include "otp_padfile.h"
+
+#define BLOCK_SIZE OTP_PADFILE_SEGMENT   // characters generated and written per block
+#define GENERATOR "keygen-getrandom"    // generator id written into containers
+
+static const char characterPool[27] = { 'A','B','C','D','E','F','G','H','I','J','K','L','M',
+                                        'N','O','P','Q','R','S','T','U','V','W','X','Y','Z',' ' };
+
+// Region of the key a thread is responsible for
+struct region {
+    int fd;                             // output file, or stdout
+    long long start;                    // offset of the first character
+    long long base;                     // where character 0 goes in the file
+    long long length;                   // number of characters
+    int usePwrite;                      // write at start with pwrite() instead of appending
+};
+
+static int binary;                      // raw bytes instead of characters
+static unsigned char *containerHead;    // header and index of a container, filled in as segments are generated
+
+void error(const char *msg) { perror(msg); exit(1); }                       // Error function used for reporting issues
+
+// Fill out[0..n) with unbiased random characters from characterPool
+static void fillBlock(char *out, size_t n)
+{
+    unsigned char random[4096];
+    size_t filled = 0;
+    ssize_t got, j;
+
+    // Raw bytes need no sampling at all
+    while (binary && filled < n) {
+        got = getrandom(out + filled, n - filled, 0);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            error("keygen: ERROR getrandom failed");
+        }
+        filled += got;
+    }
+
+    while (filled < n) {
+        got = getrandom(random, sizeof(random), 0);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            error("keygen: ERROR getrandom failed");
+        }
+
+        // Keep only bytes below 243 so each of the 27 characters comes up 9 ways
+        for (j = 0; j < got && filled < n; j++) {
+            if (random[j] < 243) out[filled++] = characterPool[random[j] % 27];
+        }
+    }
+}
+
+// Write all of buf, at offset if usePwrite is set
+static void writeBlock(int fd, const char *buf, size_t n, long long offset, int usePwrite)
+{
+    size_t done = 0;
+    ssize_t nb;
+
+    while (done < n) {
+        if (usePwrite) nb = pwrite(fd, buf + done, n - done, offset + done);
+        else nb = write(fd, buf + done, n - done);
+        if (nb < 0) {
+            if (errno == EINTR) continue;
+            error("keygen: ERROR writing the key");
+        }
+        done += nb;
+    }
+}
+
+// Generate one region of the key, a block at a time
+static void *generateRegion(void *arg)
+{
+    struct region *r = arg;
+    long long done = 0;
+    char *block = malloc(BLOCK_SIZE);
+
+    if (block == NULL) error("keygen: ERROR out of memory");
+    while (done < r->length) {
+        size_t n = r->length - done < BLOCK_SIZE ? r->length - done : BLOCK_SIZE;
+
+        fillBlock(block, n);
+        if (containerHead != NULL) {
+            otp_padfile_put_entry(containerHead, (r->start + done) / BLOCK_SIZE, BLOCK_SIZE, n, otp_padfile_checksum(block, n));
+        }
+        writeBlock(r->fd, block, n, r->base + r->start + done, r->usePwrite);
+        done += n;
+    }
+    free(block);
+    return NULL;
+}
 
 int main(int argc, char *argv[])
 {
     //////////////////////////////////////////////////////////////////////
     // variable setup 
-    int keyLength = atoi(argv[1]);      
-    //char characterPool[28] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ \0"; // pool of characters to pick from for the key
-	char characterPool[27] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+    long long keyLength;
+    const char *outputFile = NULL;
+    int threads = 1;
+    struct region *regions;
+    pthread_t *ids;
+    int fd = 1;
+    int option;
+    int i;
+    int container = 0;
+    long long segments, dataOffset = 0;
+    static const struct option longOptions[] = {
+        { "binary", no_argument, NULL, 'b' },
+        { "container", no_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
 
     //////////////////////////////////////////////////////////////////////
     // error handling
-    // if there are not two arguments (the program name and a length) output an error
-    if (argc != 2){
+    // read the options, then there must be exactly one argument left (the length)
+    while ((option = getopt_long(argc, argv, "o:t:bc", longOptions, NULL)) != -1) {
+        switch (option) {
+        case 'o': outputFile = optarg; break;
+        case 't': threads = atoi(optarg); break;
+        case 'b': binary = 1; break;
+        case 'c': container = 1; break;
+        default: fprintf(stderr, "Incorrect number of arguments\n"); exit(0);
+        }
+    }
+    if (argc - optind != 1){
         fprintf(stderr, "Incorrect number of arguments\n"); 
         exit(0); 
     }
+    keyLength = atoll(argv[optind]);
+    if (keyLength < 0) keyLength = 0;
 
-    //////////////////////////////////////////////////////////////////////
-    // if the key length is valid, proceed to generate a key of that length
-    // seed the random generator
-    srand((unsigned int)time(0));
-    int i = 0;
+    // a container's index is written last, at the front of the file, so it needs a real file
+    if (container && outputFile == NULL) {
+        fprintf(stderr, "keygen: ERROR --container needs -o outputfile\n");
+        exit(1);
+    }
+    segments = (keyLength + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (container) {
+        dataOffset = otp_padfile_data_offset(segments);
+        containerHead = calloc(dataOffset, 1);
+        if (containerHead == NULL) error("keygen: ERROR out of memory");
+    }
+
+    // threads each need their own region of a real file
+    if (threads < 1) threads = 1;
+    if (outputFile == NULL) threads = 1;
+    if (threads > keyLength / BLOCK_SIZE + 1) threads = keyLength / BLOCK_SIZE + 1;
 
+    if (outputFile != NULL) {
+        fd = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) error("keygen: ERROR could not open the output file");
+        if (ftruncate(fd, container ? dataOffset + keyLength : keyLength + !binary) < 0) error("keygen: ERROR could not size the output file");
+    }
+
+    //////////////////////////////////////////////////////////////////////
     // generate and output the key
-    // get a random number from 0 to 26 to use to select the next character from characterPool
-    // then print that character
-    for (i = 0; i < keyLength; i++){
-        int next = rand()%27;    
-        printf("%c", characterPool[next]);
+    // split the key into one contiguous region per thread (a whole number of segments each in a container)
+    regions = calloc(threads, sizeof(*regions));
+    ids = calloc(threads, sizeof(*ids));
+    if (regions == NULL || ids == NULL) error("keygen: ERROR out of memory");
+
+    for (i = 0; i < threads; i++) {
+        regions[i].fd = fd;
+        regions[i].start = container ? segments * i / threads * BLOCK_SIZE : keyLength * i / threads;
+        regions[i].length = (container ? segments * (i + 1) / threads * BLOCK_SIZE : keyLength * (i + 1) / threads) - regions[i].start;
+        if (regions[i].start + regions[i].length > keyLength) regions[i].length = keyLength - regions[i].start;
+        regions[i].base = dataOffset;
+        regions[i].usePwrite = outputFile != NULL;
+    }
+
+    if (threads == 1) generateRegion(&regions[0]);
+    else {
+        for (i = 0; i < threads; i++) {
+            if (pthread_create(&ids[i], NULL, generateRegion, &regions[i]) != 0) error("keygen: ERROR starting thread");
+        }
+        for (i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+    }
+
+    // print the final newline character (a binary key has none), or the header and index of a container, which
+    // has none either
+    if (container) {
+        otp_padfile_put_header(containerHead, keyLength, binary ? OTP_PADFILE_BYTES : OTP_PADFILE_SYMBOLS, BLOCK_SIZE, GENERATOR);
+        writeBlock(fd, (const char *)containerHead, dataOffset, 0, 1);
+        free(containerHead);
     }
+    else if (!binary) writeBlock(fd, "\n", 1, keyLength, outputFile != NULL);
+    if (outputFile != NULL && close(fd) < 0) error("keygen: ERROR closing the output file");
 
-    // print the final newline character
-    printf("\n");
+    free(regions);
+    free(ids);
 
     // return
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,157 @@
+// Description: Implementation of the client-side load balancer declared in otp_balance.h.
+// A list holds a handful of daemons, so picking simply looks at every endpoint under the lock. That takes a few
+// nanoseconds per endpoint, next to the round trip of the requests it places.
+// Sources: https://www.envoyproxy.io/docs/envoy/latest/intro/arch_overview/upstream/outlier (ejection)
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "otp_balance.h"
+
+static uint64_t milliseconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int otp_balance_init(struct otp_balancer *balancer, const char *addresses)
+{
+	const char *entry, *comma;
+	size_t count = 1, length;
+
+	memset(balancer, 0, sizeof(*balancer));
+	for (entry = addresses; (comma = strchr(entry, ',')) != NULL; entry = comma + 1) count++;
+	if (count > OTP_BALANCE_MAX) {
+		errno = E2BIG;
+		return -1;
+	}
+	balancer->endpoints = calloc(count, sizeof(*balancer->endpoints));
+	if (balancer->endpoints == NULL) return -1;
+
+	// Every entry has to name something
+	for (entry = addresses; balancer->count < count; entry = comma + 1) {
+		comma = strchr(entry, ',');
+		length = comma != NULL ? (size_t)(comma - entry) : strlen(entry);
+		if (length == 0 || length >= OTP_BALANCE_ADDRESS) {
+			free(balancer->endpoints);
+			balancer->endpoints = NULL;
+			balancer->count = 0;
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(balancer->endpoints[balancer->count++].address, entry, length);
+		if (comma == NULL) break;
+	}
+
+	// Short-lived clients pick only once, so they start their searches in different places
+	balancer->next = ((size_t)getpid() + milliseconds()) % balancer->count;
+	pthread_mutex_init(&balancer->lock, NULL);
+	return 0;
+}
+
+void otp_balance_free(struct otp_balancer *balancer)
+{
+	pthread_mutex_destroy(&balancer->lock);
+	free(balancer->endpoints);
+	balancer->endpoints = NULL;
+	balancer->count = 0;
+}
+
+// Rank an endpoint: 0 if it is available, 1 if it is busy, 2 if it is ejected
+static int rank(const struct otp_endpoint *e, uint64_t now)
+{
+	return now < e->ejectedUntil ? 2 : now < e->busyUntil ? 1 : 0;
+}
+
+// The endpoint otp_balance_pick() picks, with the lock held
+static size_t best(struct otp_balancer *balancer, uint64_t now, int *bestRank)
+{
+	struct otp_endpoint *e, *b;
+	size_t i, k, found = 0;
+	int r;
+
+	*bestRank = 3;
+	for (k = 0; k < balancer->count; k++) {
+		i = (balancer->next + k) % balancer->count;
+		e = &balancer->endpoints[i];
+		b = &balancer->endpoints[found];
+		r = rank(e, now);
+
+		// The fewest requests in flight among the available ones, or else the first to come free
+		if (r < *bestRank || (r == *bestRank && ((r == 0 && e->outstanding < b->outstanding) ||
+			(r == 1 && e->busyUntil < b->busyUntil) || (r == 2 && e->ejectedUntil < b->ejectedUntil)))) {
+			found = i;
+			*bestRank = r;
+		}
+	}
+	return found;
+}
+
+size_t otp_balance_pick(struct otp_balancer *balancer, unsigned requests, unsigned *wait)
+{
+	uint64_t now = milliseconds();
+	size_t picked;
+	int r;
+
+	pthread_mutex_lock(&balancer->lock);
+	picked = best(balancer, now, &r);
+	balancer->endpoints[picked].outstanding += requests;
+	*wait = r == 1 ? (unsigned)(balancer->endpoints[picked].busyUntil - now) : 0;
+	balancer->next = (picked + 1) % balancer->count;
+	pthread_mutex_unlock(&balancer->lock);
+	return picked;
+}
+
+unsigned otp_balance_wait(struct otp_balancer *balancer)
+{
+	uint64_t now = milliseconds();
+	unsigned wait;
+	size_t picked;
+	int r;
+
+	pthread_mutex_lock(&balancer->lock);
+	picked = best(balancer, now, &r);
+	wait = r == 1 ? (unsigned)(balancer->endpoints[picked].busyUntil - now) : 0;
+	pthread_mutex_unlock(&balancer->lock);
+	return wait;
+}
+
+void otp_balance_release(struct otp_balancer *balancer, size_t endpoint, unsigned requests)
+{
+	pthread_mutex_lock(&balancer->lock);
+	balancer->endpoints[endpoint].outstanding -= requests;
+	pthread_mutex_unlock(&balancer->lock);
+}
+
+void otp_balance_succeeded(struct otp_balancer *balancer, size_t endpoint)
+{
+	pthread_mutex_lock(&balancer->lock);
+	balancer->endpoints[endpoint].failures = 0;
+	balancer->endpoints[endpoint].ejectedUntil = 0;
+	pthread_mutex_unlock(&balancer->lock);
+}
+
+void otp_balance_failed(struct otp_balancer *balancer, size_t endpoint)
+{
+	struct otp_endpoint *e = &balancer->endpoints[endpoint];
+	unsigned ejection = OTP_BALANCE_EJECT;
+	unsigned i;
+
+	pthread_mutex_lock(&balancer->lock);
+	for (i = 0; i < e->failures && ejection < OTP_BALANCE_EJECT_MAX; i++) ejection *= 2;
+	if (ejection > OTP_BALANCE_EJECT_MAX) ejection = OTP_BALANCE_EJECT_MAX;
+	e->failures++;
+	e->ejectedUntil = milliseconds() + ejection;
+	pthread_mutex_unlock(&balancer->lock);
+}
+
+void otp_balance_busy(struct otp_balancer *balancer, size_t endpoint, unsigned backoff)
+{
+	pthread_mutex_lock(&balancer->lock);
+	balancer->endpoints[endpoint].busyUntil = milliseconds() + backoff;
+	pthread_mutex_unlock(&balancer->lock);
+}
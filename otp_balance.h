@@ -0,0 +1,64 @@
+// Description: Client-side load balancing over several daemons, used by libotpclient and the batch client.
+// Wherever a client takes the address of a daemon, it also takes a list of them separated by commas, such as
+// 5000,5001,/tmp/otp_enc.sock or 10.0.0.2:5000,10.0.0.3:5000 (each one as otp_address() reads it). The daemons are
+// meant to be interchangeable instances, so every request can go to any of them.
+// Each request goes to the daemon with the fewest requests in flight from this client. Counts are exact, since
+// picking an endpoint and counting its new requests happen under one lock, so no two pickers herd onto the
+// same idle daemon. Ties go round robin. A slow daemon piles up requests in flight and is passed over until
+// it catches up.
+// A daemon that cannot be connected to, or that drops a connection in the middle of a request, is ejected: it is
+// passed over for OTP_BALANCE_EJECT milliseconds, doubling with every failure in a row up to
+// OTP_BALANCE_EJECT_MAX. Once that time is up it is picked again, and the connection to it is its health check:
+// if it connects, it is back (and its count of failures is cleared), and if not, it is ejected for longer. A daemon
+// that answers BUSY is only passed over for the backoff it asked for. When every daemon is ejected the one
+// whose ejection ends first is tried anyway, so a client is never left with nowhere to go; when every
+// daemon that is not ejected is busy, the caller is told how long to wait for the first to come free.
+// Pads held by a daemon are not shared between daemons, so a client with several endpoints cannot use them.
+
+#ifndef OTP_BALANCE_H
+#define OTP_BALANCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define OTP_BALANCE_MAX 64                  // endpoints in one list
+#define OTP_BALANCE_ADDRESS 256             // longest endpoint address, with its NUL
+#define OTP_BALANCE_EJECT 500               // milliseconds an endpoint is ejected for after its first failure
+#define OTP_BALANCE_EJECT_MAX 30000
+
+struct otp_endpoint {
+	char address[OTP_BALANCE_ADDRESS];
+	unsigned outstanding;               // requests in flight to it
+	unsigned failures;                  // in a row
+	uint64_t ejectedUntil;              // CLOCK_MONOTONIC milliseconds
+	uint64_t busyUntil;
+};
+
+struct otp_balancer {
+	pthread_mutex_t lock;
+	struct otp_endpoint *endpoints;
+	size_t count;
+	size_t next;                        // where the next search starts, so ties go round robin
+};
+
+// Set up a balancer over the comma separated addresses. Returns 0 on success and -1 with errno set if the list is
+// empty, has an empty or too long entry, or too many of them, or memory runs out.
+int otp_balance_init(struct otp_balancer *balancer, const char *addresses);
+void otp_balance_free(struct otp_balancer *balancer);
+
+// Pick the endpoint for the next requests and count them as in flight to it, until otp_balance_release().
+// *wait is set to the milliseconds to wait before sending to it, which is 0 unless every endpoint is busy.
+size_t otp_balance_pick(struct otp_balancer *balancer, unsigned requests, unsigned *wait);
+void otp_balance_release(struct otp_balancer *balancer, size_t endpoint, unsigned requests);
+
+// The milliseconds until otp_balance_pick() would pick without waiting: 0 unless every endpoint is busy
+unsigned otp_balance_wait(struct otp_balancer *balancer);
+
+// Report on an endpoint: a connection to it succeeded, it failed (and is ejected), or it answered BUSY and asked
+// to be left alone for the given milliseconds
+void otp_balance_succeeded(struct otp_balancer *balancer, size_t endpoint);
+void otp_balance_failed(struct otp_balancer *balancer, size_t endpoint);
+void otp_balance_busy(struct otp_balancer *balancer, size_t endpoint, unsigned milliseconds);
+
+#endif
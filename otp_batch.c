@@ -0,0 +1,684 @@
+// Description: Implementation of the batch mode declared in otp_batch.h.
+// Every connection is a slot that runs one job at a time through three phases: reading the input and key, the
+// transfer (one SENDMSG for the whole request, led by the hello on a new connection, and RECVs for the answer,
+// both in flight at once) and writing the output. Completions carry the slot and the operation in their user data. A slot only moves on once all of its
+// operations have completed, so its buffers are never reused under the kernel. Buffers belong to the slot and
+// only ever grow, so a steady run of similar jobs allocates nothing.
+// A daemon that is full answers the hello BUSY. The slot then hangs up, waits out a jittered backoff with an
+// io_uring timeout (so the other slots carry on meanwhile), connects again and resends the job from memory. A slot
+// still turned away after OTP_BUSY_RETRIES attempts hands its job back and retires, so the batch shrinks to as many
+// connections as the daemon admits; only when no other slot is left does the client give up.
+// With a list of daemons (see otp_balance.h), every connection counts as one request in flight to its daemon, so
+// the slots spread over the daemons with the fewest connections. A slot whose daemon cannot be reached connects to
+// another, and one whose daemon drops it halfway through a job sends the job again to another.
+// Files are opened and closed with plain system calls, which cost little next to the reads and writes.
+// Sources: io_uring_enter(2), sendmsg(2)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "otp_protocol.h"
+#include "otp_cipher.h"
+#include "otp_padfile.h"
+#include "otp_uring.h"
+#include "otp_balance.h"
+#include "otp_batch.h"
+
+#define PHASE_READ 0
+#define PHASE_TRANSFER 1
+#define PHASE_WRITE 2
+#define PHASE_BACKOFF 3                     // turned away busy, waiting to connect again
+
+#define OP_READ_TEXT 0
+#define OP_READ_KEY 1
+#define OP_SEND 2
+#define OP_RECV 3
+#define OP_WRITE 4
+#define OP_WAIT 5
+#define USER_DATA(slot, op) ((uint64_t)(slot) << 8 | (op))
+
+#define READ_MIN 65536                      // first buffer for an input that is not a regular file
+#define MAX_IOV 1024                        // vectors one sendmsg() or writev() takes (UIO_MAXIOV)
+#define HEADER_MAX (OTP_HEADER_SIZE + OTP_PAD_REF_SIZE)
+
+// One line of the manifest
+struct job {
+	const char *input, *key, *output;
+	size_t line;
+};
+
+// An input file being read into memory
+struct input {
+	int fd;
+	char *data;
+	size_t fill, capacity;
+	off_t size;                         // of a regular file, or -1 to read until the end of file
+};
+
+// One connection and the job it is working on
+struct slot {
+	int socketFD;
+	size_t endpoint;                    // the daemon of the list it is connected to
+	int fresh;                          // the connection is new, so the next request opens it with the hello
+	struct job *job;                    // NULL once the manifest is used up
+	int phase;
+	int ops;                            // operations submitted and not completed yet
+	int failed;                         // the job failed and is skipped once ops drops to 0
+	int refused;                        // the daemon refused the job, so the connection is of no use any more
+	unsigned busyAttempts;              // BUSY answers to the current job so far
+	unsigned lostAttempts;              // connections the current job lost halfway
+	int lost;                           // the daemon dropped the connection, so the job goes to another
+	struct __kernel_timespec wait;      // backoff before the next attempt
+	struct input text, key;
+	size_t textLength;
+	int padKey;                         // the key is a pad the daemon holds
+	uint32_t padId;
+	uint64_t padOffset;
+	unsigned char *headers;             // headers (and pad references) of the request's frames
+	struct iovec *sendIov;
+	int sendFirst, sendCount;           // vectors not sent yet are sendIov[sendFirst..sendCount)
+	struct msghdr message;
+	unsigned char *answer;              // everything the daemon sends back for the job
+	size_t answerFill, answerCapacity;
+	size_t parsed;                      // offset of the next answer frame header
+	size_t answerLength;                // symbols in the DATA frames parsed so far
+	size_t answerFrames;                // and how many frames they came in
+	int answered;                       // the END frame has arrived
+	struct iovec *writeIov;             // the answer's payloads and the newline
+	int writeFirst, writeCount;
+	int outFD;
+	size_t sendIovCapacity, writeIovCapacity, headerCapacity;
+};
+
+static struct otp_uring ring;
+static struct slot *slots;
+static struct job *jobs;
+static size_t jobCount, nextJob;
+static struct job **requeued;               // jobs handed back by slots that retired, taken before the next new one
+static size_t requeuedCount;
+static int active;                          // slots still working on a job
+static int failures;                        // jobs that failed
+static const char *daemonAddress;
+static struct otp_balancer balancer;        // over the daemons of the list
+static const struct otp_batch_client *batchClient;
+static unsigned char hello[OTP_HELLO_SIZE];     // every connection's hello; the jobs to come are not known up front
+
+//////////////////////////////////////////////////////////////////////
+// helpers
+
+// Connect the slot to a daemon of the list, trying the others if it cannot be reached; its next request opens the
+// connection with the hello. Exits with 2 if no daemon can be reached, like the single-file clients.
+static void connectDaemon(struct slot *slot)
+{
+	unsigned wait;                      // the backoff is waited out before connecting
+	size_t tries;
+
+	for (tries = 0; tries < balancer.count; tries++) {
+		slot->endpoint = otp_balance_pick(&balancer, 1, &wait);
+		slot->socketFD = otp_connect(balancer.endpoints[slot->endpoint].address);
+		if (slot->socketFD >= 0) break;
+		otp_balance_release(&balancer, slot->endpoint, 1);
+		otp_balance_failed(&balancer, slot->endpoint);
+	}
+	if (slot->socketFD < 0) { fprintf(stderr, "CLIENT: ERROR connecting on port %s\n", daemonAddress); exit(2); }
+	otp_balance_succeeded(&balancer, slot->endpoint);
+	slot->fresh = 1;
+}
+
+// Close the slot's connection, if it has one
+static void hangUp(struct slot *slot)
+{
+	if (slot->socketFD < 0) return;
+	close(slot->socketFD);
+	slot->socketFD = -1;
+	otp_balance_release(&balancer, slot->endpoint, 1);
+}
+
+// Grow a buffer to hold at least size bytes. Exits if there is no memory left.
+static void *reserve(void *buffer, size_t *capacity, size_t size, size_t unit)
+{
+	if (size <= *capacity) return buffer;
+	if (size < 2 * *capacity) size = 2 * *capacity;
+	buffer = realloc(buffer, size * unit);
+	if (buffer == NULL) { perror("CLIENT: ERROR out of memory"); exit(1); }
+	*capacity = size;
+	return buffer;
+}
+
+// The symbols before the newline of data, or -1 if there is no newline or a symbol outside the alphabet before it
+// (*bad is then where)
+static long checkSymbols(const char *data, size_t length, size_t *bad)
+{
+	size_t j = otp_check_symbols(data, length);
+
+	*bad = j;
+	return j < length && data[j] == '\n' ? (long)j : -1;
+}
+
+// Drop done bytes from the front of iov[*first..count). Returns the number of vectors to pass on next.
+static int consume(struct iovec *iov, int *first, int count, size_t done)
+{
+	while (*first < count && done >= iov[*first].iov_len) done -= iov[(*first)++].iov_len;
+	if (*first < count) {
+		iov[*first].iov_base = (char *)iov[*first].iov_base + done;
+		iov[*first].iov_len -= done;
+	}
+	return count - *first < MAX_IOV ? count - *first : MAX_IOV;
+}
+
+static struct io_uring_sqe *queue(struct slot *slot, int op, int opcode, int fd)
+{
+	struct io_uring_sqe *sqe = otp_uring_sqe(&ring);
+
+	if (sqe == NULL) { perror("CLIENT: ERROR io_uring submission failed"); exit(1); }
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	if (opcode == IORING_OP_READ || opcode == IORING_OP_WRITEV) sqe->off = (uint64_t)-1;     // at the file's current position
+	sqe->user_data = USER_DATA(slot - slots, op);
+	slot->ops++;
+	return sqe;
+}
+
+static void msToTimespec(struct __kernel_timespec *ts, unsigned milliseconds)
+{
+	ts->tv_sec = milliseconds / 1000;
+	ts->tv_nsec = (long long)(milliseconds % 1000) * 1000000;
+}
+
+static void jobFailed(struct slot *slot, const char *what, const char *path)
+{
+	fprintf(stderr, "CLIENT: ERROR %s%s%s (manifest line %zu)\n", what, path != NULL ? " " : "", path != NULL ? path : "", slot->job->line);
+	slot->failed = 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// phases
+
+static void submitRead(struct slot *slot, struct input *in, int op)
+{
+	struct io_uring_sqe *sqe;
+
+	// Something that is not a regular file is read until it says end of file
+	if (in->fill == in->capacity) in->data = reserve(in->data, &in->capacity, in->capacity + READ_MIN, 1);
+	sqe = queue(slot, op, IORING_OP_READ, in->fd);
+	sqe->addr = (uintptr_t)(in->data + in->fill);
+	sqe->len = in->capacity - in->fill;
+}
+
+static int openInput(struct slot *slot, struct input *in, const char *path, int op)
+{
+	struct stat info;
+
+	in->fd = open(path, O_RDONLY);
+	if (in->fd < 0) return -1;
+	in->size = fstat(in->fd, &info) == 0 && S_ISREG(info.st_mode) ? info.st_size : -1;
+	in->fill = 0;
+	in->data = reserve(in->data, &in->capacity, in->size > 0 ? (size_t)in->size : READ_MIN, 1);
+
+	// An empty file is done already (and fails the check for lack of a newline)
+	if (in->size != 0) submitRead(slot, in, op);
+	return 0;
+}
+
+static void closeInputs(struct slot *slot)
+{
+	if (slot->text.fd >= 0) close(slot->text.fd);
+	if (slot->key.fd >= 0) close(slot->key.fd);
+	slot->text.fd = slot->key.fd = -1;
+}
+
+// Take jobs off the manifest until one is under way, or there are none left
+static void startJob(struct slot *slot)
+{
+	struct job *job;
+
+	while (requeuedCount > 0 || nextJob < jobCount) {
+		job = slot->job = requeuedCount > 0 ? requeued[--requeuedCount] : &jobs[nextJob++];
+		slot->phase = PHASE_READ;
+		slot->failed = 0;
+		slot->lostAttempts = 0;
+		slot->padKey = job->key[0] == '@' && strchr(job->key, ':') != NULL;
+		if (slot->padKey && balancer.count > 1) {
+			jobFailed(slot, "a list of daemons cannot use the pad", job->key);
+			failures++;
+			continue;
+		}
+		if (slot->padKey) {
+			slot->padId = strtoul(job->key + 1, NULL, 10);
+			slot->padOffset = strtoull(strchr(job->key, ':') + 1, NULL, 10);
+		}
+		if (openInput(slot, &slot->text, job->input, OP_READ_TEXT) < 0) {
+			jobFailed(slot, "could not open the input file", job->input);
+			failures++;
+			continue;
+		}
+		if (!slot->padKey && openInput(slot, &slot->key, job->key, OP_READ_KEY) < 0) {
+			jobFailed(slot, "could not open the key file", job->key);
+			if (slot->ops > 0) return;  // the text read must complete before the job is dropped
+			closeInputs(slot);
+			failures++;
+			continue;
+		}
+		return;
+	}
+
+	// Nothing left to do: hang up at once, so a daemon that limits its clients can let a waiting slot in
+	slot->job = NULL;
+	active--;
+	hangUp(slot);
+}
+
+static void submitSend(struct slot *slot)
+{
+	struct io_uring_sqe *sqe = queue(slot, OP_SEND, IORING_OP_SENDMSG, slot->socketFD);
+
+	sqe->addr = (uintptr_t)&slot->message;
+	sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+static void submitRecv(struct slot *slot)
+{
+	struct io_uring_sqe *sqe = queue(slot, OP_RECV, IORING_OP_RECV, slot->socketFD);
+
+	sqe->addr = (uintptr_t)(slot->answer + slot->answerFill);
+	sqe->len = slot->answerCapacity - slot->answerFill;
+}
+
+// Check the job's input the way the single-file clients do, then send it all in one go and start receiving
+static void sendRequest(struct slot *slot)
+{
+	char message[96];
+	size_t n, position, frames, bad, headerSize = slot->padKey ? HEADER_MAX : OTP_HEADER_SIZE;
+	long textLength, keyLength;
+	unsigned char *header;
+	int v = 0;
+
+	closeInputs(slot);
+	textLength = checkSymbols(slot->text.data, slot->text.fill, &bad);
+	if (textLength < 0) {
+		snprintf(message, sizeof(message), "invalid character at byte %zu of the %s", bad, batchClient->textName);
+		jobFailed(slot, message, slot->job->input);
+		return;
+	}
+	slot->textLength = textLength;
+	if (!slot->padKey) {
+		if (otp_padfile_is_container(slot->key.data, slot->key.fill)) { jobFailed(slot, "batch mode cannot use the pad container", slot->job->key); return; }
+		keyLength = checkSymbols(slot->key.data, slot->key.fill, &bad);
+		if (keyLength < 0) {
+			snprintf(message, sizeof(message), "invalid character at byte %zu of the key", bad);
+			jobFailed(slot, message, slot->job->key);
+			return;
+		}
+		if ((size_t)keyLength < slot->textLength) { jobFailed(slot, "key too short for", slot->job->input); return; }
+	}
+
+	// Describe every frame of the request: header (and pad reference), text slice, key slice; then the END frame.
+	// The first request on a connection leads with the hello.
+	frames = (slot->textLength + OTP_CHUNK_MAX - 1) / OTP_CHUNK_MAX;
+	slot->headers = reserve(slot->headers, &slot->headerCapacity, (frames + 1) * HEADER_MAX, 1);
+	slot->sendIov = reserve(slot->sendIov, &slot->sendIovCapacity, 3 * frames + 2, sizeof(struct iovec));
+	if (slot->fresh) slot->sendIov[v++] = (struct iovec){ hello, OTP_HELLO_SIZE };
+	slot->fresh = 0;
+	for (position = 0, header = slot->headers; position < slot->textLength; position += n, header += headerSize) {
+		n = slot->textLength - position < OTP_CHUNK_MAX ? slot->textLength - position : OTP_CHUNK_MAX;
+		otp_put_header(header, slot->padKey ? OTP_FRAME_PAD : OTP_FRAME_DATA, slot->job - jobs + 1, n);
+		if (slot->padKey) otp_put_pad_ref(header + OTP_HEADER_SIZE, slot->padId, slot->padOffset + position);
+		slot->sendIov[v++] = (struct iovec){ header, headerSize };
+		slot->sendIov[v++] = (struct iovec){ slot->text.data + position, n };
+		if (!slot->padKey) slot->sendIov[v++] = (struct iovec){ slot->key.data + position, n };
+	}
+	otp_put_header(header, OTP_FRAME_END, slot->job - jobs + 1, 0);
+	slot->sendIov[v++] = (struct iovec){ header, OTP_HEADER_SIZE };
+	slot->sendFirst = 0;
+	slot->sendCount = v;
+
+	// The answer is a header per frame, the ciphered symbols and the END frame, or an ERROR frame instead
+	slot->answer = reserve(slot->answer, &slot->answerCapacity, (frames + 2) * OTP_HEADER_SIZE + slot->textLength + OTP_REASON_MAX, 1);
+	slot->answerFill = 0;
+	slot->parsed = 0;
+	slot->answerLength = 0;
+	slot->answerFrames = 0;
+	slot->answered = 0;
+	slot->phase = PHASE_TRANSFER;
+
+	memset(&slot->message, 0, sizeof(slot->message));
+	slot->message.msg_iov = slot->sendIov;
+	slot->message.msg_iovlen = v < MAX_IOV ? v : MAX_IOV;
+	submitSend(slot);
+	submitRecv(slot);
+}
+
+static void submitWrite(struct slot *slot)
+{
+	struct io_uring_sqe *sqe = queue(slot, OP_WRITE, IORING_OP_WRITEV, slot->outFD);
+
+	sqe->addr = (uintptr_t)(slot->writeIov + slot->writeFirst);
+	sqe->len = slot->writeCount - slot->writeFirst < MAX_IOV ? slot->writeCount - slot->writeFirst : MAX_IOV;
+}
+
+// The whole answer is in: write its payloads to the output file, straight from the receive buffer
+static void writeAnswer(struct slot *slot)
+{
+	static char newLine[] = "\n";
+	size_t offset;
+	uint32_t id, length;
+	int type, v = 0;
+
+	slot->outFD = open(slot->job->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (slot->outFD < 0) { jobFailed(slot, "could not open the output file", slot->job->output); return; }
+
+	slot->writeIov = reserve(slot->writeIov, &slot->writeIovCapacity, slot->answerFrames + 1, sizeof(struct iovec));
+	for (offset = 0; offset < slot->parsed; offset += OTP_HEADER_SIZE + length) {
+		otp_get_header(slot->answer + offset, &type, &id, &length);
+		if (type == OTP_FRAME_DATA) slot->writeIov[v++] = (struct iovec){ slot->answer + offset + OTP_HEADER_SIZE, length };
+	}
+	slot->writeIov[v++] = (struct iovec){ newLine, 1 };
+	slot->writeFirst = 0;
+	slot->writeCount = v;
+	slot->phase = PHASE_WRITE;
+	submitWrite(slot);
+}
+
+// After a BUSY answer: drop the connection and wait, then connect again and send the job once more. After a lost
+// connection the job goes straight to another daemon.
+static void backOff(struct slot *slot)
+{
+	struct io_uring_sqe *sqe;
+
+	if (slot->lost) {
+		hangUp(slot);
+		slot->lost = 0;
+	}
+	else if (slot->socketFD >= 0) {
+		hangUp(slot);
+
+		// Out of retries: leave the job to the slots the daemons did admit, or give up if there are none
+		if (slot->busyAttempts == OTP_BUSY_RETRIES * balancer.count) {
+			if (active == 1) {
+				fprintf(stderr, "CLIENT: ERROR the server on port %s is busy, giving up\n", daemonAddress);
+				exit(2);
+			}
+			requeued[requeuedCount++] = slot->job;
+			slot->job = NULL;
+			active--;
+			return;
+		}
+		slot->busyAttempts++;
+		sqe = queue(slot, OP_WAIT, IORING_OP_TIMEOUT, -1);
+		sqe->addr = (uintptr_t)&slot->wait;
+		sqe->len = 1;
+		return;
+	}
+	connectDaemon(slot);
+	sendRequest(slot);
+}
+
+// Move a slot on once everything it submitted has completed
+static void progress(struct slot *slot)
+{
+	while (slot->job != NULL && slot->ops == 0) {
+		if (slot->failed) {
+			// Drop the job; a refusal leaves the connection in an unknown state, so it is replaced
+			closeInputs(slot);
+			if (slot->outFD >= 0) close(slot->outFD);
+			slot->outFD = -1;
+			if (slot->refused) {
+				hangUp(slot);
+				connectDaemon(slot);
+				slot->refused = 0;
+			}
+			failures++;
+			startJob(slot);
+		}
+		else if (slot->phase == PHASE_BACKOFF) backOff(slot);
+		else if (slot->phase == PHASE_READ) sendRequest(slot);
+		else if (slot->phase == PHASE_TRANSFER) writeAnswer(slot);
+		else {
+			close(slot->outFD);
+			slot->outFD = -1;
+			startJob(slot);
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// completions
+
+// The daemon closed the connection before the job was answered. With a list of daemons it is ejected and the job
+// sent to another, as long as the job has not lost a connection to every one of them; otherwise exit with 2.
+static void lostConnection(struct slot *slot)
+{
+	if (balancer.count == 1 || slot->lostAttempts == balancer.count) {
+		fprintf(stderr, "CLIENT: ERROR server closed the connection early on port %s\n", daemonAddress);
+		exit(2);
+	}
+	otp_balance_failed(&balancer, slot->endpoint);
+	slot->lostAttempts++;
+	slot->lost = 1;
+	slot->phase = PHASE_BACKOFF;
+	shutdown(slot->socketFD, SHUT_RDWR);
+}
+
+static void readDone(struct slot *slot, struct input *in, const char *path, int op, int res)
+{
+	if (slot->failed) return;
+	if (res < 0) { jobFailed(slot, "could not read", path); return; }
+
+	// A regular file is done once it has all been read, anything else when it reports end of file
+	in->fill += res;
+	if (res > 0 && (in->size < 0 || in->fill < (size_t)in->size)) submitRead(slot, in, op);
+}
+
+static void sendDone(struct slot *slot, int res)
+{
+	int next;
+
+	if (slot->refused || slot->phase == PHASE_BACKOFF) return;
+	if (res == -EPIPE || res == -ECONNRESET) { lostConnection(slot); return; }
+	if (res < 0) { errno = -res; perror("CLIENT: ERROR transfer failed"); exit(1); }
+	otp_io.bytesSent += res;
+
+	next = consume(slot->sendIov, &slot->sendFirst, slot->sendCount, res);
+	if (next > 0) {
+		slot->message.msg_iov = slot->sendIov + slot->sendFirst;
+		slot->message.msg_iovlen = next;
+		submitSend(slot);
+	}
+}
+
+static void recvDone(struct slot *slot, int res)
+{
+	char reason[OTP_REASON_MAX + 64];
+	uint32_t id, length;
+	int type;
+
+	if (slot->refused || slot->phase == PHASE_BACKOFF) return;
+	if (res == 0 || res == -ECONNRESET) { lostConnection(slot); return; }
+	if (res < 0) { errno = -res; perror("CLIENT: ERROR transfer failed"); exit(1); }
+	otp_io.bytesReceived += res;
+	slot->answerFill += res;
+
+	// Walk the frame headers that have arrived; answers belong to this job and come in order
+	while (!slot->answered && slot->parsed + OTP_HEADER_SIZE <= slot->answerFill) {
+		otp_get_header(slot->answer + slot->parsed, &type, &id, &length);
+		if (type == OTP_FRAME_BUSY) {
+			uint32_t netHint = 0;
+
+			if (slot->parsed + OTP_HEADER_SIZE + OTP_BUSY_SIZE > slot->answerFill) break;
+
+			// Nothing was ciphered: hang up, which also ends the send, and try again once this daemon or
+			// another of the list is free
+			if (length == OTP_BUSY_SIZE) memcpy(&netHint, slot->answer + slot->parsed + OTP_HEADER_SIZE, sizeof(netHint));
+			otp_balance_busy(&balancer, slot->endpoint, otp_busy_backoff(slot->busyAttempts / balancer.count, ntohl(netHint)));
+			msToTimespec(&slot->wait, otp_balance_wait(&balancer));
+			slot->phase = PHASE_BACKOFF;
+			shutdown(slot->socketFD, SHUT_RDWR);
+			return;
+		}
+		if (type == OTP_FRAME_ERROR) {
+			if (slot->parsed + OTP_HEADER_SIZE + length > slot->answerFill) break;
+
+			// A refused hello means the daemon is of no use to any job
+			if (id == OTP_HELLO_ID) {
+				fprintf(stderr, "CLIENT: ERROR the server on port %s refused %s: %.*s\n", daemonAddress, batchClient->name,
+					(int)(length < OTP_REASON_MAX ? length : OTP_REASON_MAX), (const char *)slot->answer + slot->parsed + OTP_HEADER_SIZE);
+				exit(2);
+			}
+
+			// Report the reason and hang up, which also ends a send the daemon is no longer reading
+			snprintf(reason, sizeof(reason), "server refused the request: %.*s", (int)(length < OTP_REASON_MAX ? length : OTP_REASON_MAX),
+				(const char *)slot->answer + slot->parsed + OTP_HEADER_SIZE);
+			jobFailed(slot, reason, NULL);
+			slot->refused = 1;
+			shutdown(slot->socketFD, SHUT_RDWR);
+			return;
+		}
+		// An answer has to give back exactly as many symbols as the request sent
+		if (id != (uint32_t)(slot->job - jobs + 1) || (type != OTP_FRAME_DATA && type != OTP_FRAME_END) ||
+			(type == OTP_FRAME_DATA && length > slot->textLength - slot->answerLength) ||
+			(type == OTP_FRAME_END && slot->answerLength != slot->textLength)) {
+			errno = EPROTO;
+			perror("CLIENT: ERROR transfer failed");
+			exit(1);
+		}
+		slot->parsed += OTP_HEADER_SIZE + length;
+		slot->busyAttempts = 0;
+		if (type == OTP_FRAME_DATA) {
+			slot->answerLength += length;
+			slot->answerFrames++;
+		}
+		if (type == OTP_FRAME_END) slot->answered = 1;
+	}
+	if (slot->answered) return;
+	if (slot->answerFill == slot->answerCapacity) {
+		errno = EPROTO;
+		perror("CLIENT: ERROR transfer failed");
+		exit(1);
+	}
+	submitRecv(slot);
+}
+
+static void writeDone(struct slot *slot, int res)
+{
+	if (res < 0) { jobFailed(slot, "could not write the output file", slot->job->output); return; }
+	if (consume(slot->writeIov, &slot->writeFirst, slot->writeCount, res) > 0) submitWrite(slot);
+}
+
+static void complete(const struct io_uring_cqe *cqe)
+{
+	struct slot *slot = &slots[cqe->user_data >> 8];
+
+	slot->ops--;
+	switch (cqe->user_data & 0xff) {
+	case OP_READ_TEXT: readDone(slot, &slot->text, slot->job->input, OP_READ_TEXT, cqe->res); break;
+	case OP_READ_KEY: readDone(slot, &slot->key, slot->job->key, OP_READ_KEY, cqe->res); break;
+	case OP_SEND: sendDone(slot, cqe->res); break;
+	case OP_RECV: recvDone(slot, cqe->res); break;
+	case OP_WRITE: writeDone(slot, cqe->res); break;
+	case OP_WAIT: break;                // -ETIME when the backoff is over
+	}
+	progress(slot);
+}
+
+//////////////////////////////////////////////////////////////////////
+// manifest and main loop
+
+// Read the manifest at path into jobs. Returns 0 on success and -1 (after saying why) if it is unusable.
+static int readManifest(const char *path, char **text)
+{
+	struct otp_mapping file;
+	char *line, *next, *token, *save, *field[4];
+	size_t number, lines = 1, i;
+	int fields;
+
+	if (otp_map_file(path, &file) < 0) { fprintf(stderr, "CLIENT: ERROR could not open the manifest %s\n", path); return -1; }
+	*text = malloc(file.length + 1);
+	for (i = 0; i < file.length; i++) lines += file.data[i] == '\n';
+	jobs = malloc(lines * sizeof(*jobs));
+	if (*text == NULL || jobs == NULL) { perror("CLIENT: ERROR out of memory"); exit(1); }
+	memcpy(*text, file.data, file.length);
+	(*text)[file.length] = '\0';
+	otp_unmap_file(&file);
+
+	// Jobs point into the copy, one line at a time
+	for (line = *text, number = 1; line != NULL; line = next, number++) {
+		next = strchr(line, '\n');
+		if (next != NULL) *next++ = '\0';
+		for (fields = 0, token = strtok_r(line, " \t\r", &save); token != NULL && fields < 4; token = strtok_r(NULL, " \t\r", &save))
+			field[fields++] = token;
+		if (fields == 0 || field[0][0] == '#') continue;
+		if (fields != 3) {
+			fprintf(stderr, "CLIENT: ERROR manifest line %zu: expected an input file, a key and an output file\n", number);
+			return -1;
+		}
+		jobs[jobCount++] = (struct job){ field[0], field[1], field[2], number };
+	}
+	return 0;
+}
+
+int otp_batch_run(const char *path, const char *address, int inflight, const struct otp_batch_client *client)
+{
+	struct io_uring_cqe done, *cqe;
+	char *manifest = NULL;
+	size_t j;
+	int slotCount, s, flags = 0;
+
+	daemonAddress = address;
+	batchClient = client;
+	if (otp_balance_init(&balancer, address) < 0) { fprintf(stderr, "CLIENT: ERROR bad list of daemons %s\n", address); return 1; }
+	if (readManifest(path, &manifest) < 0) return 1;
+	for (j = 0; j < jobCount; j++) if (jobs[j].key[0] == '@' && strchr(jobs[j].key, ':') != NULL) flags = OTP_HELLO_PAD;
+	otp_put_hello(hello, client->tag, flags, 0, 0);
+	slotCount = jobCount < (size_t)inflight ? (int)jobCount : inflight;
+
+	// A slot never has more than two operations in flight
+	if (slotCount > 0 && otp_uring_init(&ring, 2 * slotCount) < 0) { perror("CLIENT: ERROR io_uring is not available"); return 1; }
+	slots = calloc(slotCount > 0 ? slotCount : 1, sizeof(*slots));
+	requeued = malloc((slotCount > 0 ? slotCount : 1) * sizeof(*requeued));
+	if (slots == NULL || requeued == NULL) { perror("CLIENT: ERROR out of memory"); exit(1); }
+	for (s = 0; s < slotCount; s++) {
+		slots[s].text.fd = slots[s].key.fd = slots[s].outFD = -1;
+		connectDaemon(&slots[s]);
+	}
+
+	active = slotCount;
+	for (s = 0; s < slotCount; s++) {
+		startJob(&slots[s]);
+		progress(&slots[s]);
+	}
+
+	// One call submits what the last round of completions queued and waits for the next one
+	while (active > 0) {
+		if (otp_uring_submit(&ring, 1) < 0) { perror("CLIENT: ERROR io_uring_enter failed"); exit(1); }
+		while ((cqe = otp_uring_peek(&ring)) != NULL) {
+			done = *cqe;
+			otp_uring_seen(&ring);
+			complete(&done);
+		}
+	}
+
+	for (s = 0; s < slotCount; s++) {
+		hangUp(&slots[s]);
+		free(slots[s].text.data);
+		free(slots[s].key.data);
+		free(slots[s].headers);
+		free(slots[s].sendIov);
+		free(slots[s].answer);
+		free(slots[s].writeIov);
+	}
+	if (slotCount > 0) otp_uring_exit(&ring);
+	free(slots);
+	free(requeued);
+	free(jobs);
+	free(manifest);
+	otp_balance_free(&balancer);
+	return failures > 0 ? 1 : 0;
+}
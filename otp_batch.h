@@ -0,0 +1,32 @@
+// Description: Batch mode of otp_enc/otp_dec, for jobs that would otherwise run a client once per file:
+// otp_enc --batch MANIFEST [--inflight N] port
+// The manifest lists one job per line: an input file, a key file (or @ID:OFFSET for a pad the daemon holds) and an
+// output file, separated by blanks. Blank lines and lines starting with '#' are skipped.
+// The client opens up to N connections to the daemon (default OTP_BATCH_INFLIGHT), and each works through the jobs
+// one at a time: it reads the input and key, checks them the same way the single-file client does, sends the
+// request, receives the answer and writes it to the output file, followed by a newline. All of that file and
+// socket I/O goes through one io_uring (see otp_uring.h), so while some connections wait for the daemon others
+// are reading or writing files, and one io_uring_enter() call submits and reaps the work of all of them.
+// A job whose files cannot be read or fail the checks, or that the daemon refuses, is reported on stderr and
+// skipped; its output file is left alone and the other jobs go on. A job is held in memory whole while it is in
+// flight, so batch mode suits many small and medium files; very large ones are better streamed by the plain client.
+
+#ifndef OTP_BATCH_H
+#define OTP_BATCH_H
+
+#define OTP_BATCH_INFLIGHT 16               // connections, and so requests in flight, unless --inflight says otherwise
+#define OTP_BATCH_INFLIGHT_MAX 1024
+
+// What the batch needs to know about the client running it
+struct otp_batch_client {
+	const char *name;                   // "otp_enc" or "otp_dec", for messages
+	char tag;                           // tag of the daemon its hello asks for
+	const char *textName;               // "plaintext" or "ciphertext", for messages
+};
+
+// Run every job of the manifest at path against the daemon at address (or the comma separated list of daemons),
+// with up to inflight requests in flight. Returns the exit status: 0 if every job succeeded, 1 if the manifest is
+// bad or any job failed, and 2 if no daemon can be reached or a connection fails.
+int otp_batch_run(const char *path, const char *address, int inflight, const struct otp_batch_client *client);
+
+#endif
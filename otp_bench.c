@@ -0,0 +1,343 @@
+// Description: otp_bench is a load generator for otp_enc_d and otp_dec_d. It speaks the wire protocol directly
+// (see otp_protocol.h) and runs a closed loop: each client process opens one persistent connection, sends a
+// request, waits for the whole answer, and sends the next one. Texts and keys are random symbols generated in
+// memory, so the disks play no part in the numbers.
+// The syntax is: otp_bench port|path [--dec] [--clients N] [--size N | --size MIN-MAX] [--time S] [--warmup S] [--packed]
+//                 [--reconnect] [--fastopen] [--csv]
+//   --dec        drive otp_dec_d instead of otp_enc_d
+//   --clients N  concurrent connections, one process each (default 1)
+//   --size       symbols per request, fixed or uniformly spread over MIN-MAX (default 1000)
+//   --time S     seconds to measure for (default 10), after --warmup S seconds that are not counted (default 1)
+//   --packed     send and receive the symbols packed (see otp_pack.h)
+//   --reconnect  open a new connection for every request, and time the connect as part of it
+//   --fastopen   connect with TCP Fast Open (see otp_connect())
+//   --csv        print the results as one CSV row with a header instead of the readable report
+// A daemon that is full (--max-inflight) answers BUSY; the client then backs off the way otp_enc does and sends the
+// same request again on a new connection, and its latency counts from the first attempt. Busy answers are reported
+// on their own, and a request turned away OTP_BUSY_RETRIES times in a row counts as an error.
+// Latencies go into a log-linear histogram (16 buckets per power of two, so every bucket is within about 6%) held
+// in a shared mapping, one per client, and the parent merges them once every client is done.
+// Sources: clock_gettime(2), mmap(2)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "otp_protocol.h"
+
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define BUCKET_COUNT ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+// What one client measured, written only by that client
+struct clientStats {
+	unsigned long requests;
+	unsigned long errors;
+	unsigned long busy;                 // BUSY answers, each followed by a retry
+	unsigned long symbols;              // text symbols ciphered
+	uint64_t lastFinish;                // when the last counted request finished (ns)
+	unsigned long histogram[BUCKET_COUNT];
+};
+
+static const char characterPool[28] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+static int reconnect;                   // --reconnect: one connection per request
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "USAGE: %s port|path [--dec] [--clients N] [--size N | --size MIN-MAX] [--time S] [--warmup S] [--packed] [--reconnect] [--fastopen] [--csv]\n", program);
+	exit(1);
+}
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, one state per client
+static uint64_t nextRandom(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+// Values below SUB_BUCKETS get a bucket each; above that every power of two is split into SUB_BUCKETS buckets
+static int bucketOf(uint64_t value)
+{
+	int exponent;
+
+	if (value < SUB_BUCKETS) return value;
+	exponent = 63 - __builtin_clzll(value);
+	return SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS + ((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// Largest value that lands in bucket
+static uint64_t bucketTop(int bucket)
+{
+	int exponent, sub;
+
+	if (bucket < SUB_BUCKETS) return bucket;
+	exponent = (bucket - SUB_BUCKETS) / SUB_BUCKETS + SUB_BUCKET_BITS;
+	sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+	return ((uint64_t)(SUB_BUCKETS + sub + 1) << (exponent - SUB_BUCKET_BITS)) - 1;
+}
+
+// Smallest latency that at least fraction of the requests did not exceed
+static double percentile(const unsigned long *histogram, unsigned long total, double fraction)
+{
+	unsigned long seen = 0, wanted = (unsigned long)(fraction * total + 0.5);
+	int i;
+
+	if (wanted == 0) wanted = 1;
+	for (i = 0; i < BUCKET_COUNT; i++) {
+		seen += histogram[i];
+		if (seen >= wanted) return bucketTop(i) / 1000.0;
+	}
+	return 0;
+}
+
+// Connect to the daemon (on a local port or Unix socket path). The hello goes out with the first request.
+// Returns the socket, or -1 with a message printed.
+static int connectDaemon(const char *address)
+{
+	int socketFD = otp_connect(address);
+
+	if (socketFD < 0) fprintf(stderr, "BENCH: ERROR connecting on port %s\n", address);
+	return socketFD;
+}
+
+// One client: send requests back to back until the deadline, timing each one
+static void runClient(struct clientStats *stats, const char *address, char tag, size_t minSize, size_t maxSize,
+	uint64_t countFrom, uint64_t deadline)
+{
+	uint64_t state = now() ^ ((uint64_t)getpid() << 32);
+	struct otp_request request;
+	char *text, *key;
+	int socketFD, nullFD;
+	char hello;                         // tag to open the connection with, 0 once it has been opened
+	unsigned busyAttempts = 0;          // BUSY answers to the current request so far
+	uint64_t started = 0, finished;
+	size_t i;
+
+	// Random text and key, long enough for the largest request; each request starts at a random spot in them
+	text = malloc(2 * maxSize + 1);
+	if (text == NULL) { fprintf(stderr, "BENCH: ERROR out of memory\n"); exit(1); }
+	key = text + maxSize;
+	for (i = 0; i < 2 * maxSize; i++) text[i] = characterPool[nextRandom(&state) % 27];
+
+	nullFD = open("/dev/null", O_WRONLY);
+	if (nullFD < 0) exit(2);
+	socketFD = -1;
+	hello = 0;
+
+	memset(&request, 0, sizeof(request));
+	while (1) {
+		size_t offset;
+		int result;
+
+		// A request sent again after a BUSY answer keeps its size and its start time
+		if (busyAttempts == 0) {
+			started = now();
+			if (started >= deadline) break;
+			request.id++;
+			request.textLength = minSize + (maxSize > minSize ? nextRandom(&state) % (maxSize - minSize + 1) : 0);
+			offset = maxSize > request.textLength ? nextRandom(&state) % (maxSize - request.textLength + 1) : 0;
+			request.text = text + offset;
+			request.key = key + offset;
+		}
+		if (socketFD < 0) {
+			socketFD = connectDaemon(address);
+			if (socketFD < 0) exit(2);
+			hello = tag;
+		}
+
+		result = otp_stream_requests(socketFD, hello, &request, 1, nullFD);
+		finished = now();
+		hello = 0;
+
+		// The wrong daemon is no use at all
+		if (result == 3) {
+			fprintf(stderr, "BENCH: ERROR the daemon on port %s is not otp_%s_d: %s\n", address, tag == 't' ? "enc" : "dec", otp_reject_reason);
+			exit(2);
+		}
+
+		// A full daemon turned us away before reading anything: wait, and try again on a new connection
+		if (result == 4) {
+			stats->busy++;
+			close(socketFD);
+			socketFD = -1;
+			if (busyAttempts < OTP_BUSY_RETRIES) {
+				usleep(1000 * otp_busy_backoff(busyAttempts++, otp_busy_hint));
+				continue;
+			}
+		}
+		busyAttempts = 0;
+
+		// A failed request is counted and the connection is replaced, as it is after every request with --reconnect
+		if ((result != 0 || reconnect) && socketFD >= 0) {
+			close(socketFD);
+			socketFD = -1;
+		}
+		if (result != 0) {
+			stats->errors++;
+			continue;
+		}
+
+		// Requests still in the warmup period are not counted
+		if (started < countFrom) continue;
+		stats->requests++;
+		stats->symbols += request.textLength;
+		stats->histogram[bucketOf(finished - started)]++;
+		stats->lastFinish = finished;
+	}
+
+	if (socketFD >= 0) close(socketFD);
+	close(nullFD);
+	free(text);
+}
+
+// Print the merged histogram with one line per power of two
+static void printHistogram(const unsigned long *histogram, unsigned long total)
+{
+	unsigned long largest = 0, rows[BUCKET_COUNT / SUB_BUCKETS];
+	int rowCount = BUCKET_COUNT / SUB_BUCKETS;
+	int i, first = -1, last = -1;
+
+	for (i = 0; i < rowCount; i++) {
+		int j;
+
+		rows[i] = 0;
+		for (j = 0; j < SUB_BUCKETS; j++) rows[i] += histogram[i * SUB_BUCKETS + j];
+		if (rows[i] > largest) largest = rows[i];
+		if (rows[i] > 0 && first < 0) first = i;
+		if (rows[i] > 0) last = i;
+	}
+	if (first < 0) return;
+
+	printf("  histogram (us)\n");
+	for (i = first; i <= last; i++) {
+		double low = i == 0 ? 0 : (bucketTop(i * SUB_BUCKETS - 1) + 1) / 1000.0;
+		double high = (bucketTop(i * SUB_BUCKETS + SUB_BUCKETS - 1) + 1) / 1000.0;
+		int bar = (int)(40.0 * rows[i] / largest + 0.5);
+
+		printf("    %12.3f - %12.3f %10lu %5.1f%% ", low, high, rows[i], 100.0 * rows[i] / total);
+		while (bar-- > 0) putchar('#');
+		putchar('\n');
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option longOptions[] = {
+		{ "dec", no_argument, NULL, 'd' },
+		{ "clients", required_argument, NULL, 'c' },
+		{ "size", required_argument, NULL, 's' },
+		{ "time", required_argument, NULL, 't' },
+		{ "warmup", required_argument, NULL, 'w' },
+		{ "packed", no_argument, NULL, 'p' },
+		{ "reconnect", no_argument, NULL, 'r' },
+		{ "fastopen", no_argument, NULL, 'f' },
+		{ "csv", no_argument, NULL, 'C' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct clientStats *stats;
+	unsigned long *histogram;
+	unsigned long requests = 0, errors = 0, busy = 0, symbols = 0;
+	uint64_t countFrom, deadline, lastFinish = 0;
+	size_t minSize = 1000, maxSize = 1000;
+	double seconds = 10, warmup = 1, elapsed;
+	int clients = 1, csv = 0, failed = 0;
+	const char *address;
+	char tag = 't';
+	int option, i, status;
+
+	while ((option = getopt_long(argc, argv, "dc:s:t:w:prfC", longOptions, NULL)) != -1) {
+		switch (option) {
+		case 'd': tag = 'p'; break;
+		case 'c': clients = atoi(optarg); break;
+		case 's':
+			minSize = maxSize = strtoul(optarg, NULL, 10);
+			if (strchr(optarg, '-') != NULL) maxSize = strtoul(strchr(optarg, '-') + 1, NULL, 10);
+			break;
+		case 't': seconds = atof(optarg); break;
+		case 'w': warmup = atof(optarg); break;
+		case 'p': otp_pack_frames = 1; break;
+		case 'r': reconnect = 1; break;
+		case 'f': otp_fast_open = 1; break;
+		case 'C': csv = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc || clients < 1 || maxSize < minSize || seconds <= 0 || warmup < 0) usage(argv[0]);
+	address = argv[optind];
+
+	// One stats block per client in memory shared with the children
+	stats = mmap(NULL, clients * sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	histogram = calloc(BUCKET_COUNT, sizeof(*histogram));
+	if (stats == MAP_FAILED || histogram == NULL) { fprintf(stderr, "BENCH: ERROR out of memory\n"); exit(1); }
+
+	// Start every client against the same clock
+	countFrom = now() + (uint64_t)(warmup * 1e9);
+	deadline = countFrom + (uint64_t)(seconds * 1e9);
+	for (i = 0; i < clients; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) { perror("BENCH: ERROR on fork"); exit(1); }
+		if (pid == 0) {
+			runClient(&stats[i], address, tag, minSize, maxSize, countFrom, deadline);
+			exit(0);
+		}
+	}
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+	}
+
+	// Merge what the clients saw
+	for (i = 0; i < clients; i++) {
+		int j;
+
+		requests += stats[i].requests;
+		errors += stats[i].errors;
+		busy += stats[i].busy;
+		symbols += stats[i].symbols;
+		if (stats[i].lastFinish > lastFinish) lastFinish = stats[i].lastFinish;
+		for (j = 0; j < BUCKET_COUNT; j++) histogram[j] += stats[i].histogram[j];
+	}
+	elapsed = lastFinish > countFrom ? (lastFinish - countFrom) / 1e9 : seconds;
+
+	if (csv) {
+		printf("daemon,address,clients,min_size,max_size,seconds,requests,errors,requests_per_s,mb_per_s,p50_us,p99_us,p999_us,max_us,encoding,busy\n");
+		printf("otp_%s_d,%s,%d,%zu,%zu,%.3f,%lu,%lu,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f,%s,%lu\n",
+			tag == 't' ? "enc" : "dec", address, clients, minSize, maxSize, elapsed, requests, errors,
+			requests / elapsed, symbols / elapsed / 1e6, percentile(histogram, requests, 0.5),
+			percentile(histogram, requests, 0.99), percentile(histogram, requests, 0.999), percentile(histogram, requests, 1.0),
+			otp_pack_frames ? "packed" : "plain", busy);
+	}
+	else {
+		printf("otp_bench: otp_%s_d on %s, %d clients, %zu-%zu symbols per request%s%s, %.3f s measured\n",
+			tag == 't' ? "enc" : "dec", address, clients, minSize, maxSize, otp_pack_frames ? " (packed)" : "",
+			reconnect ? " on a new connection each" : "", elapsed);
+		printf("  requests    %lu (%lu errors, %lu busy answers retried)\n", requests, errors, busy);
+		printf("  throughput  %.1f requests/s, %.3f MB/s of text\n", requests / elapsed, symbols / elapsed / 1e6);
+		if (requests > 0) {
+			printf("  latency     p50 %.3f us  p99 %.3f us  p999 %.3f us  max %.3f us\n", percentile(histogram, requests, 0.5),
+				percentile(histogram, requests, 0.99), percentile(histogram, requests, 0.999), percentile(histogram, requests, 1.0));
+			printHistogram(histogram, requests);
+		}
+	}
+
+	// Clients that could not reach the daemon make the run fail like the other clients do
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,339 @@
+// Description: Implementation of the mod 27 cipher kernels declared in otp_cipher.h.
+// The scalar path replaces the strchr() index search with a 256 entry lookup table. The vector paths turn a
+// symbol into its index by subtracting 'A' and patching spaces to 26, add or subtract the key with a single
+// compare-and-correct step instead of a division, and map back the same way in reverse.
+// Every kernel also has a byte XOR for binary mode, 8 bytes per step on the scalar path and 64 or 128 on the vector
+// paths, which keeps up with memory bandwidth.
+// The alphabet check the clients run over their input is here too: the vector paths range check 32 or 64 bytes per
+// step with two signed compares and an equality, and only look at single bytes once a step has found a bad one.
+// Setting OTP_CIPHER_KERNEL (for example to "scalar") in the environment forces a particular kernel.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "otp_cipher.h"
+#include "otp_pack.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OTP_CIPHER_X86 1
+#endif
+
+#define PACKED_BLOCK (128 * OTP_PACK_GROUP)    // symbols otp_cipher_packed() unpacks at a time
+
+static const char characterPool[28] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";     // index -> symbol
+static unsigned char symbolIndex[256];                                    // symbol -> index
+static unsigned char symbolValid[256];                                    // 1 for the 27 symbols, 0 for any other byte
+
+//////////////////////////////////////////////////////////////////////
+// scalar kernel
+
+// decrypt is a compile time constant in every caller, so this turns into two specialised loops
+static inline __attribute__((always_inline))
+void scalarKernel(char *out, const char *text, const char *key, size_t n, const int decrypt)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		int textIndex = symbolIndex[(unsigned char)text[i]];
+		int keyIndex = symbolIndex[(unsigned char)key[i]];
+
+		// Subtracting is the same as adding 27 - key, which keeps everything in 0..53
+		int nextValue = textIndex + (decrypt ? 27 - keyIndex : keyIndex);
+		if (nextValue >= 27) nextValue -= 27;
+
+		out[i] = characterPool[nextValue];
+	}
+}
+
+static void scalarEncrypt(char *out, const char *text, const char *key, size_t n) { scalarKernel(out, text, key, n, 0); }
+static void scalarDecrypt(char *out, const char *text, const char *key, size_t n) { scalarKernel(out, text, key, n, 1); }
+
+static void scalarXor(char *out, const char *text, const char *key, size_t n)
+{
+	uint64_t t, k;
+	size_t i = 0;
+
+	// A word at a time; memcpy() keeps the unaligned loads legal and compiles to plain moves
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&t, text + i, 8);
+		memcpy(&k, key + i, 8);
+		t ^= k;
+		memcpy(out + i, &t, 8);
+	}
+	for (; i < n; i++) out[i] = text[i] ^ key[i];
+}
+
+static size_t scalarCheck(const char *data, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n && symbolValid[(unsigned char)data[i]]) i++;
+	return i;
+}
+
+static int scalarSupported(void) { return 1; }
+
+#ifdef OTP_CIPHER_X86
+//////////////////////////////////////////////////////////////////////
+// SSE4.1 kernel - two 16 byte vectors per step
+
+static inline __attribute__((always_inline, target("sse4.1")))
+__m128i sseCipher(__m128i text, __m128i key, const int decrypt)
+{
+	const __m128i letterA = _mm_set1_epi8('A');
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i n26 = _mm_set1_epi8(26);
+	const __m128i n27 = _mm_set1_epi8(27);
+	__m128i textIndex, keyIndex, value;
+
+	// Symbol -> index: 'A'..'Z' become 0..25 and ' ' becomes 26
+	textIndex = _mm_blendv_epi8(_mm_sub_epi8(text, letterA), n26, _mm_cmpeq_epi8(text, space));
+	keyIndex = _mm_blendv_epi8(_mm_sub_epi8(key, letterA), n26, _mm_cmpeq_epi8(key, space));
+
+	// Add or subtract, then bring the result back into 0..26
+	if (decrypt) {
+		value = _mm_sub_epi8(textIndex, keyIndex);
+		value = _mm_add_epi8(value, _mm_and_si128(_mm_cmpgt_epi8(_mm_setzero_si128(), value), n27));
+	}
+	else {
+		value = _mm_add_epi8(textIndex, keyIndex);
+		value = _mm_sub_epi8(value, _mm_and_si128(_mm_cmpgt_epi8(value, n26), n27));
+	}
+
+	// Index -> symbol
+	return _mm_blendv_epi8(_mm_add_epi8(value, letterA), space, _mm_cmpeq_epi8(value, n26));
+}
+
+static inline __attribute__((always_inline, target("sse4.1")))
+void sseKernel(char *out, const char *text, const char *key, size_t n, const int decrypt)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m128i t0 = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i t1 = _mm_loadu_si128((const __m128i *)(text + i + 16));
+		__m128i k0 = _mm_loadu_si128((const __m128i *)(key + i));
+		__m128i k1 = _mm_loadu_si128((const __m128i *)(key + i + 16));
+
+		_mm_storeu_si128((__m128i *)(out + i), sseCipher(t0, k0, decrypt));
+		_mm_storeu_si128((__m128i *)(out + i + 16), sseCipher(t1, k1, decrypt));
+	}
+
+	// Finish the last few symbols one at a time
+	scalarKernel(out + i, text + i, key + i, n - i, decrypt);
+}
+
+__attribute__((target("sse4.1"))) static void sseEncrypt(char *out, const char *text, const char *key, size_t n) { sseKernel(out, text, key, n, 0); }
+__attribute__((target("sse4.1"))) static void sseDecrypt(char *out, const char *text, const char *key, size_t n) { sseKernel(out, text, key, n, 1); }
+
+__attribute__((target("sse4.1")))
+static void sseXor(char *out, const char *text, const char *key, size_t n)
+{
+	size_t i = 0, j;
+
+	for (; i + 64 <= n; i += 64) {
+		for (j = 0; j < 64; j += 16) {
+			__m128i t = _mm_loadu_si128((const __m128i *)(text + i + j));
+			__m128i k = _mm_loadu_si128((const __m128i *)(key + i + j));
+
+			_mm_storeu_si128((__m128i *)(out + i + j), _mm_xor_si128(t, k));
+		}
+	}
+	scalarXor(out + i, text + i, key + i, n - i);
+}
+
+// Bit i is set if byte i of data is outside the alphabet. Bytes from 0x80 up compare as negative, so they are
+// never above 'A' - 1.
+static inline __attribute__((always_inline, target("sse4.1")))
+unsigned sseInvalid(__m128i data)
+{
+	__m128i letter = _mm_andnot_si128(_mm_cmpgt_epi8(data, _mm_set1_epi8('Z')), _mm_cmpgt_epi8(data, _mm_set1_epi8('A' - 1)));
+
+	return ~_mm_movemask_epi8(_mm_or_si128(letter, _mm_cmpeq_epi8(data, _mm_set1_epi8(' ')))) & 0xffff;
+}
+
+__attribute__((target("sse4.1")))
+static size_t sseCheck(const char *data, size_t n)
+{
+	unsigned invalid;
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		invalid = sseInvalid(_mm_loadu_si128((const __m128i *)(data + i)));
+		invalid |= sseInvalid(_mm_loadu_si128((const __m128i *)(data + i + 16))) << 16;
+		if (invalid != 0) return i + __builtin_ctz(invalid);
+	}
+	return i + scalarCheck(data + i, n - i);
+}
+
+static int sseSupported(void) { __builtin_cpu_init(); return __builtin_cpu_supports("sse4.1"); }
+
+//////////////////////////////////////////////////////////////////////
+// AVX2 kernel - two 32 byte vectors per step
+
+static inline __attribute__((always_inline, target("avx2")))
+__m256i avxCipher(__m256i text, __m256i key, const int decrypt)
+{
+	const __m256i letterA = _mm256_set1_epi8('A');
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i n26 = _mm256_set1_epi8(26);
+	const __m256i n27 = _mm256_set1_epi8(27);
+	__m256i textIndex, keyIndex, value;
+
+	// Symbol -> index: 'A'..'Z' become 0..25 and ' ' becomes 26
+	textIndex = _mm256_blendv_epi8(_mm256_sub_epi8(text, letterA), n26, _mm256_cmpeq_epi8(text, space));
+	keyIndex = _mm256_blendv_epi8(_mm256_sub_epi8(key, letterA), n26, _mm256_cmpeq_epi8(key, space));
+
+	// Add or subtract, then bring the result back into 0..26
+	if (decrypt) {
+		value = _mm256_sub_epi8(textIndex, keyIndex);
+		value = _mm256_add_epi8(value, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), value), n27));
+	}
+	else {
+		value = _mm256_add_epi8(textIndex, keyIndex);
+		value = _mm256_sub_epi8(value, _mm256_and_si256(_mm256_cmpgt_epi8(value, n26), n27));
+	}
+
+	// Index -> symbol
+	return _mm256_blendv_epi8(_mm256_add_epi8(value, letterA), space, _mm256_cmpeq_epi8(value, n26));
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+void avxKernel(char *out, const char *text, const char *key, size_t n, const int decrypt)
+{
+	size_t i = 0;
+
+	for (; i + 64 <= n; i += 64) {
+		__m256i t0 = _mm256_loadu_si256((const __m256i *)(text + i));
+		__m256i t1 = _mm256_loadu_si256((const __m256i *)(text + i + 32));
+		__m256i k0 = _mm256_loadu_si256((const __m256i *)(key + i));
+		__m256i k1 = _mm256_loadu_si256((const __m256i *)(key + i + 32));
+
+		_mm256_storeu_si256((__m256i *)(out + i), avxCipher(t0, k0, decrypt));
+		_mm256_storeu_si256((__m256i *)(out + i + 32), avxCipher(t1, k1, decrypt));
+	}
+
+	// Hand whatever is left to the 16 byte path
+	sseKernel(out + i, text + i, key + i, n - i, decrypt);
+}
+
+__attribute__((target("avx2"))) static void avxEncrypt(char *out, const char *text, const char *key, size_t n) { avxKernel(out, text, key, n, 0); }
+__attribute__((target("avx2"))) static void avxDecrypt(char *out, const char *text, const char *key, size_t n) { avxKernel(out, text, key, n, 1); }
+
+__attribute__((target("avx2")))
+static void avxXor(char *out, const char *text, const char *key, size_t n)
+{
+	size_t i = 0, j;
+
+	// Four vectors per step keep enough loads in flight to run at memory speed
+	for (; i + 128 <= n; i += 128) {
+		for (j = 0; j < 128; j += 32) {
+			__m256i t = _mm256_loadu_si256((const __m256i *)(text + i + j));
+			__m256i k = _mm256_loadu_si256((const __m256i *)(key + i + j));
+
+			_mm256_storeu_si256((__m256i *)(out + i + j), _mm256_xor_si256(t, k));
+		}
+	}
+	sseXor(out + i, text + i, key + i, n - i);
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+uint32_t avxInvalid(__m256i data)
+{
+	__m256i letter = _mm256_andnot_si256(_mm256_cmpgt_epi8(data, _mm256_set1_epi8('Z')), _mm256_cmpgt_epi8(data, _mm256_set1_epi8('A' - 1)));
+
+	return ~(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(letter, _mm256_cmpeq_epi8(data, _mm256_set1_epi8(' '))));
+}
+
+__attribute__((target("avx2")))
+static size_t avxCheck(const char *data, size_t n)
+{
+	uint64_t invalid;
+	size_t i = 0;
+
+	for (; i + 64 <= n; i += 64) {
+		invalid = avxInvalid(_mm256_loadu_si256((const __m256i *)(data + i)));
+		invalid |= (uint64_t)avxInvalid(_mm256_loadu_si256((const __m256i *)(data + i + 32))) << 32;
+		if (invalid != 0) return i + __builtin_ctzll(invalid);
+	}
+	return i + sseCheck(data + i, n - i);
+}
+
+static int avxSupported(void) { __builtin_cpu_init(); return __builtin_cpu_supports("avx2"); }
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// dispatch
+
+static const struct otp_kernel kernels[] = {
+	{ "scalar", scalarSupported, scalarEncrypt, scalarDecrypt, scalarXor, scalarCheck },
+#ifdef OTP_CIPHER_X86
+	{ "sse4.1", sseSupported, sseEncrypt, sseDecrypt, sseXor, sseCheck },
+	{ "avx2", avxSupported, avxEncrypt, avxDecrypt, avxXor, avxCheck },
+#endif
+};
+
+static const struct otp_kernel *selected = &kernels[0];
+
+// Build the lookup table and pick a kernel before main() runs, so otp_cipher() never has to check
+__attribute__((constructor))
+static void selectKernel(void)
+{
+	const char *forced = getenv("OTP_CIPHER_KERNEL");
+	size_t i;
+
+	for (i = 0; i < 26; i++) symbolIndex['A' + i] = i;
+	symbolIndex[' '] = 26;
+	for (i = 0; i < 27; i++) symbolValid[(unsigned char)characterPool[i]] = 1;
+
+	// Take the last (fastest) supported kernel, unless a specific one was asked for
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (!kernels[i].supported()) continue;
+		if (forced != NULL && strcmp(forced, kernels[i].name) != 0) continue;
+		selected = &kernels[i];
+	}
+}
+
+void otp_cipher(int direction, char *out, const char *text, const char *key, size_t n)
+{
+	if (direction == OTP_DECRYPT) selected->decrypt(out, text, key, n);
+	else if (direction == OTP_XOR) selected->xor(out, text, key, n);
+	else selected->encrypt(out, text, key, n);
+}
+
+void otp_cipher_packed(int direction, unsigned char *text, const void *key, int packing, size_t n)
+{
+	char plainText[PACKED_BLOCK], plainKey[PACKED_BLOCK];
+	const char *k;
+	size_t i, m;
+
+	// A block at a time, so the unpacked symbols stay in cache; each block is packed back over itself
+	for (i = 0; i < n; i += m) {
+		m = n - i < PACKED_BLOCK ? n - i : PACKED_BLOCK;
+		otp_unpack(plainText, text + OTP_PACKED_OFFSET(i), m);
+		if (packing & OTP_PACKED_KEY) {
+			otp_unpack(plainKey, (const unsigned char *)key + OTP_PACKED_OFFSET(i), m);
+			k = plainKey;
+		}
+		else k = (const char *)key + i;
+		otp_cipher(direction, plainText, plainText, k, m);
+		otp_pack(text + OTP_PACKED_OFFSET(i), plainText, m);
+	}
+}
+
+size_t otp_check_symbols(const char *data, size_t n)
+{
+	return selected->check(data, n);
+}
+
+const char *otp_cipher_kernel_name(void)
+{
+	return selected->name;
+}
+
+const struct otp_kernel *otp_cipher_kernels(size_t *count)
+{
+	*count = sizeof(kernels) / sizeof(kernels[0]);
+	return kernels;
+}
@@ -0,0 +1,49 @@
+// Description: Shared mod 27 cipher kernel used by otp_enc_d and otp_dec_d.
+// Every symbol is one of 'A'..'Z' or ' ', which map to the indices 0..26. Encryption adds the key index to the
+// text index mod 27 and decryption subtracts it, then the result is mapped back to a symbol. Both directions are
+// built from the same kernel, with a scalar lookup table path and SSE4.1 / AVX2 paths that work on 32 symbols
+// per step. The fastest path the CPU supports is picked once at startup.
+// The kernels expect validated input (the clients reject anything outside the alphabet before sending it).
+// Binary mode (OTP_XOR) works on raw bytes instead: it XORs the text with the key, which both encrypts and decrypts.
+// Each kernel also has the alphabet check the clients run over their input before sending it.
+
+#ifndef OTP_CIPHER_H
+#define OTP_CIPHER_H
+
+#include <stddef.h>
+
+#define OTP_ENCRYPT 0
+#define OTP_DECRYPT 1
+#define OTP_XOR 2                           // binary mode, the same in both directions
+
+typedef void (*otp_kernel_fn)(char *out, const char *text, const char *key, size_t n);
+
+// One implementation of the kernel
+struct otp_kernel {
+	const char *name;                   // "scalar", "sse4.1" or "avx2"
+	int (*supported)(void);             // non-zero if this CPU can run it
+	otp_kernel_fn encrypt;
+	otp_kernel_fn decrypt;
+	otp_kernel_fn xor;
+	size_t (*check)(const char *data, size_t n);        // see otp_check_symbols()
+};
+
+// Cipher n symbols of text with key into out using the fastest available kernel.
+// direction is OTP_ENCRYPT, OTP_DECRYPT or OTP_XOR. out may be the same buffer as text.
+void otp_cipher(int direction, char *out, const char *text, const char *key, size_t n);
+
+// Cipher n symbols of the packed text (see otp_pack.h) in place. packing is OTP_PACKED_TEXT if key holds plain
+// symbols, or OTP_PACKED_TEXT | OTP_PACKED_KEY if it is packed as well.
+void otp_cipher_packed(int direction, unsigned char *text, const void *key, int packing, size_t n);
+
+// Number of bytes at the start of data that are symbols of the alphabet: the offset of the first byte that is not
+// one, or n if they all are
+size_t otp_check_symbols(const char *data, size_t n);
+
+// Name of the kernel otp_cipher() dispatches to
+const char *otp_cipher_kernel_name(void);
+
+// Every kernel compiled in, slowest first, so benchmarks and checks can call a specific one
+const struct otp_kernel *otp_cipher_kernels(size_t *count);
+
+#endif
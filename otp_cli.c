@@ -0,0 +1,253 @@
+// Description: Implementation of the command line shared by otp_enc and otp_dec, declared in otp_cli.h.
+// Sources: https://www.cs.bu.edu/teaching/c/file-io/intro/, Beej's Guide - http://beej.us/guide/bgnet/html/single/bgnet.html
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include "otp_cli.h"
+#include "otp_cipher.h"
+#include "otp_batch.h"
+#include "otp_padfile.h"
+
+#define CHECK_THREAD_MIN (1 << 20)          // a text this large is checked on its own thread, alongside the key
+
+static void error(const char *msg) { perror(msg); exit(1); }            // Error function used for reporting issues
+
+// A mapped file to check up to its terminating newline
+struct fileCheck {
+	const struct otp_mapping *file;
+	size_t length;                      // bytes before the first one that is not a capital letter or a space
+};
+
+// Find the first byte of the file that is not a capital letter or a space; the file is valid if that is its newline
+static void *checkFile(void *argument)
+{
+	struct fileCheck *check = argument;
+
+	check->length = otp_check_symbols(check->file->data, check->file->length);
+	return NULL;
+}
+
+// Return the number of symbols before the newline of a checked file.
+// Prints where the file went wrong and exits with 1 if it has a bad character (a file without a newline counts as one).
+static size_t checkedLength(const struct fileCheck *check, const char *what, const char *path)
+{
+	if (check->length == check->file->length) {
+		fprintf(stderr, "CLIENT: ERROR invalid character in the %s: %s does not end with a newline\n", what, path);
+		exit(1);
+	}
+	if (check->file->data[check->length] != '\n') {
+		fprintf(stderr, "CLIENT: ERROR invalid character in the %s: byte %zu of %s is 0x%02x\n", what, check->length, path,
+			(unsigned char)check->file->data[check->length]);
+		exit(1);
+	}
+	return check->length;
+}
+
+// Map the key named by argument: a key file, or a pad container (see otp_padfile.h) that may be followed by :OFFSET
+// to start that far into it. Returns 1 and opens pad if the key is a container, and 0 if it is a plain key file.
+// Prints an error and exits with 1 if the file cannot be opened or is a damaged container.
+static int mapKey(const char *argument, struct otp_mapping *file, struct otp_padfile *pad, uint64_t *offset)
+{
+	const char *colon = strrchr(argument, ':');
+	const char *reason;
+	char path[4096];
+
+	// PATH:OFFSET only counts as an offset if there is no file of that whole name
+	*offset = 0;
+	snprintf(path, sizeof(path), "%s", argument);
+	if (colon != NULL && colon[1] != '\0' && strspn(colon + 1, "0123456789") == strlen(colon + 1) && access(argument, F_OK) != 0) {
+		path[colon - argument] = '\0';
+		*offset = strtoull(colon + 1, NULL, 10);
+	}
+
+	// If we could not open the key file
+	if (otp_map_file(path, file) < 0) error("CLIENT: ERROR could not open the key file\n");
+	if (!otp_padfile_is_container(file->data, file->length)) {
+		if (*offset != 0) { fprintf(stderr, "CLIENT: ERROR key %s is not a pad container, so it cannot be used from an offset\n", path); exit(1); }
+		return 0;
+	}
+	if (otp_padfile_open(pad, file->data, file->length, &reason) < 0) { fprintf(stderr, "CLIENT: ERROR key %s: %s\n", path, reason); exit(1); }
+	return 1;
+}
+
+// Wait for a call, and exit with what went wrong if it failed: with 1 if the daemon refused the request or the
+// answer could not be written, and with 2 if the daemon at address could not be reached or would not serve us
+static void waitCall(struct otp_call *call, const char *name, const char *address)
+{
+	switch (otp_client_wait(call)) {
+	case OTP_CLIENT_OK: return;
+	case OTP_CLIENT_REFUSED: fprintf(stderr, "CLIENT: ERROR server refused the request: %s\n", call->reason); exit(1);
+	case OTP_CLIENT_UNREACHABLE: fprintf(stderr, "CLIENT: ERROR connecting on port %s\n", address); exit(2);
+	case OTP_CLIENT_WRONG_DAEMON: fprintf(stderr, "CLIENT: ERROR the server on port %s refused %s: %s\n", address, name, call->reason); exit(2);
+	case OTP_CLIENT_BUSY: fprintf(stderr, "CLIENT: ERROR the server on port %s is busy, giving up\n", address); exit(2);
+	case OTP_CLIENT_CLOSED: fprintf(stderr, "CLIENT: ERROR server closed the connection early on port %s\n", address); exit(2);
+	default: fprintf(stderr, "CLIENT: ERROR %s\n", call->reason); exit(1);
+	}
+}
+
+void otp_cli_open(struct otp_cli_run *run, const struct otp_cli *cli, int argc, char *argv[])
+{
+	memset(run, 0, sizeof(*run));
+	run->cli = cli;
+
+	// Batch mode takes a manifest of jobs instead of text and key files
+	if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+		const struct otp_batch_client batchClient = { cli->name, cli->tag, cli->textName };
+		int inflight = OTP_BATCH_INFLIGHT;
+		int result;
+
+		if (argc == 6 && strcmp(argv[3], "--inflight") == 0) inflight = atoi(argv[4]);
+		else if (argc != 4) inflight = 0;
+		if (inflight < 1 || inflight > OTP_BATCH_INFLIGHT_MAX) { fprintf(stderr, "CLIENT: ERROR usage: %s --batch manifest [--inflight N] port\n", cli->name); exit(2); }
+		result = otp_batch_run(argv[2], argv[argc - 1], inflight, &batchClient);
+		if (getenv("OTP_IO_STATS") != NULL) otp_print_io_counters(cli->name);
+		exit(result);
+	}
+
+	// --binary before the files switches to raw bytes: whole files, any byte value and no newline
+	run->binary = argc > 1 && strcmp(argv[1], "--binary") == 0;
+	if (run->binary) { argc--; argv++; }
+
+	// --compress before the files leaves the client to compress what it sends or expand what it gets back
+	run->compress = argc > 1 && strcmp(argv[1], "--compress") == 0;
+	if (run->compress) { argc--; argv++; }
+	if (run->compress && run->binary) { fprintf(stderr, "CLIENT: ERROR --compress works on symbols, so it cannot go with --binary\n"); exit(2); }
+
+	// If there are not enough arguments (text and key files come in pairs, then the port)
+	if (argc < 4 || argc % 2 != 0) { fprintf(stderr, "CLIENT: ERROR not enough arguments"); exit(2); }
+	run->pairs = argv + 1;
+	run->count = (argc - 2) / 2;
+	run->address = argv[argc - 1];
+	run->local = strcmp(run->address, "--local") == 0;
+	run->calls = calloc(run->count, sizeof(*run->calls));
+	run->files = malloc(2 * run->count * sizeof(*run->files));
+	if (run->calls == NULL || run->files == NULL) error("CLIENT: ERROR out of memory\n");
+}
+
+void otp_cli_check(struct otp_cli_run *run, void (*prepare)(struct otp_call *call))
+{
+	const struct otp_cli *cli = run->cli;
+	struct otp_mapping *files = run->files;
+	struct otp_call *call;
+	const char *text, *keyName, *key, *reason;
+	size_t textLength, keyLength, r;
+	int padKey;                         // the key names a pad the server holds
+	int containerKey;                   // the key is a pad container
+	struct otp_padfile container;
+	uint64_t keyOffset;                 // where in the container the key starts
+	struct fileCheck textCheck, keyCheck;
+	pthread_t textThread;
+	int threaded;                       // textCheck runs on textThread
+
+	// Check every pair before connecting so bad input never reaches the server
+	for (r = 0; r < run->count; r++) {
+		call = &run->calls[r];
+		text = run->pairs[2 * r];
+		keyName = run->pairs[2 * r + 1];
+
+		// Map the text file
+		// If we could not open the text file
+		if (otp_map_file(text, &files[2 * r]) < 0) error("CLIENT: ERROR could not open plain text file\n");
+
+		// A key of the form @ID:OFFSET refers to a pad the server holds, so there is nothing to read or check here
+		padKey = keyName[0] == '@' && strchr(keyName, ':') != NULL;
+		if (padKey) {
+			if (run->binary) { fprintf(stderr, "CLIENT: ERROR key %s names a pad held by %s, which --binary cannot use\n", keyName, cli->daemon); exit(1); }
+			if (run->local) { fprintf(stderr, "CLIENT: ERROR key %s names a pad held by %s, which --local cannot use\n", keyName, cli->daemon); exit(1); }
+			if (strchr(run->address, ',') != NULL) { fprintf(stderr, "CLIENT: ERROR key %s names a pad held by one %s, which a list of daemons cannot use\n", keyName, cli->daemon); exit(1); }
+			call->padId = strtoul(keyName + 1, NULL, 10);
+			call->padOffset = strtoull(strchr(keyName, ':') + 1, NULL, 10);
+			files[2 * r + 1].data = NULL;
+			files[2 * r + 1].length = 0;
+			files[2 * r + 1].mapped = 0;
+		}
+		// Map the key file
+		containerKey = !padKey && mapKey(keyName, &files[2 * r + 1], &container, &keyOffset);
+
+		// Make sure the text and the key only hold valid characters up to their terminating newlines (binary ones are
+		// taken whole). A large text is checked on a thread of its own while this one checks the key.
+		textCheck.file = &files[2 * r];
+		keyCheck.file = &files[2 * r + 1];
+		keyCheck.length = 0;                // a pad or a container has its length found below
+		if (run->binary) {
+			textCheck.length = textCheck.file->length;
+			keyCheck.length = keyCheck.file->length;
+		}
+		else {
+			threaded = !padKey && !containerKey && textCheck.file->length >= CHECK_THREAD_MIN && pthread_create(&textThread, NULL, checkFile, &textCheck) == 0;
+			if (!threaded) checkFile(&textCheck);
+			if (!padKey && !containerKey) checkFile(&keyCheck);
+			if (threaded) pthread_join(textThread, NULL);
+			textCheck.length = checkedLength(&textCheck, cli->textName, text);
+			if (!padKey && !containerKey) keyCheck.length = checkedLength(&keyCheck, "key", keyName);
+		}
+		call->text = files[2 * r].data;
+		call->textLength = textCheck.length;
+		keyLength = keyCheck.length;
+		key = files[2 * r + 1].data;
+
+		// The client may cipher something else in place of the text (otp_enc --compress), so the key only has to cover that
+		if (prepare != NULL) prepare(call);
+		textLength = call->textLength;
+
+		// A container has no newline to look for: check the checksums, and the characters, of just the part in use
+		if (containerKey) {
+			if (container.alphabet != (run->binary ? OTP_PADFILE_BYTES : OTP_PADFILE_SYMBOLS)) {
+				fprintf(stderr, "CLIENT: ERROR key %s is a %s pad\n", keyName, run->binary ? "symbol" : "binary");
+				exit(1);
+			}
+			keyLength = keyOffset < container.length ? container.length - keyOffset : 0;
+			if (textLength <= keyLength) {
+				key = otp_padfile_symbols(&container, keyOffset, textLength, &reason);
+				if (key == NULL) { fprintf(stderr, "CLIENT: ERROR key %s: %s\n", keyName, reason); exit(1); }
+			}
+			otp_padfile_close(&container);
+		}
+
+		// Check to make sure the key length is not shorter than the text length
+		if (!padKey && textLength > keyLength) {
+			fprintf(stderr, "CLIENT: ERROR key too short \n");
+			exit(1);
+		}
+		call->key = key;
+	}
+}
+
+void otp_cli_transfer(struct otp_cli_run *run, int outFD)
+{
+	struct otp_client_options options;
+	struct otp_client *client;
+	size_t r;
+
+	// Hand the requests to libotpclient, with one connection to the daemon on the port (over loopback TCP) or the Unix
+	// socket path given last, or none with --local. The hello that goes out with the first chunk asks for the
+	// client's own daemon, and any other daemon (or one that cannot serve us) refuses it before it touches a symbol; a
+	// daemon that is full is tried again after a growing wait. The answers are written to outFD in order, as they come back.
+	otp_fast_open = getenv("OTP_FASTOPEN") != NULL;
+	options.address = run->local ? NULL : run->address;
+	options.direction = run->cli->direction;
+	options.connections = 1;
+	options.flags = OTP_CLIENT_CHECKED | OTP_CLIENT_ABANDON | (run->binary ? OTP_CLIENT_BINARY : 0) | (getenv("OTP_PACKED") != NULL ? OTP_CLIENT_PACKED : 0);
+	client = otp_client_open(&options);
+	if (client == NULL) error("CLIENT: ERROR starting the client\n");
+	for (r = 0; r < run->count; r++) run->calls[r].outFD = outFD;
+	otp_client_submit(client, run->calls, run->count);
+	for (r = 0; r < run->count; r++) waitCall(&run->calls[r], run->cli->name, run->address);
+	otp_client_close(client);
+}
+
+void otp_cli_close(struct otp_cli_run *run)
+{
+	size_t r;
+
+	// Report what the transfer cost if asked to
+	if (getenv("OTP_IO_STATS") != NULL) otp_print_io_counters(run->cli->name);
+
+	// Unmap the files
+	for (r = 0; r < 2 * run->count; r++) otp_unmap_file(&run->files[r]);
+	free(run->files);
+	free(run->calls);
+}
@@ -0,0 +1,55 @@
+// Description: The command line otp_enc and otp_dec have in common:
+// otp_enc [--binary | --compress] text key [text key ...] port, or otp_enc --batch manifest [--inflight N] port
+// (and the same for otp_dec). otp_cli_open() reads the arguments, and runs batch mode (see otp_batch.h) if that
+// is what they ask for. otp_cli_check() maps every text/key pair and checks it before anything is sent, so bad
+// input never reaches a daemon. otp_cli_transfer() hands the requests to libotpclient (see otp_client.h) and turns
+// what went wrong into messages and exit values, and otp_cli_close() reports and cleans up. The clients only add
+// their own --compress step: otp_enc compresses each text once it is checked, and otp_dec expands the answers.
+
+#ifndef OTP_CLI_H
+#define OTP_CLI_H
+
+#include <stddef.h>
+#include "otp_protocol.h"
+#include "otp_client.h"
+
+// The client running the command line
+struct otp_cli {
+	const char *name;                   // "otp_enc" or "otp_dec", for messages
+	const char *daemon;                 // "otp_enc_d" or "otp_dec_d", for messages
+	const char *textName;               // "plaintext" or "ciphertext", for messages
+	int direction;                      // OTP_ENCRYPT or OTP_DECRYPT
+	char tag;                           // tag of the daemon its hello asks for, for batch mode
+};
+
+// One run of a client over the text/key pairs of its command line
+struct otp_cli_run {
+	const struct otp_cli *cli;
+	char **pairs;                       // the text/key pairs: pairs[2 * r] is a text and pairs[2 * r + 1] its key
+	const char *address;                // the last argument: a port, a path, a list of daemons, or --local
+	int local;                          // cipher in-process instead of asking the daemon
+	int binary;                         // raw bytes instead of symbols
+	int compress;                       // --compress was given; what it means is up to the client
+	struct otp_call *calls;             // one per text/key pair
+	size_t count;
+	struct otp_mapping *files;          // text and key file of every pair, mapped into memory
+};
+
+// Read the command line into run. Runs batch mode and exits with its status if it is asked for, and exits with 2
+// if the command line is wrong.
+void otp_cli_open(struct otp_cli_run *run, const struct otp_cli *cli, int argc, char *argv[]);
+
+// Map and check every text/key pair and fill in its call. If prepare is not NULL, it is called with every call
+// once its text is checked and may replace the text (and its length) with what is to be ciphered instead; the key
+// then only has to cover that. Prints why and exits with 1 if any pair is unusable.
+void otp_cli_check(struct otp_cli_run *run, void (*prepare)(struct otp_call *call));
+
+// Cipher every call, writing the answers to outFD in order, and wait for all of them. Exits with 1 if the daemon
+// refused a request or an answer could not be written, and with 2 if the daemon could not be reached or would not
+// serve us.
+void otp_cli_transfer(struct otp_cli_run *run, int outFD);
+
+// Print what the transfer cost if OTP_IO_STATS is set, then unmap the files and free the calls
+void otp_cli_close(struct otp_cli_run *run);
+
+#endif
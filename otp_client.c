@@ -0,0 +1,527 @@
+// Description: Implementation of libotpclient, declared in otp_client.h.
+// All of a client's state is guarded by one mutex: the queue of calls, the flags, and whether each call without a
+// done() callback has finished. Each connection thread holds the lock only to take calls off the queue and to
+// finish them. While it streams a batch, it owns those calls, its socket and the buffers of its otp_stream, so
+// any number of connections transfer at the same time.
+// The calls of a batch become the requests of one otp_stream_run(), with their index in the batch as the id.
+// Answers go straight into each call's output (or its file descriptor), and a call finishes as soon as its END
+// frame is in, while the later calls of the batch are still under way. When the transfer stops early, the calls
+// that finished are skipped and the rest are sent again on a new connection, failed, or (after BUSY) kept until
+// the backoff is over and, if the daemon still turns them away, handed to the other connections.
+// With a list of daemons, a connection keeps a socket to each daemon it has used, and every batch goes to the one
+// otp_balance_pick() chooses. A batch that cannot reach its daemon, or loses it halfway, fails over to another.
+// Sources: pthread_cond_wait(3p), https://en.wikipedia.org/wiki/Futures_and_promises
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "otp_cipher.h"
+#include "otp_local.h"
+#include "otp_balance.h"
+#include "otp_client.h"
+
+// One connection of the pool and the thread that runs it
+struct connection {
+	struct otp_client *client;
+	pthread_t thread;
+	int *sockets;                       // to each daemon of the list: -1 until opened, and after it fails
+	struct otp_stream stream;
+	struct otp_call **calls;            // the batch being transferred
+	size_t filled;                      // bytes of the oldest unfinished call's answer taken so far
+	int received;                       // some answer has come back on this transfer
+	int outputError;                    // errno of a failed write to a call's outFD, or 0
+	int retired;                        // the daemon kept turning it away, so its thread has stopped
+};
+
+struct otp_client {
+	char *address;                      // the daemon or list of daemons, or NULL in local mode
+	struct otp_balancer balancer;       // over the daemons of the list
+	char tag;                           // of the daemon the hello asks for
+	int direction;                      // for local mode: OTP_ENCRYPT, OTP_DECRYPT or OTP_XOR
+	int flags;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;              // calls were queued, or the client is closing
+	pthread_cond_t finished;            // a call without done() finished
+	struct otp_call *first, *last;      // calls waiting for a connection
+	size_t waiting;
+	int closing;
+	int abandoned;                      // with OTP_CLIENT_ABANDON: a call has failed
+	struct connection *connections;
+	int connectionCount;
+	int retired;                        // connections that have retired
+};
+
+//////////////////////////////////////////////////////////////////////
+// calls
+
+// Finish a call with status and, unless it is NULL, reason. The call must not be touched after this.
+static void complete(struct otp_call *call, int status, const char *reason)
+{
+	struct otp_client *client = call->client;
+	void (*done)(struct otp_call *) = call->done;
+
+	call->status = status;
+	if (reason != NULL) snprintf(call->reason, sizeof(call->reason), "%s", reason);
+	pthread_mutex_lock(&client->lock);
+	if (status != OTP_CLIENT_OK && client->flags & OTP_CLIENT_ABANDON) client->abandoned = 1;
+	if (done == NULL) {
+		call->finished = 1;
+		pthread_cond_broadcast(&client->finished);
+	}
+	pthread_mutex_unlock(&client->lock);
+	if (done != NULL) done(call);
+}
+
+static void completeAll(struct otp_call **calls, size_t count, int status, const char *reason)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) complete(calls[i], status, reason);
+}
+
+static int isAbandoned(struct otp_client *client)
+{
+	int abandoned;
+
+	pthread_mutex_lock(&client->lock);
+	abandoned = client->abandoned;
+	pthread_mutex_unlock(&client->lock);
+	return abandoned;
+}
+
+// Check what can be checked before a call is sent. Returns 0 if it can go, and -1 with its reason set if not.
+static int checkCall(struct otp_client *client, struct otp_call *call)
+{
+	size_t bad;
+
+	if (call->key == NULL && client->address == NULL) {
+		snprintf(call->reason, sizeof(call->reason), "pad %u is held by a daemon, which local mode cannot use", call->padId);
+		return -1;
+	}
+	if (call->key == NULL && client->flags & OTP_CLIENT_BINARY) {
+		snprintf(call->reason, sizeof(call->reason), "pad %u is held by a daemon, which binary mode cannot use", call->padId);
+		return -1;
+	}
+
+	// Each daemon keeps its own record of the pad ranges it used, so spreading a pad over several could reuse it
+	if (call->key == NULL && client->balancer.count > 1) {
+		snprintf(call->reason, sizeof(call->reason), "pad %u is held by one daemon, which a list of daemons cannot use", call->padId);
+		return -1;
+	}
+	if (client->flags & (OTP_CLIENT_CHECKED | OTP_CLIENT_BINARY)) return 0;
+
+	// Only the alphabet can be checked; a key has to be at least as long as the text
+	bad = otp_check_symbols(call->text, call->textLength);
+	if (bad < call->textLength) {
+		snprintf(call->reason, sizeof(call->reason), "invalid character in the text: byte %zu is 0x%02x", bad, (unsigned char)call->text[bad]);
+		return -1;
+	}
+	bad = call->key != NULL ? otp_check_symbols(call->key, call->textLength) : call->textLength;
+	if (bad < call->textLength) {
+		snprintf(call->reason, sizeof(call->reason), "invalid character in the key: byte %zu is 0x%02x", bad, (unsigned char)call->key[bad]);
+		return -1;
+	}
+	return 0;
+}
+
+// Cipher a call in this thread, for a local client
+static void cipherLocally(struct otp_client *client, struct otp_call *call)
+{
+	struct otp_request request;
+	char reason[OTP_REASON_MAX + 1];
+	int result;
+
+	if (call->out != NULL) {
+		otp_cipher(client->direction, call->out, call->text, call->key, call->textLength);
+		complete(call, OTP_CLIENT_OK, NULL);
+		return;
+	}
+
+	// otp_local_requests() writes through a buffer of its own, so only one thread at a time may use it
+	memset(&request, 0, sizeof(request));
+	request.text = call->text;
+	request.key = call->key;
+	request.textLength = call->textLength;
+	pthread_mutex_lock(&client->lock);
+	result = otp_local_requests(client->direction, &request, 1, call->outFD);
+	if (result < 0) snprintf(reason, sizeof(reason), "writing the result: %s", strerror(errno));
+	pthread_mutex_unlock(&client->lock);
+	complete(call, result < 0 ? OTP_CLIENT_FAILED : OTP_CLIENT_OK, result < 0 ? reason : NULL);
+}
+
+//////////////////////////////////////////////////////////////////////
+// connections
+
+// otp_stream_run() hands each piece of an answer to the call it belongs to
+static int takeAnswer(struct otp_stream *stream, size_t request, const char *symbols, size_t n)
+{
+	struct connection *c = stream->context;
+	struct otp_call *call = c->calls[request];
+	size_t total = 0;
+	ssize_t nb;
+
+	c->received = 1;
+	if (call->out != NULL) {
+		// An answer longer than its request would run past the caller's buffer
+		if (n > call->textLength - c->filled) {
+			errno = EPROTO;
+			return -1;
+		}
+		memcpy(call->out + c->filled, symbols, n);
+		c->stream.io.bytesCopied += n;
+		c->filled += n;
+		return 0;
+	}
+	while (total < n) {
+		nb = write(call->outFD, symbols + total, n - total);
+		c->stream.io.syscalls++;
+		if (nb < 0 && errno == EINTR) continue;
+		if (nb < 0) {
+			c->outputError = errno;
+			return -1;
+		}
+		total += nb;
+	}
+	c->filled += n;
+	return 0;
+}
+
+static int finishAnswer(struct otp_stream *stream, size_t request)
+{
+	struct connection *c = stream->context;
+	struct otp_call *call = c->calls[request];
+
+	c->received = 1;
+	if (call->out != NULL && c->filled != call->textLength) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (call->out == NULL && !stream->binary) {
+		if (takeAnswer(stream, request, "\n", 1) < 0) return -1;
+	}
+	c->filled = 0;
+	complete(call, OTP_CLIENT_OK, NULL);
+	return 0;
+}
+
+// Hand the calls of a connection the daemon keeps turning away back to the queue, ahead of the others, and retire
+// it, so the pool shrinks to as many connections as the daemon admits. Returns 0 if it is the last one left.
+static int retire(struct connection *c, struct otp_call **calls, size_t count)
+{
+	struct otp_client *client = c->client;
+	size_t i;
+
+	pthread_mutex_lock(&client->lock);
+	if (client->connectionCount - client->retired == 1) {
+		pthread_mutex_unlock(&client->lock);
+		return 0;
+	}
+	for (i = count; i-- > 0; ) {
+		calls[i]->next = client->first;
+		client->first = calls[i];
+		if (client->last == NULL) client->last = calls[i];
+	}
+	client->waiting += count;
+	client->retired++;
+	c->retired = 1;
+	pthread_cond_broadcast(&client->queued);
+	pthread_mutex_unlock(&client->lock);
+	return 1;
+}
+
+// Transfer a batch of calls, connecting and reconnecting as needed, until every one of them has finished
+static void transfer(struct connection *c, struct otp_call **calls, size_t count)
+{
+	struct otp_client *client = c->client;
+	struct otp_balancer *balancer = &client->balancer;
+	struct otp_request requests[OTP_CLIENT_PIPELINE];
+	char reason[OTP_REASON_MAX + 1];
+	unsigned busyAttempts = 0;          // BUSY answers to this batch so far
+	size_t failovers = 0;               // daemons this batch has left because they failed it
+	int resent = 0;                     // the batch already went out again after a pooled connection failed
+	int fresh, result;
+	unsigned wait;
+	size_t i, e;
+
+	while (count > 0) {
+		if (isAbandoned(client)) {
+			completeAll(calls, count, OTP_CLIENT_ABANDONED, "an earlier call failed");
+			return;
+		}
+
+		// When every daemon is busy, the one that comes free first is waited for
+		e = otp_balance_pick(balancer, count, &wait);
+		if (wait > 0) usleep(1000 * wait);
+
+		// A new connection opens with the hello; making it is the daemon's health check
+		fresh = c->sockets[e] < 0;
+		if (fresh) {
+			c->sockets[e] = otp_connect(balancer->endpoints[e].address);
+			if (c->sockets[e] < 0) {
+				snprintf(reason, sizeof(reason), "could not connect to %.200s: %s", balancer->endpoints[e].address, strerror(errno));
+				otp_balance_release(balancer, e, count);
+				otp_balance_failed(balancer, e);
+				if (++failovers < balancer->count) continue;
+				completeAll(calls, count, OTP_CLIENT_UNREACHABLE, reason);
+				return;
+			}
+			otp_balance_succeeded(balancer, e);
+		}
+
+		memset(requests, 0, count * sizeof(*requests));
+		for (i = 0; i < count; i++) {
+			requests[i].id = i + 1;     // 0 is OTP_HELLO_ID
+			requests[i].text = calls[i]->text;
+			requests[i].key = calls[i]->key;
+			requests[i].textLength = calls[i]->textLength;
+			requests[i].padId = calls[i]->padId;
+			requests[i].padOffset = calls[i]->padOffset;
+		}
+		c->calls = calls;
+		c->filled = 0;
+		c->received = 0;
+		c->outputError = 0;
+		result = otp_stream_run(c->sockets[e], fresh ? client->tag : 0, requests, count, &c->stream);
+		otp_balance_release(balancer, e, count);
+		if (result == 0) return;
+		if (result < 0) snprintf(reason, sizeof(reason), "transfer failed: %s", strerror(errno));
+
+		// Whatever went wrong, the connection is of no use any more; the calls that finished are done with
+		close(c->sockets[e]);
+		c->sockets[e] = -1;
+		calls += c->stream.answered;
+		count -= c->stream.answered;
+
+		if (c->outputError != 0) {
+			snprintf(reason, sizeof(reason), "writing the result: %s", strerror(c->outputError));
+			complete(calls[0], OTP_CLIENT_FAILED, reason);
+			calls++;
+			count--;
+		}
+		else if (result == 4) {
+			// Nothing was ciphered: leave the daemon alone a little longer every time and start over, on
+			// another daemon if one is free
+			if (busyAttempts == OTP_BUSY_RETRIES * balancer->count) {
+				if (retire(c, calls, count)) return;
+				snprintf(reason, sizeof(reason), "the daemon on %s is busy", client->address);
+				completeAll(calls, count, OTP_CLIENT_BUSY, reason);
+				return;
+			}
+			otp_balance_busy(balancer, e, otp_busy_backoff(busyAttempts++ / balancer->count, c->stream.busyHint));
+		}
+		else if (result == 3) {
+			completeAll(calls, count, OTP_CLIENT_WRONG_DAEMON, c->stream.reason);
+			return;
+		}
+		else if (result == 2) {
+			complete(calls[0], OTP_CLIENT_REFUSED, c->stream.reason);
+			calls++;
+			count--;
+		}
+		else if (!fresh && !c->received && !resent) {
+			// The daemon most likely hung up on the pooled connection while it sat idle; try once on a new one
+			resent = 1;
+		}
+		else {
+			if (result == 1) snprintf(reason, sizeof(reason), "the daemon on %.200s closed the connection early", balancer->endpoints[e].address);
+			otp_balance_failed(balancer, e);
+
+			// Part of an answer that went to a file descriptor cannot be taken back, so that call cannot fail over
+			if (c->filled > 0 && calls[0]->out == NULL) {
+				complete(calls[0], result == 1 ? OTP_CLIENT_CLOSED : OTP_CLIENT_FAILED, reason);
+				calls++;
+				count--;
+			}
+			if (++failovers < balancer->count) continue;
+			completeAll(calls, count, result == 1 ? OTP_CLIENT_CLOSED : OTP_CLIENT_FAILED, reason);
+			return;
+		}
+	}
+}
+
+// Take a fair share of the waiting calls and transfer them, until the client closes and the queue is empty
+static void *runConnection(void *argument)
+{
+	struct connection *c = argument;
+	struct otp_client *client = c->client;
+	struct otp_call *calls[OTP_CLIENT_PIPELINE];
+	size_t count, share, i;
+
+	for (;;) {
+		pthread_mutex_lock(&client->lock);
+		while (client->first == NULL && !client->closing) pthread_cond_wait(&client->queued, &client->lock);
+		if (client->first == NULL) {
+			pthread_mutex_unlock(&client->lock);
+			break;
+		}
+
+		// Leave some for the other connections, so a burst of calls is spread over all of them
+		share = (client->waiting + client->connectionCount - client->retired - 1) / (client->connectionCount - client->retired);
+		if (share > OTP_CLIENT_PIPELINE) share = OTP_CLIENT_PIPELINE;
+		for (count = 0; count < share; count++) {
+			calls[count] = client->first;
+			client->first = client->first->next;
+		}
+		if (client->first == NULL) client->last = NULL;
+		client->waiting -= count;
+		pthread_mutex_unlock(&client->lock);
+
+		transfer(c, calls, count);
+		if (c->retired) break;
+	}
+	for (i = 0; i < client->balancer.count; i++) {
+		if (c->sockets[i] >= 0) close(c->sockets[i]);
+	}
+	return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// interface
+
+// Stop and free the first started connections of a client, and the client
+static void freeClient(struct otp_client *client, int started)
+{
+	int i;
+
+	pthread_mutex_lock(&client->lock);
+	client->closing = 1;
+	pthread_cond_broadcast(&client->queued);
+	pthread_mutex_unlock(&client->lock);
+	for (i = 0; i < started; i++) pthread_join(client->connections[i].thread, NULL);
+	for (i = 0; i < client->connectionCount; i++) {
+		otp_add_io_counters(&client->connections[i].stream.io);
+		free(client->connections[i].stream.buffers);
+		free(client->connections[i].sockets);
+	}
+	if (client->balancer.endpoints != NULL) otp_balance_free(&client->balancer);
+	pthread_mutex_destroy(&client->lock);
+	pthread_cond_destroy(&client->queued);
+	pthread_cond_destroy(&client->finished);
+	free(client->connections);
+	free(client->address);
+	free(client);
+}
+
+struct otp_client *otp_client_open(const struct otp_client_options *options)
+{
+	struct otp_client *client;
+	struct connection *c;
+	int connections = options->connections > 0 ? options->connections : OTP_CLIENT_CONNECTIONS;
+	int i, error;
+	size_t k;
+
+	if ((options->direction != OTP_ENCRYPT && options->direction != OTP_DECRYPT) || connections > OTP_CLIENT_CONNECTIONS_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	client = calloc(1, sizeof(*client));
+	if (client == NULL) return NULL;
+	client->tag = options->direction == OTP_ENCRYPT ? 't' : 'p';
+	client->direction = options->flags & OTP_CLIENT_BINARY ? OTP_XOR : options->direction;
+	client->flags = options->flags;
+	pthread_mutex_init(&client->lock, NULL);
+	pthread_cond_init(&client->queued, NULL);
+	pthread_cond_init(&client->finished, NULL);
+	if (options->address == NULL) return client;
+
+	// Every connection gets its own stream buffers, so they can all transfer at once
+	client->address = strdup(options->address);
+	client->connections = calloc(connections, sizeof(*client->connections));
+	if (client->address == NULL || client->connections == NULL) {
+		freeClient(client, 0);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (otp_balance_init(&client->balancer, options->address) < 0) {
+		error = errno;
+		freeClient(client, 0);
+		errno = error;
+		return NULL;
+	}
+	client->connectionCount = connections;
+	for (i = 0; i < connections; i++) {
+		c = &client->connections[i];
+		c->client = client;
+		c->sockets = malloc(client->balancer.count * sizeof(*c->sockets));
+		if (c->sockets == NULL) {
+			freeClient(client, i);
+			errno = ENOMEM;
+			return NULL;
+		}
+		for (k = 0; k < client->balancer.count; k++) c->sockets[k] = -1;
+		c->stream.pack = (options->flags & OTP_CLIENT_PACKED) != 0;
+		c->stream.binary = (options->flags & OTP_CLIENT_BINARY) != 0;
+		c->stream.answer = takeAnswer;
+		c->stream.end = finishAnswer;
+		c->stream.context = c;
+		c->stream.buffers = malloc(OTP_STREAM_BUFFERS);
+		error = c->stream.buffers == NULL ? ENOMEM : pthread_create(&c->thread, NULL, runConnection, c);
+		if (error != 0) {
+			freeClient(client, i);
+			errno = error;
+			return NULL;
+		}
+	}
+	return client;
+}
+
+void otp_client_close(struct otp_client *client)
+{
+	// The connection threads work through the queue before they see the client is closing
+	freeClient(client, client->connectionCount);
+}
+
+void otp_client_submit(struct otp_client *client, struct otp_call *calls, size_t count)
+{
+	struct otp_call *first = NULL, *last = NULL;
+	size_t i, queued = 0;
+
+	for (i = 0; i < count; i++) {
+		struct otp_call *call = &calls[i];
+
+		call->client = client;
+		call->next = NULL;
+		call->finished = 0;
+		call->reason[0] = '\0';
+		if (checkCall(client, call) < 0) complete(call, OTP_CLIENT_INVALID, NULL);
+		else if (client->address == NULL && isAbandoned(client)) complete(call, OTP_CLIENT_ABANDONED, "an earlier call failed");
+		else if (client->address == NULL) cipherLocally(client, call);
+		else {
+			if (last == NULL) first = call;
+			else last->next = call;
+			last = call;
+			queued++;
+		}
+	}
+	if (queued == 0) return;
+
+	// Queue them all at once, so calls submitted together go out in order and, when they fit, together
+	pthread_mutex_lock(&client->lock);
+	if (client->last == NULL) client->first = first;
+	else client->last->next = first;
+	client->last = last;
+	client->waiting += queued;
+	if (queued > 1) pthread_cond_broadcast(&client->queued);
+	else pthread_cond_signal(&client->queued);
+	pthread_mutex_unlock(&client->lock);
+}
+
+int otp_client_wait(struct otp_call *call)
+{
+	struct otp_client *client = call->client;
+
+	pthread_mutex_lock(&client->lock);
+	while (!call->finished) pthread_cond_wait(&client->finished, &client->lock);
+	pthread_mutex_unlock(&client->lock);
+	return call->status;
+}
+
+int otp_client_cipher(struct otp_client *client, struct otp_call *call)
+{
+	call->done = NULL;
+	otp_client_submit(client, call, 1);
+	return otp_client_wait(call);
+}
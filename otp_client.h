@@ -0,0 +1,99 @@
+// Description: libotpclient, the client side of otp_enc/otp_dec as a library, for programs that cipher many
+// messages from one long-lived process instead of running a client (and opening a connection) for each.
+// A client is opened for one daemon, for a list of interchangeable daemons it balances the calls over (see
+// otp_balance.h), or for none: in local mode it ciphers in-process with the daemons' kernel.
+// It keeps a pool of connections to the daemon, each opened when it is first needed and kept open between calls.
+// A call ciphers one text held in memory with a key held in memory (or with a pad the daemon holds), and puts the
+// result in memory or writes it to a file descriptor the way the CLIs write to stdout.
+// Calls wait in a queue. Every connection has a thread that takes its share of the waiting calls, up to
+// OTP_CLIENT_PIPELINE of them, and pipelines them over its connection (see otp_stream_run()), so small calls made
+// at the same time share round trips.
+// otp_client_cipher() makes a call and waits for it. otp_client_submit() queues calls and returns at once; each call
+// is then a future that otp_client_wait() waits on, or, if it has a done() callback, the connection thread hands
+// it back through that as soon as it completes.
+// A daemon that answers BUSY is tried again after otp_busy_backoff(), like the CLIs do, and a connection that is
+// still turned away after OTP_BUSY_RETRIES more tries leaves its calls to the others and retires, so the pool
+// shrinks to what the daemon admits. A pooled connection the daemon hung up on while it sat idle (see --deadline) is
+// opened again, and its calls sent again.
+// otp_enc and otp_dec are built on it. See README for building libotpclient.a; programs link it with -pthread.
+
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "otp_protocol.h"
+#include "otp_cipher.h"
+
+#define OTP_CLIENT_CONNECTIONS 4            // connections in the pool, unless the options say otherwise
+#define OTP_CLIENT_CONNECTIONS_MAX 256
+#define OTP_CLIENT_PIPELINE 256             // most calls one connection sends before it waits for their answers
+
+// Options flags
+#define OTP_CLIENT_BINARY 1                 // texts and keys are raw bytes, XORed (see binary mode in otp_protocol.h)
+#define OTP_CLIENT_PACKED 2                 // send symbols packed (see otp_pack.h)
+#define OTP_CLIENT_CHECKED 4                // the caller has checked every text and key, so calls skip the check
+#define OTP_CLIENT_ABANDON 8                // once a call fails, fail every call after it instead of sending it
+
+// Call statuses
+#define OTP_CLIENT_OK 0
+#define OTP_CLIENT_INVALID 1                // the text or key holds a byte outside the alphabet, or the key is unusable
+#define OTP_CLIENT_REFUSED 2                // the daemon refused the request
+#define OTP_CLIENT_UNREACHABLE 3            // no connection could be made to the daemon (to any of the list)
+#define OTP_CLIENT_WRONG_DAEMON 4           // the daemon refused the hello: it is not the daemon asked for
+#define OTP_CLIENT_BUSY 5                   // the daemon was still busy after OTP_BUSY_RETRIES more tries
+#define OTP_CLIENT_CLOSED 6                 // the daemon closed the connection before answering (every one tried)
+#define OTP_CLIENT_FAILED 7                 // a system call failed, or the daemon broke the protocol
+#define OTP_CLIENT_ABANDONED 8              // not sent because an earlier call failed (OTP_CLIENT_ABANDON)
+
+struct otp_client_options {
+	const char *address;                // the daemon (port, HOST:PORT or Unix socket path), several separated by
+	                                    // commas, or NULL for local mode
+	int direction;                      // OTP_ENCRYPT (otp_enc_d) or OTP_DECRYPT (otp_dec_d)
+	int connections;                    // 0 for OTP_CLIENT_CONNECTIONS
+	int flags;
+};
+
+struct otp_client;
+
+// One request. The caller fills in the first part and keeps the call, its text and key and its output in place
+// until it completes.
+struct otp_call {
+	const char *text;
+	size_t textLength;                  // symbols (bytes, in binary mode) of the text
+	const char *key;                    // textLength key symbols, or NULL to use the daemon's pad
+	uint32_t padId;                     // pad and offset to cipher with when key is NULL
+	uint64_t padOffset;
+	char *out;                          // room for textLength symbols, or NULL to write the result to outFD
+	int outFD;                          // written like the CLIs write stdout: a newline follows, unless binary
+	void (*done)(struct otp_call *call);        // if set, called once the call completes, and it may free the call
+	void *context;                      // for done()
+
+	// Filled in when the call completes
+	int status;
+	char reason[OTP_REASON_MAX + 1];    // what went wrong, when status is not OTP_CLIENT_OK
+
+	// Private
+	struct otp_client *client;
+	struct otp_call *next;
+	int finished;
+};
+
+// Start a client. Connections are opened as calls need them. Returns NULL with errno set if memory or threads
+// run out, or the options are not valid.
+struct otp_client *otp_client_open(const struct otp_client_options *options);
+
+// Finish every call that has been submitted, then close the connections and free the client
+void otp_client_close(struct otp_client *client);
+
+// Queue count calls, in order. A call that fails its checks, and every call of a local client, completes before
+// this returns, so done() may run on this thread.
+void otp_client_submit(struct otp_client *client, struct otp_call *calls, size_t count);
+
+// Wait until a call without a done() callback completes, and return its status
+int otp_client_wait(struct otp_call *call);
+
+// Submit one call, wait for it and return its status
+int otp_client_cipher(struct otp_client *client, struct otp_call *call);
+
+#endif
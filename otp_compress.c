@@ -0,0 +1,184 @@
+// Description: Implementation of the plaintext compression declared in otp_compress.h.
+// The coder keeps a state x in [L, 27 L). Encoding a symbol of frequency f and cumulative frequency c (out of
+// SCALE) first moves whole base 27 digits out of x until x < 27^5 f, then sets x to (x / f) SCALE + x % f + c;
+// decoding reverses it, reading digits back in while x < L. The encoder runs over the text backwards and writes
+// its digits from the end of the buffer down, so the decoder reads them front to back in text order. The final
+// state goes first, and decoding must end with x back at L with every digit used, which catches most damage.
+// The frequency tables come from the order-1 symbol counts of Isaac Newton's Opticks (about 537K symbols once
+// everything but letters is folded into single spaces), scaled to SCALE with every symbol given at least 1.
+// On other English (the GPL v3, the Gettysburg address) they reach 3.3 to 3.5 bits per symbol.
+// Sources: J. Duda, Asymmetric numeral systems (arXiv:1311.2540), F. Giesen, Interleaved entropy coders (arXiv:1402.3392)
+
+#include <stdint.h>
+#include <string.h>
+#include "otp_compress.h"
+
+#define SCALE_BITS 12
+#define SCALE (1 << SCALE_BITS)
+#define LOW ((uint64_t)SCALE * 27 * 27 * 27 * 27)       // L, the bottom of the state interval
+#define STATE_DIGITS 8                                  // 27^8 > 27 L, so a final state fits in 8 digits
+#define SPACE 26                                        // the context of the first symbol
+
+static const char characterPool[28] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+// frequencies[previous][symbol], each row summing to SCALE
+static const uint16_t frequencies[27][27] = {
+	{ 1, 70, 244, 109, 1, 29, 59, 1, 93, 2, 56, 357, 110, 1005, 1, 101, 2, 459, 375, 556, 27, 48, 15, 11, 161, 1, 202 },   // after A
+	{ 47, 34, 25, 11, 1305, 1, 1, 9, 107, 65, 1, 538, 2, 2, 468, 1, 1, 184, 181, 18, 263, 1, 1, 4, 765, 1, 60 },   // after B
+	{ 248, 7, 76, 6, 674, 2, 1, 596, 271, 2, 157, 146, 1, 2, 947, 2, 2, 100, 5, 614, 164, 1, 1, 1, 5, 1, 64 },   // after C
+	{ 39, 1, 1, 41, 548, 1, 25, 3, 546, 2, 2, 37, 2, 1, 115, 1, 1, 33, 85, 23, 43, 2, 1, 1, 34, 1, 2507 },   // after D
+	{ 152, 7, 112, 250, 96, 133, 23, 3, 76, 1, 7, 74, 54, 295, 7, 24, 22, 521, 349, 117, 1, 28, 15, 59, 48, 1, 1621 },   // after E
+	{ 167, 1, 1, 1, 172, 103, 7, 1, 349, 1, 1, 199, 3, 1, 469, 1, 1, 591, 2, 101, 40, 1, 1, 1, 6, 1, 1874 },   // after F
+	{ 99, 1, 1, 3, 556, 1, 16, 783, 205, 1, 1, 398, 15, 52, 115, 1, 2, 476, 136, 51, 104, 1, 1, 1, 5, 1, 1070 },   // after G
+	{ 444, 1, 1, 1, 2214, 1, 1, 1, 430, 1, 1, 1, 4, 1, 172, 1, 1, 60, 5, 188, 21, 1, 1, 1, 12, 1, 530 },   // after H
+	{ 42, 66, 258, 140, 103, 116, 204, 1, 9, 1, 24, 159, 111, 1067, 322, 13, 23, 238, 450, 517, 22, 58, 1, 40, 1, 5, 105 },   // after I
+	{ 264, 9, 9, 9, 2587, 9, 9, 9, 9, 9, 60, 9, 9, 9, 298, 9, 9, 9, 9, 43, 315, 9, 9, 9, 9, 9, 349 },   // after J
+	{ 12, 1, 3, 1, 1265, 3, 1, 10, 412, 1, 3, 30, 8, 624, 26, 3, 10, 1, 144, 6, 1, 1, 8, 1, 10, 1, 1510 },   // after K
+	{ 395, 1, 3, 98, 825, 33, 4, 1, 504, 1, 2, 558, 10, 2, 426, 9, 1, 2, 83, 47, 171, 31, 7, 1, 278, 1, 602 },   // after L
+	{ 660, 75, 4, 1, 1003, 13, 1, 1, 404, 1, 1, 4, 43, 19, 477, 180, 1, 4, 116, 4, 143, 1, 1, 1, 33, 1, 904 },   // after M
+	{ 64, 1, 273, 811, 343, 22, 471, 1, 83, 1, 4, 22, 1, 29, 189, 1, 1, 1, 248, 338, 35, 18, 3, 1, 63, 1, 1071 },   // after N
+	{ 20, 80, 19, 67, 7, 671, 29, 3, 34, 1, 20, 234, 226, 633, 44, 101, 1, 432, 159, 233, 414, 39, 143, 1, 2, 1, 482 },   // after O
+	{ 756, 1, 1, 1, 876, 1, 1, 95, 115, 1, 1, 303, 1, 2, 670, 249, 4, 611, 30, 127, 80, 1, 6, 1, 1, 1, 160 },   // after P
+	{ 2, 2, 16, 2, 7, 11, 2, 2, 2, 2, 16, 2, 7, 7, 2, 2, 2, 111, 2, 11, 3407, 2, 2, 2, 2, 2, 469 },   // after Q
+	{ 451, 7, 64, 89, 1073, 38, 33, 3, 293, 1, 22, 19, 54, 28, 328, 31, 1, 19, 204, 212, 38, 45, 10, 1, 86, 1, 945 },   // after R
+	{ 90, 1, 46, 1, 481, 2, 1, 99, 244, 1, 4, 19, 95, 1, 202, 111, 9, 1, 240, 407, 173, 1, 6, 1, 11, 1, 1848 },   // after S
+	{ 109, 1, 3, 1, 343, 1, 1, 1707, 310, 1, 1, 35, 4, 2, 265, 1, 1, 98, 107, 50, 49, 1, 52, 1, 34, 1, 917 },   // after T
+	{ 212, 100, 247, 31, 226, 32, 165, 1, 97, 1, 1, 317, 271, 356, 35, 224, 1, 814, 398, 510, 10, 1, 1, 1, 1, 1, 42 },   // after U
+	{ 561, 1, 1, 1, 2511, 1, 1, 1, 796, 1, 1, 1, 1, 4, 70, 1, 1, 1, 4, 7, 17, 1, 2, 7, 10, 1, 92 },   // after V
+	{ 634, 1, 1, 18, 511, 1, 1, 1280, 753, 1, 1, 12, 1, 76, 274, 1, 1, 11, 55, 2, 1, 1, 2, 1, 1, 1, 454 },   // after W
+	{ 76, 2, 303, 2, 114, 2, 2, 176, 907, 2, 2, 11, 2, 2, 5, 972, 2, 14, 2, 627, 5, 33, 2, 11, 51, 2, 767 },   // after X
+	{ 3, 2, 1, 1, 294, 1, 1, 1, 34, 1, 2, 5, 8, 1, 65, 14, 1, 2, 478, 1, 1, 1, 1, 1, 1, 1, 3174 },   // after Y
+	{ 221, 25, 25, 74, 858, 25, 25, 25, 270, 25, 25, 74, 25, 25, 760, 25, 25, 25, 25, 25, 123, 25, 25, 25, 74, 25, 1192 },   // after Z
+	{ 496, 246, 162, 124, 83, 149, 67, 58, 305, 2, 8, 110, 143, 58, 374, 168, 12, 167, 243, 815, 35, 44, 205, 2, 18, 1, 1 },   // after space
+};
+
+static uint16_t cumulative[27][28];                     // running sums of each row
+static unsigned char slotSymbol[27][SCALE];             // the symbol a state's low bits decode to, per context
+static unsigned char symbolIndex[256];
+static uint64_t reciprocal[SCALE + 1];                  // ceil(2^63 / f), so x / f is a multiply and a shift
+
+// Build the decoding tables before main() runs
+__attribute__((constructor))
+static void buildTables(void)
+{
+	int context, s, slot;
+
+	for (s = 0; s < 27; s++) symbolIndex[(unsigned char)characterPool[s]] = s;
+	for (slot = 1; slot <= SCALE; slot++) reciprocal[slot] = ((1ULL << 63) + slot - 1) / slot;
+	for (context = 0; context < 27; context++) {
+		for (s = 0; s < 27; s++) {
+			cumulative[context][s + 1] = cumulative[context][s] + frequencies[context][s];
+			for (slot = cumulative[context][s]; slot < cumulative[context][s + 1]; slot++) slotSymbol[context][slot] = s;
+		}
+	}
+}
+
+// Write the format symbol and the length; returns the symbols written
+static size_t putHeader(char *out, char format, uint64_t length)
+{
+	size_t digits = 0;
+
+	out[0] = format;
+	do {
+		out[2 + digits++] = characterPool[length % 27];
+		length /= 27;
+	} while (length > 0);
+	out[1] = characterPool[digits];
+	return 2 + digits;
+}
+
+size_t otp_compress(char *out, const char *symbols, size_t n)
+{
+	size_t header = putHeader(out, OTP_COMPRESS_ORDER1, n), i, d;
+	char *end = out + header + n, *p = end, *limit = out + header + 2 * STATE_DIGITS;
+	uint64_t x[2] = { LOW, LOW }, q;
+	int s, context, j, full = 0;
+
+	// Code from the last symbol back, giving up once the digits and the final states would take as many symbols as
+	// the text itself. Even symbols go through state 0 and odd ones through state 1.
+	for (i = n; i-- > 0 && !full; ) {
+		j = i & 1;
+		s = symbolIndex[(unsigned char)symbols[i]];
+		context = i > 0 ? symbolIndex[(unsigned char)symbols[i - 1]] : SPACE;
+		while (x[j] >= (LOW / SCALE) * 27 * frequencies[context][s]) {
+			if (p <= limit) { full = 1; break; }
+			*--p = characterPool[x[j] % 27];
+			x[j] /= 27;
+		}
+		q = (unsigned __int128)x[j] * reciprocal[frequencies[context][s]] >> 63;
+		x[j] = q * SCALE + x[j] - q * frequencies[context][s] + cumulative[context][s];
+	}
+
+	// The final states go in front, state 0 first, then the digits move up behind the header
+	if (!full && p >= limit) {
+		for (j = 1; j >= 0; j--) {
+			for (d = 0; d < STATE_DIGITS; d++) {
+				*--p = characterPool[x[j] % 27];
+				x[j] /= 27;
+			}
+		}
+		memmove(out + header, p, end - p);
+		return header + (end - p);
+	}
+
+	// Not worth it: store the text as it is
+	out[0] = OTP_COMPRESS_STORED;
+	memcpy(out + header, symbols, n);
+	return header + n;
+}
+
+// Read the header of in. Returns the symbols it takes, or 0 if it is not one this version can read.
+static size_t getHeader(const char *in, size_t n, uint64_t *length)
+{
+	size_t digits, d;
+
+	if (n < 3 || (in[0] != OTP_COMPRESS_STORED && in[0] != OTP_COMPRESS_ORDER1)) return 0;
+	digits = symbolIndex[(unsigned char)in[1]];
+	if (digits == 0 || digits > 14 || n < 2 + digits) return 0;
+	*length = 0;
+	for (d = digits; d-- > 0; ) *length = *length * 27 + symbolIndex[(unsigned char)in[2 + d]];
+	return 2 + digits;
+}
+
+long long otp_decompressed_length(const char *in, size_t n)
+{
+	uint64_t length;
+	size_t header = getHeader(in, n, &length);
+
+	if (header == 0 || length > INT64_MAX) return -1;
+	if (in[0] == OTP_COMPRESS_STORED && length != n - header) return -1;
+	return length;
+}
+
+int otp_decompress(char *out, const char *in, size_t n)
+{
+	uint64_t length, x[2] = { 0, 0 }, i;
+	size_t header = getHeader(in, n, &length), d;
+	const char *p = in + header, *end = in + n;
+	unsigned slot;
+	int s, j, context = SPACE;
+
+	if (header == 0) return -1;
+	if (in[0] == OTP_COMPRESS_STORED) {
+		if (length != n - header) return -1;
+		memcpy(out, p, length);
+		return 0;
+	}
+
+	// Load the final states, then decode a symbol at a time, topping its state up with digits as it runs low
+	if (end - p < 2 * STATE_DIGITS) return -1;
+	for (j = 0; j < 2; j++) for (d = 0; d < STATE_DIGITS; d++) x[j] = x[j] * 27 + symbolIndex[(unsigned char)*p++];
+	for (i = 0; i < length; i++) {
+		j = i & 1;
+		slot = x[j] & (SCALE - 1);
+		s = slotSymbol[context][slot];
+		x[j] = frequencies[context][s] * (x[j] >> SCALE_BITS) + slot - cumulative[context][s];
+		while (x[j] < LOW) {
+			if (p == end) return -1;
+			x[j] = x[j] * 27 + symbolIndex[(unsigned char)*p++];
+		}
+		out[i] = characterPool[s];
+		context = s;
+	}
+	return x[0] == LOW && x[1] == LOW && p == end ? 0 : -1;
+}
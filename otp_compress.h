@@ -0,0 +1,35 @@
+// Description: Optional compression of plaintext symbols, used by otp_enc and otp_dec with --compress.
+// Every plaintext symbol costs a pad symbol and a wire byte, but English carries far less than the 4.75 bits a
+// symbol can hold. otp_enc compresses the plaintext before it is encrypted and otp_dec expands it again after it
+// is decrypted, so the compressed text is what travels, what uses up the pad and what the ciphertext file holds.
+// The daemons cipher it like any other text and need not know.
+// The coder is rANS over the 27 symbol alphabet with static order-1 frequencies (the symbol before picks the
+// table), taken from English prose and built into the program, and it writes its output as symbols of the same
+// alphabet (base 27 digits), so compressed text can be ciphered, packed and padded like plain text. English
+// comes out at about 0.7 symbols per symbol. Text it cannot shrink, such as a keygen key, is stored as it is.
+// A compressed text starts with a format symbol, which tells otp_dec how it was coded and lets it refuse formats
+// it does not know, and the length of the original text.
+
+#ifndef OTP_COMPRESS_H
+#define OTP_COMPRESS_H
+
+#include <stddef.h>
+
+#define OTP_COMPRESS_STORED 'A'             // format symbol: the symbols follow as they are
+#define OTP_COMPRESS_ORDER1 'B'             // format symbol: rANS with the built-in order-1 tables
+#define OTP_COMPRESS_OVERHEAD 16            // most symbols compression adds to a text (format and length)
+
+// Most symbols otp_compress() writes for n symbols
+#define OTP_COMPRESS_BOUND(n) ((n) + OTP_COMPRESS_OVERHEAD)
+
+// Compress n validated symbols into out, which must hold OTP_COMPRESS_BOUND(n). Returns the compressed length.
+size_t otp_compress(char *out, const char *symbols, size_t n);
+
+// The length of the text compressed into in[0..n), or -1 if in is not a compressed text this version can read
+long long otp_decompressed_length(const char *in, size_t n);
+
+// Expand the n compressed symbols at in into out, which must hold otp_decompressed_length() symbols.
+// Returns 0 on success and -1 if the compressed text is damaged.
+int otp_decompress(char *out, const char *in, size_t n);
+
+#endif
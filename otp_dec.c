@@ -8,177 +8,128 @@
 // if otp_dec cannot connect to the otp_dec_d server, for any reason (including that it has accidentally tried to connect to the otp_enc_d server),
 // it should report this error to stderr with the attempted port, and set the exit value to 2.
 // Otherwise, upon successfully running and terminating, otp_dec should set the exit value to 0.
+// The ciphertext and key are streamed to otp_dec_d in bounded chunks (see otp_protocol.h), so files of any size can be decrypted.
+// Several files can be decrypted over one connection with: otp_dec ciphertext key [ciphertext key ...] port. The requests are
+// pipelined, and the plaintexts are written to stdout in the order given, one per line.
+// If otp_dec_d holds the pad (started with --pad), a key can be given as @ID:OFFSET instead of a file. Only the ciphertext is
+// then sent, and the daemon uses its own copy of pad ID starting at OFFSET. It refuses pad ranges that were used before.
+// Instead of a port, the last argument can be the path of a Unix domain socket the daemon listens on (anything
+// containing a '/'), which skips the TCP/IP stack when both run on the same host.
+// It can also be HOST:PORT for a daemon on another host, or a list of daemons separated by commas
+// (5000,5001,HOST:PORT,/tmp/s.sock), and the request goes to the one with the fewest requests in flight, moving
+// on to the next if it cannot be reached (see otp_balance.h). Keys of the form @ID:OFFSET need a single daemon.
+// With OTP_PACKED set in the environment, symbols travel packed, three to every 15 bits (see otp_pack.h), which
+// cuts the bytes sent and received by 37.5%.
+// With --local in place of the port (otp_dec ciphertext key --local), no daemon is involved: the ciphertext is
+// ciphered in-process with the daemons' kernel, straight from the mapped files, and written to stdout. Input checks, messages and exit
+// codes are the same as over the network, but keys of the form @ID:OFFSET need a daemon and are refused.
+// Many files are decrypted in one run with otp_dec --batch manifest [--inflight N] port. Every line of the
+// manifest names a ciphertext, a key and the file to write the result to (see otp_batch.h).
+// With --binary before the files (otp_dec --binary ciphertext key port) any file can be decrypted: the whole file is
+// the ciphertext, bytes of every value included, and it is XORed with as many bytes of the key (keygen --binary
+// makes one). The result is exactly as long as the input and has no newline added.
+// A key can also be a pad container written by keygen --container (see otp_padfile.h), named as PATH or as
+// PATH:OFFSET to start that far into it. Only the part of it the ciphertext uses is read and checked.
+// With --compress before the files (otp_dec --compress ciphertext key port) a ciphertext written by otp_enc --compress
+// is decrypted and then expanded back to the plaintext (see otp_compress.h), one line at a time as it arrives.
+// The transfer itself is done by libotpclient (see otp_client.h), which programs can link to cipher buffers in
+// memory. The command line, the checks of the files and the messages and exit values are shared with otp_enc (see
+// otp_cli.h); otp_dec itself only adds the --compress step.
+// A daemon that is full answers BUSY; otp_dec then connects again after a growing, jittered wait, and gives up
+// with exit value 2 after OTP_BUSY_RETRIES more tries.
 // Sources: https://www.cs.bu.edu/teaching/c/file-io/intro/, Beej's guide - http://beej.us/guide/bgnet/html/single/bgnet.html, http://www.cs.dartmouth.edu/~campbell/cs50/socketprogramming.html
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
+#include <errno.h>
+#include <pthread.h>
+#include "otp_cli.h"
+#include "otp_compress.h"
 
 void error(const char *msg) { perror(msg); exit(1); }                   // Error function used for reporting issues
 
-int main(int argc, char *argv[])
+// Expand one compressed plaintext and write it to stdout with its newline. Exits with 1 if it is not a compressed text.
+void writeExpanded(const char *line, size_t n)
 {
-	// Variable setup
-	int socketFD, portNumber, charsWritten = 0, charsRead;
-	struct sockaddr_in serverAddress;
-	struct hostent* serverHostInfo;
-	char plainText[70001];
-	char totalText[140005];
-	FILE *fp;                           // file pointer
-	char textFile[1000];                // text file name
-	FILE *keyp;                         // key file pointer
-	char keyFile[1000];                 // key file name
-	int nextValue;					
-	char nextChar;
-	int i = 0;
-	int sent = 0;                       // bytes sent to the server
-	int bytesLeft;
-	int textLength = 0;
-	int keyLength = 0;
-	char test[2];
-	char t[2];
-
-	// If there are not enough arguments
-	if (argc < 4) { fprintf(stderr, "CLIENT: ERROR not enough arguments"); exit(2); }
-
-	// Get the cipher text file and key file names
-	strcpy(textFile, argv[1]);
-	strcpy(keyFile, argv[2]);
-
-	// Open and read the text file into text[]
-	fp = fopen(textFile, "r");
-
-	// If we could not open the text file
-	if (fp == NULL) error("CLIENT: ERROR could not open plain text file\n");
-
-	// If we could open the file, read in each character until we get to a terminating newline
-	while ((nextValue = getc(fp)) != '\n') {
-	// Check to make sure the input is valid
-	if (!((nextValue >= 65 && nextValue <= 90) || nextValue == 32)) error("CLIENT: ERROR invalid character in the ciphertext\n");
-
-	// Convert nextValue to a char and store in text[]
-	nextChar = nextValue;
-	//text[i] = nextChar;
-	totalText[i] = nextChar;
-	i++;
-	textLength++;
-	}
-
-	// Add a newline to distinguish the end of the ciphertext
-	totalText[i] = '\n';
-
-	// increment i
-	i++;
-
-	// Close the text file
-	fclose(fp);
-
-	// open and read the key file into key[]
-	keyp = fopen(keyFile, "r");
-
-	// If we could not open the key file
-	if (keyp == NULL) error("CLIENT: ERROR could not open the key file\n");
-
-	// If we could open the file, read in each character until we get to a terminating newline
-	while ((nextValue = getc(keyp)) != '\n') {
-		// Check to make sure the input is valid
-		if (!((nextValue >= 65 && nextValue <= 90) || nextValue == 32)) error("CLIENT: ERROR invalid character in the key\n");
-
-		// Convert nextValue to a char and store in key[]
-		nextChar = nextValue;
-		//key[i] = nextChar;
-		totalText[i] = nextChar;
-		i++;
-		keyLength++;
-	}
+	long long length = otp_decompressed_length(line, n);
+	char *plain = length >= 0 ? malloc(length + 1) : NULL;
 
-	// Close the key file
-	fclose(keyp);
-
-	// Check to make sure the key length is not shorter than the plaintext length
-	if (textLength > keyLength) {
-		error("CLIENT: ERROR, key too short\n");
+	if (plain == NULL || otp_decompress(plain, line, n) < 0) {
+		fprintf(stderr, "CLIENT: ERROR the plaintext is not compressed (was it encrypted with otp_enc --compress?)\n");
+		exit(1);
 	}
+	plain[length] = '\n';
+	if (fwrite(plain, 1, length + 1, stdout) != (size_t)length + 1) error("CLIENT: ERROR writing the plaintext\n");
+	free(plain);
+}
+
+// With --compress the daemon's answers, one per line, are compressed plaintexts. They come through the pipe whose
+// read end argument points to, and this thread holds only the line coming in: once its newline arrives, the line
+// is expanded and written to stdout.
+void *expandAnswers(void *argument)
+{
+	int fd = *(const int *)argument;
+	char chunk[OTP_CHUNK_MAX];
+	char *line = NULL, *newLine;
+	size_t fill = 0, capacity = 0, start, n;
+	ssize_t nb;
 
-	// Set up the server address struct
-	memset((char*)&serverAddress, '\0', sizeof(serverAddress));         // Clear out the address struct
-	portNumber = atoi(argv[3]);                                         // Get the port number, convert to an integer from a string
-	serverAddress.sin_family = AF_INET;                                 // Create a network-capable socket
-	serverAddress.sin_port = htons(portNumber);                         // Store the port number
-	//serverHostInfo = gethostbyname(argv[1]);                          // Convert the machine name into a special form of address
-	serverHostInfo = gethostbyname("127.0.0.1");                        // Use localhost as the machine name; convert to a special form of address
-	if (serverHostInfo == NULL) { fprintf(stderr, "CLIENT: ERROR, no such host\n"); exit(2); }  // if opt_enc cannot connect to the server
-	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length); // Copy in the address
-
-	// Set up the socket
-	socketFD = socket(AF_INET, SOCK_STREAM, 0);                         // Create the socket
-	if (socketFD < 0) error("CLIENT: ERROR opening socket");
-
-	// Connect to server, or print an error
-	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)         // Connect socket to address
-	{
-	fprintf(stderr, "CLIENT: ERROR connecting on port %d\n", portNumber); exit(2);
+	while ((nb = read(fd, chunk, sizeof(chunk))) != 0) {
+		if (nb < 0 && errno == EINTR) continue;
+		if (nb < 0) error("CLIENT: ERROR reading back the plaintext\n");
+		for (start = 0; start < (size_t)nb; start += n + 1) {
+			// Add what belongs to the current line, and expand it if this chunk ends it
+			newLine = memchr(chunk + start, '\n', nb - start);
+			n = (newLine != NULL ? (size_t)(newLine - chunk) : (size_t)nb) - start;
+			if (fill + n > capacity) {
+				capacity = 2 * (fill + n);
+				line = realloc(line, capacity);
+				if (line == NULL) error("CLIENT: ERROR out of memory\n");
+			}
+			memcpy(line + fill, chunk + start, n);
+			fill += n;
+			if (newLine == NULL) break;
+			writeExpanded(line, fill);
+			fill = 0;
+		}
 	}
+	if (fill > 0) writeExpanded(line, fill);
+	free(line);
+	return NULL;
+}
 
-	// Make sure we are connected to otp_dec_d - send and receive "p" upon connection
-	charsRead = recv(socketFD, test, sizeof(test), 0);
-	fflush(stdout);
-	if (charsRead < 0) error("CLIENT: ERROR reading from socket");
-
-	t[0] = 'p';
-	t[1] = '\0';
-
-	charsWritten = send(socketFD, t, sizeof(t), 0);
-	fflush(stdout);
-	if (charsWritten < 0) error("ERROR writing to socket");            // Error output if send fails
-
-	charsWritten = 0;
-
-	// Print an error and exit status 2 if we are trying to connect to the wrong server
-	if (strcmp(test, t))
-	{
-	fprintf(stderr, "CLIENT: ERROR otp_dec trying to connect to server other than otp_dec_d on port %d\n", portNumber); close(socketFD); exit(2);
+int main(int argc, char *argv[])
+{
+	static const struct otp_cli decClient = { "otp_dec", "otp_dec_d", "ciphertext", OTP_DECRYPT, 'p' };
+	struct otp_cli_run run;
+	int outFD = 1;                      // where the answers go: stdout, or the pipe to expandThread
+	int expandPipe[2];
+	pthread_t expandThread;             // with --compress, expands the answers as they arrive
+
+	// Read the command line and check every pair before connecting so bad input never reaches the server
+	otp_cli_open(&run, &decClient, argc, argv);
+	otp_cli_check(&run, NULL);
+
+	// Compressed plaintexts go through a pipe to a thread that expands each one as soon as its line is complete
+	if (run.compress) {
+		if (pipe(expandPipe) < 0) error("CLIENT: ERROR creating a pipe for the plaintext\n");
+		if ((errno = pthread_create(&expandThread, NULL, expandAnswers, &expandPipe[0])) != 0) error("CLIENT: ERROR starting the expanding thread\n");
+		outFD = expandPipe[1];
 	}
+	otp_cli_transfer(&run, outFD);
 
-	// If we are successfully connected to otp_dec_d, proceed
-	// Let the server know how large the message is
-	// Get string length
-	int str_size = strlen(totalText);
-	// Send fixed-length data to pre-pend variable-length field with the latter's size
-	send(socketFD, &str_size, sizeof(str_size), 0);
-
-	// Send text to server - iterate until the entire text is sent
-	size_t total = 0;
-	ssize_t nb;
-
-	while (total != strlen(totalText)) {
-		nb = send(socketFD, totalText + total, strlen(totalText) - total, 0);
-		if (nb == -1) error("CLIENT: ERROR, send failed");
-		total += nb;
+	// The end of the pipe tells the thread that the last line is in
+	if (run.compress) {
+		close(expandPipe[1]);
+		pthread_join(expandThread, NULL);
+		fflush(stdout);
 	}
 
-	// Make sure all the text was sent
-	if (nb < strlen(totalText)) error("CLIENT: WARNING: Not all key data written to socket!\n");
-	
-	// Get the plaintext from server
-	// textLength + 1 to account for extra \n at end
-	size_t receive = 0; 
-
-	// Loop until we have received everything
-	while (receive < textLength + 1) {
-		ssize_t nb = recv(socketFD, plainText, textLength + 1, 0);
-		// Check for errors and end of stream
-		if (nb == -1) error("CLIENT: ERROR recv failed");
-		if (nb == 0) break; 
-		if (write(1, plainText, nb) == -1) error("CLIENT: ERROR file write failed");
-		receive += nb;
-	}
+	// Unmap the files
+	otp_cli_close(&run);
 
 	// Return from the program
 	exit(0);
-}
\ No newline at end of file
+}
@@ -7,185 +7,72 @@
 // if otp_enc cannot connect to the otp_enc_d server, for any reason (including that it has accidentally tried to connect to the otp_dec_d server), 
 // it should report this error to stderr with the attempted port, and set the exit value to 2. 
 // Otherwise, upon successfully running and terminating, otp_enc should set the exit value to 0.
+// The plaintext and key are streamed to otp_enc_d in bounded chunks (see otp_protocol.h), so files of any size can be encrypted.
+// Several files can be encrypted over one connection with: otp_enc plaintext key [plaintext key ...] port. The requests are
+// pipelined, and the ciphertexts are written to stdout in the order given, one per line.
+// If otp_enc_d holds the pad (started with --pad), a key can be given as @ID:OFFSET instead of a file. Only the plaintext is
+// then sent, and the daemon uses its own copy of pad ID starting at OFFSET. It refuses pad ranges that were used before.
+// Instead of a port, the last argument can be the path of a Unix domain socket the daemon listens on (anything
+// containing a '/'), which skips the TCP/IP stack when both run on the same host.
+// It can also be HOST:PORT for a daemon on another host, or a list of daemons separated by commas
+// (5000,5001,HOST:PORT,/tmp/s.sock), and the request goes to the one with the fewest requests in flight, moving
+// on to the next if it cannot be reached (see otp_balance.h). Keys of the form @ID:OFFSET need a single daemon.
+// With OTP_PACKED set in the environment, symbols travel packed, three to every 15 bits (see otp_pack.h), which
+// cuts the bytes sent and received by 37.5%.
+// With --local in place of the port (otp_enc plaintext key --local), no daemon is involved: the plaintext is
+// ciphered in-process with the daemons' kernel, straight from the mapped files, and written to stdout. Input checks, messages and exit
+// codes are the same as over the network, but keys of the form @ID:OFFSET need a daemon and are refused.
+// Many files are encrypted in one run with otp_enc --batch manifest [--inflight N] port. Every line of the
+// manifest names a plaintext, a key and the file to write the result to (see otp_batch.h).
+// With --binary before the files (otp_enc --binary plaintext key port) any file can be encrypted: the whole file is
+// the plaintext, bytes of every value included, and it is XORed with as many bytes of the key (keygen --binary
+// makes one). The result is exactly as long as the input and has no newline added.
+// A key can also be a pad container written by keygen --container (see otp_padfile.h), named as PATH or as
+// PATH:OFFSET to start that far into it. Only the part of it the plaintext uses is read and checked.
+// With --compress before the files (otp_enc --compress plaintext key port) the plaintext is compressed before it
+// is encrypted (see otp_compress.h), so English uses up about 30% less key and the ciphertext is as much shorter.
+// Only otp_dec --compress can decrypt it.
+// The transfer itself is done by libotpclient (see otp_client.h), which programs can link to cipher buffers in
+// memory. The command line, the checks of the files and the messages and exit values are shared with otp_dec (see
+// otp_cli.h); otp_enc itself only adds the --compress step.
+// A daemon that is full answers BUSY; otp_enc then connects again after a growing, jittered wait, and gives up
+// with exit value 2 after OTP_BUSY_RETRIES more tries.
 // Sources: https://www.cs.bu.edu/teaching/c/file-io/intro/, https://stackoverflow.com/questions/30655002/socket-programming-recv-is-not-receiving-data-correctly,
 // Beej's Guide - http://beej.us/guide/bgnet/html/single/bgnet.html, http://www.cs.dartmouth.edu/~campbell/cs50/socketprogramming.html
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h> 
+#include "otp_cli.h"
+#include "otp_compress.h"
 
 void error(const char *msg) { perror(msg); exit(1); }                   // Error function used for reporting issues
 
-int main(int argc, char *argv[])
+// With --compress the compressed plaintext is what gets encrypted, so the key only has to cover that
+void compressText(struct otp_call *call)
 {
-	// Variable setup
-	int socketFD, portNumber, charsWritten = 0, charsRead;
-	struct sockaddr_in serverAddress;
-	struct hostent* serverHostInfo;
-	char cipherText[70001];             // cipher text
-	char totalText[140005];
-	FILE *fp;                           // file pointer
-	char textFile[1000];                // text file name
-	FILE *keyp;                         // key file pointer
-	char keyFile[1000];                 // key file name
-	int nextValue;
-	char nextChar;
-	int i = 0;
-	int sent = 0;                       // bytes sent to the server
-	int bytesLeft;
-	int textLength = 0;
-	int keyLength = 0;
-	char test[2];
-	char t[2];
-
-	// If there are not enough arguments
-	if (argc < 4) { fprintf(stderr, "CLIENT: ERROR not enough arguments"); exit(2); }
-
-	// Get the plain text file and key file names
-	strcpy(textFile, argv[1]);
-	strcpy(keyFile, argv[2]);
-
-	// Open and read the text file into text[]
-	fp = fopen(textFile, "r");
-
-	// If we could not open the text file
-	if (fp == NULL) error("CLIENT: ERROR could not open plain text file\n");
-
-	// If we could open the file, read in each character until we get to a terminating newline
-	while ((nextValue = getc(fp)) != '\n') {
-		// Check to make sure the input is valid, else print an error and exit
-		if (!((nextValue >= 65 && nextValue <= 90) || nextValue == 32)) {
-			fprintf(stderr, "CLIENT: ERROR invalid character in the plaintext\n");
-			exit(1);
-		}
-
-		// Convert nextValue to a char and store in text[]
-		nextChar = nextValue;
-		//text[i] = nextChar;
-		totalText[i] = nextChar;
-		i++;
-		textLength++;
-	}
-
-	// Add a newline to distinguish the end of the plaintext
-	totalText[i] = '\n';
-
-	// increment i
-	i++;
-
-	// Close the text file
-	fclose(fp);
-
-	// open and read the key file into key[]
-	keyp = fopen(keyFile, "r");
-
-	// If we could not open the key file
-	if (keyp == NULL) error("CLIENT: ERROR could not open the key file\n");
-
-	// If we could open the file, read in each character until we get to a terminating newline
-	while ((nextValue = getc(keyp)) != '\n') {
-		// Check to make sure the input is valid
-		if (!((nextValue >= 65 && nextValue <= 90) || nextValue == 32)) {
-			fprintf(stderr, "CLIENT: ERROR invalid character in the key\n");
-			exit(1);
-		}
-
-		// Convert nextValue to a char and store in key[]
-		nextChar = nextValue;
-		//key[i] = nextChar;
-		totalText[i] = nextChar;
-		i++;
-		keyLength++;
-	}
-
-	// Close the key file
-	fclose(keyp);
+	char *compressed = malloc(OTP_COMPRESS_BOUND(call->textLength));
 
-	// Check to make sure the key length is not shorter than the plaintext length
-	if (textLength > keyLength) {
-		fprintf(stderr, "CLIENT: ERROR key too short \n");
-		exit(1);
-	}
-
-	// Set up the server address struct
-	memset((char*)&serverAddress, '\0', sizeof(serverAddress));         // Clear out the address struct
-	portNumber = atoi(argv[3]);                                         // Get the port number, convert to an integer from a string
-	serverAddress.sin_family = AF_INET;                                 // Create a network-capable socket
-	serverAddress.sin_port = htons(portNumber);                         // Store the port number
-	serverHostInfo = gethostbyname("127.0.0.1");                        // Use localhost as the machine name; convert to a special form of address
-	if (serverHostInfo == NULL) { fprintf(stderr, "CLIENT: ERROR no such host\n"); exit(2); }  // if opt_enc cannot connect to the server
-	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length); // Copy in the address
-
-																											// Set up the socket
-	socketFD = socket(AF_INET, SOCK_STREAM, 0);                         // Create the socket
-	if (socketFD < 0) error("CLIENT: ERROR opening socket");
-
-	// Connect to server, or print an error 
-	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)         // Connect socket to address
-	{
-		fprintf(stderr, "CLIENT: ERROR connecting on port %d\n", portNumber); exit(2);
-	}
-
-	// Make sure we are connected to otp_enc_d - send and receive "t" upon connection
-	charsRead = recv(socketFD, test, sizeof(test), 0);
-	fflush(stdout);
-	if (charsRead < 0) error("CLIENT: ERROR reading from socket\n");
-
-	t[0] = 't';
-	t[1] = '\0';
-
-	charsWritten = send(socketFD, t, sizeof(t), 0);
-	fflush(stdout);
-	if (charsWritten < 0) error("CLIENT: ERROR writing to socket\n");            // Error output if send fails
-
-	charsWritten = 0;
-
-	// Print an error message and exit if we are trying to connect to the wrong server
-	if (strcmp(test, t))
-	{
-		fprintf(stderr, "CLIENT: ERROR otp_enc trying to connect to different server from otp_enc_d on port %d\n", portNumber); close(socketFD); exit(2);
-	}
-
-	// If we are successfully connected to otp_enc_d, proceed
-	// Let the server know how large the message is
-	// Get string length
-	int str_size = strlen(totalText);
-	// Send fixed-length data to pre-pend variable-length field with the latter's size
-	send(socketFD, &str_size, sizeof(str_size), 0);
-
-	// Send text to server - iterate until the entire text is sent
-	size_t total = 0;
-	ssize_t nb;
+	if (compressed == NULL) error("CLIENT: ERROR out of memory\n");
+	call->textLength = otp_compress(compressed, call->text, call->textLength);
+	call->text = compressed;
+}
 
-	while (total != strlen(totalText)) {
-		nb = send(socketFD, totalText + total, strlen(totalText) - total, 0);
-		if (nb == -1) error("CLIENT: ERROR send failed\n");
-		total += nb;
-	}
+int main(int argc, char *argv[])
+{
+	static const struct otp_cli encClient = { "otp_enc", "otp_enc_d", "plaintext", OTP_ENCRYPT, 't' };
+	struct otp_cli_run run;
+	size_t r;
 
-	// Make sure all the text was sent
-	if (nb < strlen(totalText)) error("CLIENT: ERROR Not all key data written to socket\n");
-	
-	// Get the ciphertext from server
-	// Use textLength + 1 to account for extra \n at end
-	size_t receive = 0; 
+	// Read the command line, check every pair before connecting so bad input never reaches the server, and write
+	// the ciphertexts to stdout
+	otp_cli_open(&run, &encClient, argc, argv);
+	otp_cli_check(&run, run.compress ? compressText : NULL);
+	otp_cli_transfer(&run, 1);
 
-	// Loop until we have received everything
-	while (receive < textLength+1) {
-		ssize_t nb = recv(socketFD, cipherText, textLength + 1, 0);
-		// Check for errors or end of stream
-		if (nb == -1) error("CLIENT: ERROR recv failed\n");
-		if (nb == 0) break; 
-		if (write(1, cipherText, nb) == -1) error("CLIENT: ERROR file write failed\n");
-		receive += nb;
-	}
+	// Free the compressed plaintexts and unmap the files
+	for (r = 0; run.compress && r < run.count; r++) free((char *)run.calls[r].text);
+	otp_cli_close(&run);
 
 	// Return from the program
 	exit(0);
 }
-
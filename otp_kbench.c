@@ -0,0 +1,533 @@
+// Description: otp_kbench measures the per-symbol loops on their own, away from sockets and processes:
+//   index/*     turning a symbol into its index, with strchr() as the daemons originally did and with a table
+//   cipher/*    the whole mod 27 cipher, the original strchr() loop ("reference") and every kernel in otp_cipher.c,
+//               and the binary mode XOR of every kernel ("-xor", against a byte loop)
+//   validate/*  the clients' alphabet check, one getc() per symbol as originally written, a byte loop over a mapped
+//               buffer, and the check of every kernel in otp_cipher.c
+//   pack/*, unpack/*  the packed wire encoding, every kernel in otp_pack.c (ns per symbol)
+// With --corpus FILE (repeatable) it instead reports how well otp_compress.c shrinks each plaintext FILE: the
+// compressed size, bits per symbol, and the time to compress and expand it (min of --reps runs).
+// Each loop runs over inputs from --min to --max bytes (default 64 B to 1 GB, every power of 4), one warmup pass
+// and then --reps timed samples (default 7), and reports the minimum and median ns/byte and the GB/s of the
+// minimum. Small inputs are run many times per sample so every sample takes a measurable amount of time.
+// Before timing anything, every kernel is checked against the reference loop (all 27 x 27 symbol pairs, then
+// random inputs of many lengths and alignments), every validation loop and kernel check against the getc() loop,
+// and every pack kernel against the scalar one; any difference is printed and otp_kbench exits with 1. --check runs
+// only the checks. Compression is checked by round trips of random and English-like texts of many lengths.
+// The syntax is: otp_kbench [--min BYTES] [--max BYTES] [--reps N] [--check] [--corpus FILE ...]
+// Sources: clock_gettime(2), fmemopen(3)
+
+#define _GNU_SOURCE                         // fmemopen()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include "otp_cipher.h"
+#include "otp_pack.h"
+#include "otp_compress.h"
+
+#define SAMPLE_BYTES (4 << 20)              // small inputs are repeated until a sample covers about this much
+#define CORPORA_MAX 16
+
+typedef void (*loopFunction)(char *out, const char *text, const char *key, size_t n);
+
+struct loop {
+	char name[32];
+	loopFunction run;
+	const struct otp_pack_kernel *packer;       // pack/unpack loops run this kernel instead of run
+	int unpacking;
+	size_t (*check)(const char *data, size_t n);    // validate loops of a kernel run this instead of run
+};
+
+static const char characterPool[28] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+static unsigned char symbolIndex[256];
+static volatile size_t sink;                // results go here so the compiler cannot drop the loops
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "USAGE: %s [--min BYTES] [--max BYTES] [--reps N] [--check] [--corpus FILE ...]\n", program);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t nextRandom(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// the original loops, as they were in otp_enc_d.c, otp_dec_d.c and otp_enc.c / otp_dec.c
+
+static void referenceEncrypt(char *out, const char *text, const char *key, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		int textIndex = strchr(characterPool, text[i]) - characterPool;
+		int keyIndex = strchr(characterPool, key[i]) - characterPool;
+		int nextValue = textIndex + keyIndex;
+
+		if (nextValue > 26) nextValue = nextValue - 27;
+		nextValue = nextValue % 27;
+		out[i] = characterPool[nextValue];
+	}
+}
+
+static void referenceDecrypt(char *out, const char *text, const char *key, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		int textIndex = strchr(characterPool, text[i]) - characterPool;
+		int keyIndex = strchr(characterPool, key[i]) - characterPool;
+		int nextValue = textIndex - keyIndex;
+
+		if (nextValue < 0) nextValue = nextValue + 27;
+		nextValue = nextValue % 27;
+		out[i] = characterPool[nextValue];
+	}
+}
+
+// Number of symbols before the first one outside the alphabet, reading the input one getc() at a time.
+// The input ends with a newline, like the files the clients read.
+static size_t validateGetc(const char *data, size_t n)
+{
+	FILE *fp = fmemopen((void *)data, n + 1, "r");
+	size_t i = 0;
+	int nextValue;
+
+	while ((nextValue = getc(fp)) != '\n') {
+		if (!((nextValue >= 65 && nextValue <= 90) || nextValue == 32)) break;
+		i++;
+	}
+	fclose(fp);
+	return i;
+}
+
+//////////////////////////////////////////////////////////////////////
+// the baseline for binary mode, which is new and so has no original loop
+
+// The XOR kernels are checked against this byte at a time loop
+static void referenceXor(char *out, const char *text, const char *key, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) out[i] = text[i] ^ key[i];
+}
+
+//////////////////////////////////////////////////////////////////////
+// the loops being measured
+
+static void indexStrchr(char *out, const char *text, const char *key, size_t n)
+{
+	size_t i, total = 0;
+
+	(void)out;
+	(void)key;
+	for (i = 0; i < n; i++) total += strchr(characterPool, text[i]) - characterPool;
+	sink = total;
+}
+
+static void indexTable(char *out, const char *text, const char *key, size_t n)
+{
+	size_t i, total = 0;
+
+	(void)out;
+	(void)key;
+	for (i = 0; i < n; i++) total += symbolIndex[(unsigned char)text[i]];
+	sink = total;
+}
+
+// The check otp_enc / otp_dec ran over the mapped file before it moved into the kernels
+static size_t validateBuffer(const char *data, size_t n)
+{
+	size_t j;
+
+	for (j = 0; j < n; j++) {
+		if (!((data[j] >= 65 && data[j] <= 90) || data[j] == 32)) break;
+	}
+	return j;
+}
+
+static void validateGetcLoop(char *out, const char *text, const char *key, size_t n) { (void)out; (void)key; sink = validateGetc(text, n); }
+static void validateBufferLoop(char *out, const char *text, const char *key, size_t n) { (void)out; (void)key; sink = validateBuffer(text, n); }
+
+//////////////////////////////////////////////////////////////////////
+// checks
+
+static void fillRandom(char *buffer, size_t n, uint64_t *state)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) buffer[i] = characterPool[nextRandom(state) % 27];
+}
+
+// Compare every kernel with the reference loop. Returns the number of mismatches found.
+static int checkKernels(const struct otp_kernel *kernels, size_t kernelCount)
+{
+	static char text[4096 + 64], key[4096 + 64], expected[4096 + 64], actual[4096 + 64];
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	int failures = 0, direction, a, b;
+	size_t k, n, align;
+
+	for (k = 0; k < kernelCount; k++) {
+		if (!kernels[k].supported()) continue;
+		for (direction = OTP_ENCRYPT; direction <= OTP_XOR; direction++) {
+			loopFunction reference = direction == OTP_XOR ? referenceXor : direction == OTP_DECRYPT ? referenceDecrypt : referenceEncrypt;
+			loopFunction kernel = direction == OTP_XOR ? kernels[k].xor : direction == OTP_DECRYPT ? kernels[k].decrypt : kernels[k].encrypt;
+			int bad = 0;
+
+			// Every text symbol against every key symbol
+			for (a = 0; a < 27; a++) {
+				for (b = 0; b < 27; b++) {
+					text[27 * a + b] = characterPool[a];
+					key[27 * a + b] = characterPool[b];
+				}
+			}
+			reference(expected, text, key, 27 * 27);
+			kernel(actual, text, key, 27 * 27);
+			if (memcmp(expected, actual, 27 * 27) != 0) bad = 1;
+
+			// Random inputs of every length up to 300 and some longer ones, at every alignment within a vector
+			for (n = 0; n <= 4096 && !bad; n += n < 300 ? 1 : 191) {
+				for (align = 0; align < 64 && !bad; align += 7) {
+					fillRandom(text + align, n, &state);
+					fillRandom(key, n, &state);
+					reference(expected, text + align, key, n);
+					kernel(actual + align, text + align, key, n);
+					if (memcmp(expected, actual + align, n) != 0) bad = 1;
+				}
+			}
+
+			// The daemons cipher in place, so check that too
+			fillRandom(text, 4096, &state);
+			fillRandom(key, 4096, &state);
+			reference(expected, text, key, 4096);
+			kernel(text, text, key, 4096);
+			if (memcmp(expected, text, 4096) != 0) bad = 1;
+
+			printf("check cipher/%s-%s: %s\n", kernels[k].name, direction == OTP_XOR ? "xor" : direction == OTP_DECRYPT ? "dec" : "enc",
+				bad ? "MISMATCH" : "ok");
+			failures += bad;
+		}
+	}
+	return failures;
+}
+
+// Compare one validation loop with the getc() loop, with one bad byte of every value at several positions, from
+// several starting alignments. Returns 1 if they differ.
+static int checkValidator(const char *name, size_t (*validate)(const char *data, size_t n))
+{
+	static char data[1024 + 1];
+	uint64_t state = 0x2545f4914f6cdd1dULL;
+	size_t n = 1000, position, start;
+	int value, bad = 0;
+
+	fillRandom(data, n, &state);
+	data[n] = '\n';
+	for (start = 0; start < 4; start++) if (validate(data + start, n - start) != validateGetc(data + start, n - start)) bad = 1;
+	for (value = 0; value < 256; value++) {
+		if ((value >= 65 && value <= 90) || value == 32) continue;
+		for (position = 0; position < n; position += 37) {
+			char saved = data[position];
+
+			// A newline stops the getc() loop as the end of the file, so it only counts as bad for the buffer check
+			data[position] = value;
+			for (start = 0; start < 4 && start <= position; start++) {
+				if (value != '\n' && validate(data + start, n - start) != validateGetc(data + start, n - start)) bad = 1;
+				if (value == '\n' && validate(data + start, n - start) != position - start) bad = 1;
+			}
+			data[position] = saved;
+		}
+	}
+	printf("check validate/%s: %s\n", name, bad ? "MISMATCH" : "ok");
+	return bad;
+}
+
+// Check the buffer loop and every kernel's check. Returns the number of mismatches found.
+static int checkValidation(const struct otp_kernel *kernels, size_t kernelCount)
+{
+	int failures = checkValidator("buffer", validateBuffer);
+	size_t k;
+
+	for (k = 0; k < kernelCount; k++) if (kernels[k].supported()) failures += checkValidator(kernels[k].name, kernels[k].check);
+	return failures;
+}
+
+// Compare every pack kernel with the scalar one, which otp_pack.h describes bit by bit: the packed bytes
+// (and nothing past them), the round trip, and unpacking random bytes. Returns the number of mismatches found.
+static int checkPackers(const struct otp_pack_kernel *packers, size_t packerCount)
+{
+	static char symbols[4096], expected[4096], actual[4096];
+	static unsigned char packedExpected[4096], packedActual[4096];
+	uint64_t state = 0x8cb92ba72f3d8dd7ULL;
+	int failures = 0;
+	size_t k, n, i;
+
+	for (k = 0; k < packerCount; k++) {
+		int bad = 0;
+
+		if (!packers[k].supported()) continue;
+		for (n = 0; n <= 4096 && !bad; n += n < 300 ? 1 : 191) {
+			fillRandom(symbols, n, &state);
+			memset(packedExpected, 0xa5, sizeof(packedExpected));
+			memset(packedActual, 0xa5, sizeof(packedActual));
+			packers[0].pack(packedExpected, symbols, n);
+			packers[k].pack(packedActual, symbols, n);
+			if (memcmp(packedExpected, packedActual, sizeof(packedActual)) != 0) bad = 1;
+			if (n < 4096 && packedActual[OTP_PACKED_SIZE(n)] != 0xa5) bad = 1;
+			packers[k].unpack(actual, packedActual, n);
+			if (memcmp(symbols, actual, n) != 0) bad = 1;
+
+			// Bytes off the network may hold any value, which must still unpack to the alphabet, the same way
+			for (i = 0; i < OTP_PACKED_SIZE(n); i++) packedActual[i] = nextRandom(&state);
+			packers[0].unpack(expected, packedActual, n);
+			packers[k].unpack(actual, packedActual, n);
+			if (memcmp(expected, actual, n) != 0) bad = 1;
+			for (i = 0; i < n; i++) if (memchr(characterPool, actual[i], 27) == NULL) bad = 1;
+		}
+		printf("check pack/%s: %s\n", packers[k].name, bad ? "MISMATCH" : "ok");
+		failures += bad;
+	}
+	return failures;
+}
+
+//////////////////////////////////////////////////////////////////////
+// timing
+
+// Compress and expand texts of every length up to 3000, random ones (which are stored) and ones drawn mostly from
+// a few common words (which are coded). Returns 1 if any does not come back as it went in.
+static int checkCompressor(void)
+{
+	static const char words[] = "THE AND OF TO IN THAT IS WITH ";
+	static char text[3000], compressed[OTP_COMPRESS_BOUND(3000)], expanded[3000];
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	size_t n, i, m;
+	int english, bad = 0;
+
+	for (english = 0; english < 2; english++) {
+		for (n = 0; n <= sizeof(text); n++) {
+			for (i = 0; i < n; i++) {
+				uint64_t r = nextRandom(&state);
+
+				text[i] = english && r % 8 != 0 ? words[(r >> 8) % (sizeof(words) - 1)] : characterPool[(r >> 8) % 27];
+			}
+			m = otp_compress(compressed, text, n);
+			if (m > OTP_COMPRESS_BOUND(n) || otp_decompressed_length(compressed, m) != (long long)n ||
+				otp_decompress(expanded, compressed, m) < 0 || memcmp(expanded, text, n) != 0) bad = 1;
+		}
+	}
+	printf("check compress: %s\n", bad ? "MISMATCH" : "ok");
+	return bad;
+}
+
+// Report how well one plaintext file compresses, and how fast. Returns 1 if it does not come back as it went in.
+static int measureCorpus(const char *path, int reps)
+{
+	FILE *fp = fopen(path, "r");
+	char *text, *compressed, *expanded;
+	double compressTime = 0, expandTime = 0, started;
+	size_t n = 0, m = 0;
+	long size;
+	int r, bad;
+
+	if (fp == NULL || fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0) { fprintf(stderr, "KBENCH: ERROR could not read %s\n", path); exit(1); }
+	rewind(fp);
+	text = malloc(size + 1);
+	compressed = malloc(OTP_COMPRESS_BOUND(size));
+	expanded = malloc(size + 1);
+	if (text == NULL || compressed == NULL || expanded == NULL) { fprintf(stderr, "KBENCH: ERROR out of memory\n"); exit(1); }
+	if (fread(text, 1, size, fp) != (size_t)size) { fprintf(stderr, "KBENCH: ERROR could not read %s\n", path); exit(1); }
+	fclose(fp);
+
+	// A plaintext ends at its newline and holds nothing but symbols before it
+	n = otp_check_symbols(text, size);
+	if (n == (size_t)size || text[n] != '\n') { fprintf(stderr, "KBENCH: ERROR %s is not a plaintext (byte %zu)\n", path, n); exit(1); }
+
+	for (r = 0; r < reps; r++) {
+		started = now();
+		m = otp_compress(compressed, text, n);
+		if (r == 0 || now() - started < compressTime) compressTime = now() - started;
+		started = now();
+		bad = otp_decompress(expanded, compressed, m) < 0;
+		if (r == 0 || now() - started < expandTime) expandTime = now() - started;
+	}
+	bad = bad || otp_decompressed_length(compressed, m) != (long long)n || memcmp(expanded, text, n) != 0;
+	printf("%-24s %10zu %10zu %8.3f %8.2f %12.2f %12.2f%s\n", path, n, m, n ? (double)m / n : 0, n ? m * 4.7549 / n : 0,
+		n ? compressTime / n : 0, n ? expandTime / n : 0, bad ? "  MISMATCH" : "");
+	free(text);
+	free(compressed);
+	free(expanded);
+	return bad;
+}
+
+static void runLoop(const struct loop *loop, char *out, const char *text, const char *key, size_t n)
+{
+	// Unpacking reads the random symbols as packed bytes, which is as good an input as any
+	if (loop->check != NULL) sink = loop->check(text, n);
+	else if (loop->packer == NULL) loop->run(out, text, key, n);
+	else if (loop->unpacking) loop->packer->unpack(out, (const unsigned char *)text, n);
+	else loop->packer->pack((unsigned char *)out, text, n);
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static const char *sizeName(size_t bytes, char *name, size_t length)
+{
+	if (bytes >= (1 << 30)) snprintf(name, length, "%zu GB", bytes >> 30);
+	else if (bytes >= (1 << 20)) snprintf(name, length, "%zu MB", bytes >> 20);
+	else if (bytes >= (1 << 10)) snprintf(name, length, "%zu KB", bytes >> 10);
+	else snprintf(name, length, "%zu B", bytes);
+	return name;
+}
+
+// Time one loop on n bytes and print a line
+static void measure(const struct loop *loop, char *out, const char *text, const char *key, size_t n, int reps)
+{
+	size_t calls = n >= SAMPLE_BYTES ? 1 : SAMPLE_BYTES / n, c;
+	double samples[64];
+	char name[16];
+	int r;
+
+	// One warmup pass, then the timed samples
+	for (c = 0; c < calls; c++) runLoop(loop, out, text, key, n);
+	for (r = 0; r < reps; r++) {
+		double started = now();
+
+		for (c = 0; c < calls; c++) runLoop(loop, out, text, key, n);
+		samples[r] = (now() - started) / ((double)calls * n);
+	}
+	sink = out[n - 1];
+
+	qsort(samples, reps, sizeof(samples[0]), compareDoubles);
+	printf("%-24s %8s %12.4f %12.4f %10.3f\n", loop->name, sizeName(n, name, sizeof(name)), samples[0], samples[reps / 2], 1 / samples[0]);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option longOptions[] = {
+		{ "min", required_argument, NULL, 'm' },
+		{ "max", required_argument, NULL, 'M' },
+		{ "reps", required_argument, NULL, 'r' },
+		{ "check", no_argument, NULL, 'c' },
+		{ "corpus", required_argument, NULL, 'C' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const struct otp_kernel *kernels;
+	const struct otp_pack_kernel *packers;
+	struct loop loops[32];
+	size_t kernelCount, packerCount, loopCount = 0, minSize = 64, maxSize = (size_t)1 << 30, n, k;
+	uint64_t state = 1;
+	char *text, *key, *out;
+	int reps = 7, checkOnly = 0, failures;
+	const char *corpora[CORPORA_MAX];
+	int corpusCount = 0;
+	int option;
+
+	while ((option = getopt_long(argc, argv, "m:M:r:cC:", longOptions, NULL)) != -1) {
+		switch (option) {
+		case 'm': minSize = strtoull(optarg, NULL, 10); break;
+		case 'M': maxSize = strtoull(optarg, NULL, 10); break;
+		case 'r': reps = atoi(optarg); break;
+		case 'c': checkOnly = 1; break;
+		case 'C':
+			if (corpusCount == CORPORA_MAX) usage(argv[0]);
+			corpora[corpusCount++] = optarg;
+			break;
+		default: usage(argv[0]);
+		}
+	}
+	if (minSize == 0 || maxSize < minSize || reps < 1 || reps > 64) usage(argv[0]);
+
+	for (n = 0; n < 26; n++) symbolIndex['A' + n] = n;
+	symbolIndex[' '] = 26;
+
+	// Nothing is worth timing if it gives different answers
+	kernels = otp_cipher_kernels(&kernelCount);
+	packers = otp_pack_kernels(&packerCount);
+	failures = checkKernels(kernels, kernelCount) + checkValidation(kernels, kernelCount) + checkPackers(packers, packerCount) + checkCompressor();
+	if (failures > 0) { fprintf(stderr, "KBENCH: ERROR %d loop(s) differ from the reference\n", failures); exit(1); }
+	if (checkOnly) return 0;
+
+	// With corpora, report on compression alone
+	if (corpusCount > 0) {
+		printf("%-24s %10s %10s %8s %8s %12s %12s\n", "corpus", "symbols", "compressed", "ratio", "bits/sym", "compress ns", "expand ns");
+		for (k = 0; k < (size_t)corpusCount; k++) failures += measureCorpus(corpora[k], reps);
+		return failures > 0;
+	}
+
+	// Everything that gets timed, the original loops first
+	loops[loopCount++] = (struct loop){ "index/strchr", indexStrchr, NULL, 0, NULL };
+	loops[loopCount++] = (struct loop){ "index/table", indexTable, NULL, 0, NULL };
+	loops[loopCount++] = (struct loop){ "cipher/reference-enc", referenceEncrypt, NULL, 0, NULL };
+	loops[loopCount++] = (struct loop){ "cipher/reference-dec", referenceDecrypt, NULL, 0, NULL };
+	for (k = 0; k < kernelCount; k++) {
+		if (!kernels[k].supported()) continue;
+		loops[loopCount] = (struct loop){ "", kernels[k].encrypt, NULL, 0, NULL };
+		snprintf(loops[loopCount++].name, sizeof(loops[0].name), "cipher/%s-enc", kernels[k].name);
+		loops[loopCount] = (struct loop){ "", kernels[k].decrypt, NULL, 0, NULL };
+		snprintf(loops[loopCount++].name, sizeof(loops[0].name), "cipher/%s-dec", kernels[k].name);
+		loops[loopCount] = (struct loop){ "", kernels[k].xor, NULL, 0, NULL };
+		snprintf(loops[loopCount++].name, sizeof(loops[0].name), "cipher/%s-xor", kernels[k].name);
+	}
+	loops[loopCount++] = (struct loop){ "validate/getc", validateGetcLoop, NULL, 0, NULL };
+	loops[loopCount++] = (struct loop){ "validate/buffer", validateBufferLoop, NULL, 0, NULL };
+	for (k = 0; k < kernelCount; k++) {
+		if (!kernels[k].supported()) continue;
+		loops[loopCount] = (struct loop){ "", NULL, NULL, 0, kernels[k].check };
+		snprintf(loops[loopCount++].name, sizeof(loops[0].name), "validate/%s", kernels[k].name);
+	}
+	for (k = 0; k < packerCount; k++) {
+		if (!packers[k].supported()) continue;
+		loops[loopCount] = (struct loop){ "", NULL, &packers[k], 0, NULL };
+		snprintf(loops[loopCount++].name, sizeof(loops[0].name), "pack/%s", packers[k].name);
+		loops[loopCount] = (struct loop){ "", NULL, &packers[k], 1, NULL };
+		snprintf(loops[loopCount++].name, sizeof(loops[0].name), "unpack/%s", packers[k].name);
+	}
+
+	// One set of buffers big enough for the largest size, touched once so page faults stay out of the timings
+	text = malloc(maxSize + 1);
+	key = malloc(maxSize);
+	out = malloc(maxSize);
+	if (text == NULL || key == NULL || out == NULL) { fprintf(stderr, "KBENCH: ERROR out of memory\n"); exit(1); }
+	fillRandom(text, maxSize, &state);
+	fillRandom(key, maxSize, &state);
+	memset(out, 0, maxSize);
+
+	printf("%-24s %8s %12s %12s %10s\n", "loop", "size", "min ns/B", "median ns/B", "GB/s");
+	for (k = 0; k < loopCount; k++) {
+		for (n = minSize; n <= maxSize; n *= 4) {
+			// The getc() loop reads up to a newline, so put one after the input for the duration of the run
+			char saved = text[n];
+
+			text[n] = '\n';
+			measure(&loops[k], out, text, key, n, reps);
+			text[n] = saved;
+			if (n > maxSize / 4) break;
+		}
+	}
+
+	free(text);
+	free(key);
+	free(out);
+	return 0;
+}
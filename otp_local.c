@@ -0,0 +1,49 @@
+// Description: Implementation of the serverless mode declared in otp_local.h.
+// Each request is ciphered in blocks of OTP_LOCAL_BLOCK symbols into one reusable buffer, which is written out
+// before the next block is ciphered. A block is large enough that the write() calls cost little next to the cipher,
+// and small enough that the buffer stays in cache while it is written. The newline that ends a request rides along
+// with its last block.
+
+#include <errno.h>
+#include <unistd.h>
+#include "otp_cipher.h"
+#include "otp_local.h"
+
+static int writeAll(int fd, const char *buf, size_t len)
+{
+	size_t total = 0;
+	ssize_t nb;
+
+	while (total < len) {
+		nb = write(fd, buf + total, len - total);
+		otp_io.syscalls++;
+		if (nb < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		total += nb;
+	}
+	return 0;
+}
+
+int otp_local_requests(int direction, const struct otp_request *requests, size_t count, int outFD)
+{
+	static char block[OTP_LOCAL_BLOCK + 1];             // one block of output, plus room for the newline
+	size_t r, position, n;
+
+	for (r = 0; r < count; r++) {
+		const struct otp_request *q = &requests[r];
+
+		position = 0;
+		do {
+			n = q->textLength - position < OTP_LOCAL_BLOCK ? q->textLength - position : OTP_LOCAL_BLOCK;
+			otp_cipher(direction, block, q->text + position, q->key + position, n);
+			position += n;
+
+			// The last block of the request (possibly empty) carries its newline, unless it is binary
+			if (position == q->textLength && direction != OTP_XOR) block[n++] = '\n';
+			if (writeAll(outFD, block, n) < 0) return -1;
+		} while (position < q->textLength);
+	}
+	return 0;
+}
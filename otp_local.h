@@ -0,0 +1,21 @@
+// Description: Serverless mode of otp_enc/otp_dec (--local in place of the port).
+// For batch jobs on the host that holds the text and the key, going through a daemon only adds copies, context
+// switches and a trip through the socket layer. otp_local_requests() takes the same validated requests that
+// otp_stream_requests() would send and ciphers them in-process with the daemons' kernel (otp_cipher.c), straight
+// out of the mapped files into an output buffer, and writes the results to outFD in the same format: one per line,
+// in order. Requests that refer to a daemon's pad cannot be served locally and must be rejected by the caller.
+
+#ifndef OTP_LOCAL_H
+#define OTP_LOCAL_H
+
+#include <stddef.h>
+#include "otp_protocol.h"
+
+#define OTP_LOCAL_BLOCK (1 << 20)           // symbols ciphered and written at a time
+
+// Cipher count requests with direction (OTP_ENCRYPT, OTP_DECRYPT or OTP_XOR) and write them to outFD, each followed
+// by a newline (binary OTP_XOR results are written as they are). Every request must have a key.
+// Returns 0 on success and -1 with errno set if a write fails.
+int otp_local_requests(int direction, const struct otp_request *requests, size_t count, int outFD);
+
+#endif
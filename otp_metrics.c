@@ -0,0 +1,237 @@
+// Description: Implementation of the daemon metrics declared in otp_metrics.h.
+// Slot 0 belongs to the process that starts the daemon (the --epoll process counts into it). The other slots are
+// handed out by the parent and given back by the child when it is done; a slot whose owner died without giving
+// it back is reclaimed the next time the parent looks for one.
+// Sources: mmap(2), unix(7), prctl(2) PR_SET_PDEATHSIG, https://prometheus.io/docs/instrumenting/exposition_formats/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "otp_metrics.h"
+#include "otp_protocol.h"
+
+static struct otp_metrics privateSlot;
+static struct otp_metrics *slots;
+static int nextSlot = 1;                    // where the parent starts looking for a free slot
+
+struct otp_metrics *otp_metrics_mine = &privateSlot;
+int otp_metrics_contended;
+
+int otp_metrics_init(void)
+{
+	slots = mmap(NULL, OTP_METRICS_SLOTS * sizeof(*slots), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (slots == MAP_FAILED) {
+		slots = NULL;
+		return -1;
+	}
+	otp_metrics_mine = &slots[0];
+	return 0;
+}
+
+struct otp_metrics *otp_metrics_slot(int i)
+{
+	return slots != NULL ? &slots[i] : &privateSlot;
+}
+
+int otp_metrics_claim(void)
+{
+	int tries, i;
+
+	if (slots == NULL) return OTP_METRICS_SHARED;
+	for (tries = 1; tries < OTP_METRICS_SHARED; tries++) {
+		i = nextSlot;
+		nextSlot = nextSlot + 1 < OTP_METRICS_SHARED ? nextSlot + 1 : 1;
+
+		// Take a slot that was given back, or one whose owner died holding it (its connection is gone too)
+		if (__atomic_load_n(&slots[i].inUse, __ATOMIC_ACQUIRE)) {
+			if (slots[i].pid <= 0 || kill(slots[i].pid, 0) == 0 || errno != ESRCH) continue;
+			slots[i].connectionsClosed = slots[i].connections;
+		}
+		slots[i].inUse = 1;
+		slots[i].pid = 0;
+		return i;
+	}
+	return OTP_METRICS_SHARED;
+}
+
+void otp_metrics_adopt(int i)
+{
+	otp_metrics_mine = otp_metrics_slot(i);
+	otp_metrics_contended = i == OTP_METRICS_SHARED;
+	if (otp_metrics_contended) return;
+	otp_metrics_mine->pid = getpid();
+	otp_metrics_mine->inUse = 1;
+}
+
+void otp_metrics_release(void)
+{
+	if (!otp_metrics_contended) __atomic_store_n(&otp_metrics_mine->inUse, 0, __ATOMIC_RELEASE);
+}
+
+//////////////////////////////////////////////////////////////////////
+// stats process
+
+// Totals across every slot
+static void sumSlots(struct otp_metrics *total, int *processes)
+{
+	int i;
+
+	memset(total, 0, sizeof(*total));
+	*processes = 0;
+	for (i = 0; i < OTP_METRICS_SLOTS; i++) {
+		const struct otp_metrics *s = &slots[i];
+
+		total->requests += __atomic_load_n(&s->requests, __ATOMIC_RELAXED);
+		total->connections += __atomic_load_n(&s->connections, __ATOMIC_RELAXED);
+		total->connectionsClosed += __atomic_load_n(&s->connectionsClosed, __ATOMIC_RELAXED);
+		total->handshakeRejections += __atomic_load_n(&s->handshakeRejections, __ATOMIC_RELAXED);
+		total->refusals += __atomic_load_n(&s->refusals, __ATOMIC_RELAXED);
+		total->busyRejections += __atomic_load_n(&s->busyRejections, __ATOMIC_RELAXED);
+		total->deadlineMisses += __atomic_load_n(&s->deadlineMisses, __ATOMIC_RELAXED);
+		total->symbolsCiphered += __atomic_load_n(&s->symbolsCiphered, __ATOMIC_RELAXED);
+		total->bytesReceived += __atomic_load_n(&s->bytesReceived, __ATOMIC_RELAXED);
+		total->bytesSent += __atomic_load_n(&s->bytesSent, __ATOMIC_RELAXED);
+		total->recvErrors += __atomic_load_n(&s->recvErrors, __ATOMIC_RELAXED);
+		total->sendErrors += __atomic_load_n(&s->sendErrors, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&s->inUse, __ATOMIC_RELAXED) && s->pid > 0 && (kill(s->pid, 0) == 0 || errno != ESRCH))
+			(*processes)++;
+	}
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Append one metric with its help and type lines to text
+static size_t metric(char *text, size_t used, size_t size, const char *daemon, const char *name, const char *type,
+	const char *help, double value)
+{
+	int n = snprintf(text + used, size - used, "# HELP %s %s\n# TYPE %s %s\n%s{daemon=\"%s\"} %.17g\n",
+		name, help, name, type, name, daemon, value);
+
+	return n > 0 && used + n < size ? used + n : used;
+}
+
+// Reply to one scrape with the current totals and the rates from the last sample
+static void answerScrape(int fd, const char *daemon, const double *rates)
+{
+	static char text[8192];
+	struct otp_metrics total;
+	struct pollfd pfd;
+	char request[1024];
+	size_t used = 0;
+	int processes;
+
+	// Read (and ignore) the request if the client sends one, without waiting long for clients that do not
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 100) > 0) (void)!recv(fd, request, sizeof(request), MSG_DONTWAIT);
+
+	sumSlots(&total, &processes);
+	used = snprintf(text, sizeof(text), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+	used = metric(text, used, sizeof(text), daemon, "otp_requests_total", "counter", "Requests answered to completion.", total.requests);
+	used = metric(text, used, sizeof(text), daemon, "otp_connections_total", "counter", "Connections accepted.", total.connections);
+	used = metric(text, used, sizeof(text), daemon, "otp_connections_active", "gauge", "Connections currently open.", total.connections - total.connectionsClosed);
+	used = metric(text, used, sizeof(text), daemon, "otp_processes_active", "gauge", "Processes serving connections (forked children, pool workers or the event loop).", processes);
+	used = metric(text, used, sizeof(text), daemon, "otp_handshake_rejections_total", "counter", "Clients whose hello was refused (wrong daemon, protocol version or flags).", total.handshakeRejections);
+	used = metric(text, used, sizeof(text), daemon, "otp_refusals_total", "counter", "Frames refused with an ERROR frame.", total.refusals);
+	used = metric(text, used, sizeof(text), daemon, "otp_busy_rejections_total", "counter", "Connections turned away busy: the --max-inflight queue was full, or they waited in it past --deadline.", total.busyRejections);
+	used = metric(text, used, sizeof(text), daemon, "otp_deadline_misses_total", "counter", "Requests or idle connections cut off by --deadline.", total.deadlineMisses);
+	used = metric(text, used, sizeof(text), daemon, "otp_symbols_ciphered_total", "counter", "Symbols encrypted or decrypted.", total.symbolsCiphered);
+	used = metric(text, used, sizeof(text), daemon, "otp_received_bytes_total", "counter", "Bytes received from clients, hellos included.", total.bytesReceived);
+	used = metric(text, used, sizeof(text), daemon, "otp_sent_bytes_total", "counter", "Bytes sent to clients.", total.bytesSent);
+	used = metric(text, used, sizeof(text), daemon, "otp_recv_errors_total", "counter", "Connections dropped because a receive failed.", total.recvErrors);
+	used = metric(text, used, sizeof(text), daemon, "otp_send_errors_total", "counter", "Connections dropped because a send failed.", total.sendErrors);
+	used = metric(text, used, sizeof(text), daemon, "otp_requests_per_second", "gauge", "Requests completed per second over the last second.", rates[0]);
+	used = metric(text, used, sizeof(text), daemon, "otp_symbols_ciphered_per_second", "gauge", "Symbols ciphered per second over the last second.", rates[1]);
+	used = metric(text, used, sizeof(text), daemon, "otp_received_bytes_per_second", "gauge", "Bytes received per second over the last second.", rates[2]);
+	used = metric(text, used, sizeof(text), daemon, "otp_sent_bytes_per_second", "gauge", "Bytes sent per second over the last second.", rates[3]);
+
+	(void)!send(fd, text, used, MSG_NOSIGNAL);
+}
+
+static void serveStats(int listenFD, const char *daemon)
+{
+	struct otp_metrics previous, total;
+	double rates[4] = { 0, 0, 0, 0 };
+	double sampledAt = seconds(), now;
+	struct pollfd pfd;
+	int processes, fd;
+
+	sumSlots(&previous, &processes);
+	while (1) {
+		pfd.fd = listenFD;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, 1000);
+
+		// Once a second, turn the change in the totals into rates
+		now = seconds();
+		if (now - sampledAt >= 1) {
+			sumSlots(&total, &processes);
+			rates[0] = (total.requests - previous.requests) / (now - sampledAt);
+			rates[1] = (total.symbolsCiphered - previous.symbolsCiphered) / (now - sampledAt);
+			rates[2] = (total.bytesReceived - previous.bytesReceived) / (now - sampledAt);
+			rates[3] = (total.bytesSent - previous.bytesSent) / (now - sampledAt);
+			previous = total;
+			sampledAt = now;
+		}
+
+		if (pfd.revents & POLLIN) {
+			fd = accept(listenFD, NULL, NULL);
+			if (fd < 0) continue;
+			answerScrape(fd, daemon, rates);
+			close(fd);
+		}
+	}
+}
+
+pid_t otp_metrics_serve(const char *address, const char *daemon)
+{
+	struct sockaddr_storage statsAddress;
+	socklen_t addressLength;
+	struct stat info;
+	int listenFD, yes = 1;
+	pid_t pid;
+
+	if (slots == NULL) return -1;
+
+	// A path means a Unix socket, anything else is a port on the loopback interface. Clear away the socket a
+	// previous run left behind, but never any other kind of file.
+	if (otp_address(address, &statsAddress, &addressLength) < 0) { perror("SERVER: ERROR with stats address"); return -1; }
+	if (otp_is_socket_path(address) && lstat(address, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(address);
+	listenFD = socket(statsAddress.ss_family, SOCK_STREAM, 0);
+	if (listenFD >= 0) setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if (listenFD < 0 || bind(listenFD, (struct sockaddr *)&statsAddress, addressLength) < 0) {
+		perror("SERVER: ERROR binding stats socket");
+		return -1;
+	}
+	if (listen(listenFD, 16) < 0) { perror("SERVER: ERROR on stats listen"); return -1; }
+
+	pid = fork();
+	if (pid < 0) { perror("SERVER: ERROR forking stats process"); return -1; }
+	if (pid > 0) {
+		close(listenFD);
+		return pid;
+	}
+
+	// The stats process goes away with the daemon
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() == 1) exit(0);
+	serveStats(listenFD, daemon);
+	exit(0);
+}
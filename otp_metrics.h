@@ -0,0 +1,63 @@
+// Description: Live metrics for otp_enc_d and otp_dec_d.
+// Every process that serves clients (the --epoll process, each pool worker, each forked child) owns one slot of
+// counters in a mapping shared by the whole daemon. Slots are cache line aligned and each has a single writer,
+// so counting on the hot path is a plain add: no lock, no atomic read-modify-write and no cache line shared with
+// another process. Only when more children are alive than there are slots do the extra ones share the last slot,
+// and then they add atomically.
+// With --stats ADDRESS the daemon forks a small stats process that sums the slots whenever it is scraped and
+// serves the totals as Prometheus text over HTTP, on a port on 127.0.0.1 or, if ADDRESS contains a '/', on a
+// Unix socket at that path. It also samples the totals every second to report current rates.
+
+#ifndef OTP_METRICS_H
+#define OTP_METRICS_H
+
+#include <sys/types.h>
+
+#define OTP_METRICS_SLOTS 1024
+#define OTP_METRICS_SHARED (OTP_METRICS_SLOTS - 1)  // the slot children share when every other one is taken
+
+struct otp_metrics {
+	unsigned long requests;             // requests answered to completion (END frames echoed)
+	unsigned long connections;          // connections accepted
+	unsigned long connectionsClosed;
+	unsigned long handshakeRejections;  // hellos refused: otp_enc at otp_dec_d or the reverse, a wrong version or flags
+	unsigned long refusals;             // frames answered with an ERROR frame
+	unsigned long busyRejections;       // connections turned away with a BUSY frame (--max-inflight and --backlog reached)
+	unsigned long deadlineMisses;       // requests cut off by --deadline
+	unsigned long symbolsCiphered;
+	unsigned long bytesReceived;
+	unsigned long bytesSent;
+	unsigned long recvErrors;
+	unsigned long sendErrors;
+	int inUse;                          // a live process owns the slot
+	pid_t pid;                          // which one, once the parent knows
+} __attribute__((aligned(64)));
+
+extern struct otp_metrics *otp_metrics_mine;        // slot this process counts into
+extern int otp_metrics_contended;                   // other processes count into the same slot
+
+// Add n to one of this process' counters
+#define OTP_COUNT(field, n) do { \
+	if (otp_metrics_contended) __atomic_fetch_add(&otp_metrics_mine->field, (n), __ATOMIC_RELAXED); \
+	else __atomic_store_n(&otp_metrics_mine->field, otp_metrics_mine->field + (n), __ATOMIC_RELAXED); \
+} while (0)
+
+// Create the shared slots and count into slot 0, which belongs to the process that calls this. Until then (and
+// in processes that never call it) counting goes to a private slot. Returns 0 on success and -1 on failure.
+int otp_metrics_init(void);
+
+struct otp_metrics *otp_metrics_slot(int i);
+
+// In the parent, before forking a child: reserve a free slot, or return OTP_METRICS_SHARED if there is none
+int otp_metrics_claim(void);
+
+// Start counting into slot i in the process that will own it (atomically if it is OTP_METRICS_SHARED), and give
+// it back when done
+void otp_metrics_adopt(int i);
+void otp_metrics_release(void);
+
+// Open the stats listener on address and fork the process that serves it, labelling every metric with daemon.
+// Returns the stats process' pid, or -1 with a message on stderr.
+pid_t otp_metrics_serve(const char *address, const char *daemon);
+
+#endif
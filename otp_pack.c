@@ -0,0 +1,213 @@
+// Description: Implementation of the packed wire encoding declared in otp_pack.h.
+// The scalar path keeps a 64 bit accumulator of pending bits. The SSE4.1 path turns 24 symbols into indices,
+// gathers the three symbols of each triple into 16 bit lanes with byte shuffles, and combines them with
+// a * 729 + b * 27 + c. It then squeezes the eight 15 bit values into 120 bits in two shift-and-merge rounds.
+// Unpacking runs the same steps backwards and divides by 729 and 27 with multiply-high by a reciprocal.
+// Sources: https://software.intel.com/sites/landingpage/IntrinsicsGuide/, Hacker's Delight ch. 10 (division by constants)
+
+#include <stdint.h>
+#include <string.h>
+#include "otp_pack.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define OTP_PACK_X86 1
+#endif
+
+#define TRIPLES 19683                       // 27^3, the number of valid 15 bit values
+
+static const char characterPool[28] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";     // index -> symbol
+static unsigned char symbolIndex[256];                                    // symbol -> index
+
+//////////////////////////////////////////////////////////////////////
+// scalar kernel
+
+static void scalarPack(unsigned char *out, const char *symbols, size_t n)
+{
+	uint64_t bits = 0;                  // pending bits, the oldest in the lowest position
+	int count = 0;
+	unsigned value;
+	size_t i;
+
+	for (i = 0; i < n; i += 3) {
+		// A missing second or third symbol counts as index 0
+		value = symbolIndex[(unsigned char)symbols[i]] * 729;
+		if (i + 1 < n) value += symbolIndex[(unsigned char)symbols[i + 1]] * 27;
+		if (i + 2 < n) value += symbolIndex[(unsigned char)symbols[i + 2]];
+
+		bits |= (uint64_t)value << count;
+		for (count += 15; count >= 8; count -= 8) {
+			*out++ = bits;
+			bits >>= 8;
+		}
+	}
+	if (count > 0) *out = bits;
+}
+
+static void scalarUnpack(char *out, const unsigned char *packed, size_t n)
+{
+	uint64_t bits = 0;
+	int count = 0;
+	unsigned value;
+	size_t i;
+
+	for (i = 0; i < n; i += 3) {
+		for (; count < 15; count += 8) bits |= (uint64_t)*packed++ << count;
+		value = bits & 0x7fff;
+		bits >>= 15;
+		count -= 15;
+
+		// Values past 27^3 - 1 never come from otp_pack(), but must not run off characterPool
+		if (value >= TRIPLES) value -= TRIPLES;
+		out[i] = characterPool[value / 729];
+		if (i + 1 < n) out[i + 1] = characterPool[value / 27 % 27];
+		if (i + 2 < n) out[i + 2] = characterPool[value % 27];
+	}
+}
+
+static int scalarSupported(void) { return 1; }
+
+#ifdef OTP_PACK_X86
+//////////////////////////////////////////////////////////////////////
+// SSE4.1 kernel - 24 symbols / 15 bytes per step
+
+static inline __attribute__((always_inline, target("sse4.1")))
+void ssePackGroup(unsigned char *out, const char *symbols)
+{
+	const __m128i letterA = _mm_set1_epi8('A');
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i n26 = _mm_set1_epi8(26);
+	__m128i s0 = _mm_loadu_si128((const __m128i *)symbols);
+	__m128i s1 = _mm_loadl_epi64((const __m128i *)(symbols + 16));
+	__m128i a, b, c, value, pairs, quads;
+	uint64_t low, high;
+
+	// Symbol -> index: 'A'..'Z' become 0..25 and ' ' becomes 26
+	s0 = _mm_blendv_epi8(_mm_sub_epi8(s0, letterA), n26, _mm_cmpeq_epi8(s0, space));
+	s1 = _mm_blendv_epi8(_mm_sub_epi8(s1, letterA), n26, _mm_cmpeq_epi8(s1, space));
+
+	// First, second and third symbol of every triple, one triple per 16 bit lane
+	a = _mm_or_si128(_mm_shuffle_epi8(s0, _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, 12, -1, 15, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(s1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, -1, 5, -1)));
+	b = _mm_or_si128(_mm_shuffle_epi8(s0, _mm_setr_epi8(1, -1, 4, -1, 7, -1, 10, -1, 13, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(s1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, -1, 3, -1, 6, -1)));
+	c = _mm_or_si128(_mm_shuffle_epi8(s0, _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, 14, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(s1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, -1, 4, -1, 7, -1)));
+	value = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(a, _mm_set1_epi16(729)), _mm_mullo_epi16(b, _mm_set1_epi16(27))), c);
+
+	// Close the gaps: two 15 bit values per 32 bit lane become 30 bits, two of those per 64 bit lane become 60
+	pairs = _mm_sub_epi32(value, _mm_slli_epi32(_mm_srli_epi32(value, 16), 15));
+	quads = _mm_or_si128(_mm_and_si128(pairs, _mm_set1_epi64x(0xffffffff)), _mm_slli_epi64(_mm_srli_epi64(pairs, 32), 30));
+
+	// And the two 60 bit halves make 120 bits
+	low = _mm_cvtsi128_si64(quads);
+	high = _mm_extract_epi64(quads, 1);
+	low |= high << 60;
+	high >>= 4;
+	memcpy(out, &low, 8);
+	memcpy(out + 8, &high, 7);
+}
+
+static inline __attribute__((always_inline, target("sse4.1")))
+void sseUnpackGroup(char *out, const unsigned char *packed)
+{
+	const __m128i letterA = _mm_set1_epi8('A');
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i n26 = _mm_set1_epi8(26);
+	__m128i quads, pairs, value, a, b, c, rest, ab, cc, s0, s1;
+	uint64_t low, high;
+
+	// 120 bits -> two 60 bit halves -> four 30 bit quarters -> eight 15 bit values in 16 bit lanes.
+	// The top 7 bytes are read as the 8 bytes before them shifted down, which stays within the group
+	memcpy(&low, packed, 8);
+	memcpy(&high, packed + 7, 8);
+	high >>= 8;
+	quads = _mm_set_epi64x(high << 4 | low >> 60, low & ((1ULL << 60) - 1));
+	pairs = _mm_or_si128(_mm_and_si128(quads, _mm_set1_epi64x((1 << 30) - 1)), _mm_slli_epi64(_mm_srli_epi64(quads, 30), 32));
+	value = _mm_or_si128(_mm_and_si128(pairs, _mm_set1_epi32(0x7fff)), _mm_slli_epi32(_mm_srli_epi32(pairs, 15), 16));
+
+	// Fold values past 27^3 - 1 back into range (the subtraction wraps around for the ones already in it)
+	value = _mm_min_epu16(value, _mm_sub_epi16(value, _mm_set1_epi16(TRIPLES)));
+
+	// a = value / 729, b = value % 729 / 27, c = value % 27, dividing with multiply-high
+	a = _mm_srli_epi16(_mm_mulhi_epu16(value, _mm_set1_epi16((short)46029)), 9);
+	rest = _mm_sub_epi16(value, _mm_mullo_epi16(a, _mm_set1_epi16(729)));
+	b = _mm_srli_epi16(_mm_mulhi_epu16(rest, _mm_set1_epi16((short)38837)), 4);
+	c = _mm_sub_epi16(rest, _mm_mullo_epi16(b, _mm_set1_epi16(27)));
+
+	// Interleave them back into symbol order: a0 b0 c0 a1 b1 c1 ...
+	ab = _mm_packus_epi16(a, b);
+	cc = _mm_packus_epi16(c, c);
+	s0 = _mm_or_si128(_mm_shuffle_epi8(ab, _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5)),
+		_mm_shuffle_epi8(cc, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+	s1 = _mm_or_si128(_mm_shuffle_epi8(ab, _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(cc, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1)));
+
+	// Index -> symbol
+	s0 = _mm_blendv_epi8(_mm_add_epi8(s0, letterA), space, _mm_cmpeq_epi8(s0, n26));
+	s1 = _mm_blendv_epi8(_mm_add_epi8(s1, letterA), space, _mm_cmpeq_epi8(s1, n26));
+	_mm_storeu_si128((__m128i *)out, s0);
+	_mm_storel_epi64((__m128i *)(out + 16), s1);
+}
+
+__attribute__((target("sse4.1")))
+static void ssePack(unsigned char *out, const char *symbols, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + OTP_PACK_GROUP <= n; i += OTP_PACK_GROUP) ssePackGroup(out + OTP_PACKED_OFFSET(i), symbols + i);
+
+	// A group ends on a byte boundary, so the scalar path can finish the last few symbols
+	scalarPack(out + OTP_PACKED_OFFSET(i), symbols + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void sseUnpack(char *out, const unsigned char *packed, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + OTP_PACK_GROUP <= n; i += OTP_PACK_GROUP) sseUnpackGroup(out + i, packed + OTP_PACKED_OFFSET(i));
+	scalarUnpack(out + i, packed + OTP_PACKED_OFFSET(i), n - i);
+}
+
+static int sseSupported(void) { __builtin_cpu_init(); return __builtin_cpu_supports("sse4.1"); }
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// dispatch
+
+static const struct otp_pack_kernel kernels[] = {
+	{ "scalar", scalarSupported, scalarPack, scalarUnpack },
+#ifdef OTP_PACK_X86
+	{ "sse4.1", sseSupported, ssePack, sseUnpack },
+#endif
+};
+
+static const struct otp_pack_kernel *selected = &kernels[0];
+
+// Build the lookup table and pick a kernel before main() runs
+__attribute__((constructor))
+static void selectKernel(void)
+{
+	size_t i;
+
+	for (i = 0; i < 26; i++) symbolIndex['A' + i] = i;
+	symbolIndex[' '] = 26;
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) if (kernels[i].supported()) selected = &kernels[i];
+}
+
+void otp_pack(unsigned char *out, const char *symbols, size_t n)
+{
+	selected->pack(out, symbols, n);
+}
+
+void otp_unpack(char *out, const unsigned char *packed, size_t n)
+{
+	selected->unpack(out, packed, n);
+}
+
+const struct otp_pack_kernel *otp_pack_kernels(size_t *count)
+{
+	*count = sizeof(kernels) / sizeof(kernels[0]);
+	return kernels;
+}
@@ -0,0 +1,44 @@
+// Description: Packed wire encoding of the 27 symbol alphabet, used by otp_enc/otp_dec and the daemons when a client
+// asks for it (see otp_protocol.h).
+// A symbol carries log2(27) = 4.75 bits, so three of them (27^3 = 19683 < 2^15) fit in 15 bits: the triple
+// (a, b, c) of symbol indices becomes a * 729 + b * 27 + c. The 15 bit values are laid end to end, least
+// significant bit first, and the last triple is filled up with index 0, so n symbols take
+// ceil(ceil(n / 3) * 15 / 8) bytes, 37.5% fewer than one byte per symbol. Every 24 symbols come to exactly
+// 15 bytes, so a packed buffer can be split on any multiple of 24 symbols.
+// Packing and unpacking have a scalar path and an SSE4.1 path that handles 24 symbols per step; the faster one
+// the CPU supports is picked once at startup. Unpacking accepts any bytes, since they come off the network, and
+// always produces symbols of the alphabet.
+
+#ifndef OTP_PACK_H
+#define OTP_PACK_H
+
+#include <stddef.h>
+
+#define OTP_PACK_GROUP 24                   // symbols that pack into a whole number of bytes
+#define OTP_PACK_GROUP_BYTES 15
+
+#define OTP_PACKED_TEXT 1                   // otp_cipher_packed(): the text (and the result) are packed
+#define OTP_PACKED_KEY 2                    // otp_cipher_packed(): the key is packed too
+
+// Bytes n symbols take packed
+#define OTP_PACKED_SIZE(n) ((((n) + 2) / 3 * 15 + 7) / 8)
+
+// Offset in a packed buffer of symbol i, which must be a multiple of OTP_PACK_GROUP
+#define OTP_PACKED_OFFSET(i) ((i) / OTP_PACK_GROUP * OTP_PACK_GROUP_BYTES)
+
+// One implementation of packing and unpacking
+struct otp_pack_kernel {
+	const char *name;                   // "scalar" or "sse4.1"
+	int (*supported)(void);             // non-zero if this CPU can run it
+	void (*pack)(unsigned char *out, const char *symbols, size_t n);
+	void (*unpack)(char *out, const unsigned char *packed, size_t n);
+};
+
+// Pack n symbols into OTP_PACKED_SIZE(n) bytes, and back
+void otp_pack(unsigned char *out, const char *symbols, size_t n);
+void otp_unpack(char *out, const unsigned char *packed, size_t n);
+
+// Every kernel compiled in, slowest first, so benchmarks and checks can call a specific one
+const struct otp_pack_kernel *otp_pack_kernels(size_t *count);
+
+#endif
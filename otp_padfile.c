@@ -0,0 +1,232 @@
+// Description: Implementation of the pad container format declared in otp_padfile.h.
+// Checksums are CRC-32C (the Castagnoli polynomial), computed with the SSE4.2 crc32 instruction 8 bytes at a time
+// where the CPU has it and with a lookup table otherwise; both give the same values, so a pad written on one host
+// checks out on any other.
+// Sources: RFC 3720 appendix B.4 (CRC-32C), mmap(2)
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "otp_padfile.h"
+#include "otp_cipher.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define OTP_PADFILE_X86 1
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82f63b78        // reflected
+
+static uint32_t crcTable[256];
+static uint32_t (*crcUpdate)(uint32_t crc, const unsigned char *data, size_t n);
+
+//////////////////////////////////////////////////////////////////////
+// checksums
+
+static uint32_t tableUpdate(uint32_t crc, const unsigned char *data, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef OTP_PADFILE_X86
+__attribute__((target("sse4.2")))
+static uint32_t sseUpdate(uint32_t crc, const unsigned char *data, size_t n)
+{
+	uint64_t word, wide = crc;
+	size_t i = 0;
+
+	// memcpy() keeps the unaligned loads legal and compiles to plain moves
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&word, data + i, 8);
+		wide = _mm_crc32_u64(wide, word);
+	}
+	return tableUpdate((uint32_t)wide, data + i, n - i);
+}
+#endif
+
+// Build the table and pick the fastest path before main() runs
+__attribute__((constructor))
+static void selectChecksum(void)
+{
+	uint32_t crc;
+	int i, bit;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (bit = 0; bit < 8; bit++) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+		crcTable[i] = crc;
+	}
+	crcUpdate = tableUpdate;
+#ifdef OTP_PADFILE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) crcUpdate = sseUpdate;
+#endif
+}
+
+uint32_t otp_padfile_checksum(const void *data, size_t n)
+{
+	return ~crcUpdate(~0u, data, n);
+}
+
+//////////////////////////////////////////////////////////////////////
+// layout
+
+static void put32(unsigned char *at, uint32_t value)
+{
+	value = htonl(value);
+	memcpy(at, &value, 4);
+}
+
+static void put64(unsigned char *at, uint64_t value)
+{
+	put32(at, value >> 32);
+	put32(at + 4, (uint32_t)value);
+}
+
+static uint32_t get32(const unsigned char *at)
+{
+	uint32_t value;
+
+	memcpy(&value, at, 4);
+	return ntohl(value);
+}
+
+static uint64_t get64(const unsigned char *at)
+{
+	return ((uint64_t)get32(at) << 32) | get32(at + 4);
+}
+
+// Header fields
+#define AT_VERSION 8
+#define AT_ALPHABET 12
+#define AT_LENGTH 16
+#define AT_SEGMENT_SIZE 24
+#define AT_GENERATOR 32
+#define AT_DATA 48
+#define AT_INDEX_CHECKSUM 56
+#define AT_HEADER_CHECKSUM 60
+
+uint64_t otp_padfile_data_offset(uint64_t segmentCount)
+{
+	uint64_t end = OTP_PADFILE_HEADER + segmentCount * OTP_PADFILE_ENTRY;
+
+	return (end + OTP_PADFILE_ALIGN - 1) / OTP_PADFILE_ALIGN * OTP_PADFILE_ALIGN;
+}
+
+void otp_padfile_put_entry(unsigned char *file, uint64_t i, uint32_t segmentSize, uint32_t length, uint32_t checksum)
+{
+	unsigned char *entry = file + OTP_PADFILE_HEADER + i * OTP_PADFILE_ENTRY;
+
+	put64(entry, i * segmentSize);
+	put32(entry + 8, length);
+	put32(entry + 12, checksum);
+}
+
+void otp_padfile_put_header(unsigned char *file, uint64_t length, int alphabet, uint32_t segmentSize, const char *generator)
+{
+	uint64_t segmentCount = (length + segmentSize - 1) / segmentSize;
+
+	memset(file, 0, OTP_PADFILE_HEADER);
+	memcpy(file, OTP_PADFILE_MAGIC, 8);
+	put32(file + AT_VERSION, OTP_PADFILE_VERSION);
+	put32(file + AT_ALPHABET, alphabet);
+	put64(file + AT_LENGTH, length);
+	put32(file + AT_SEGMENT_SIZE, segmentSize);
+	strncpy((char *)file + AT_GENERATOR, generator, OTP_PADFILE_GENERATOR);
+	put64(file + AT_DATA, otp_padfile_data_offset(segmentCount));
+	put32(file + AT_INDEX_CHECKSUM, otp_padfile_checksum(file + OTP_PADFILE_HEADER, segmentCount * OTP_PADFILE_ENTRY));
+	put32(file + AT_HEADER_CHECKSUM, otp_padfile_checksum(file, AT_HEADER_CHECKSUM));
+}
+
+//////////////////////////////////////////////////////////////////////
+// reading
+
+int otp_padfile_is_container(const void *file, size_t length)
+{
+	return length >= OTP_PADFILE_HEADER && memcmp(file, OTP_PADFILE_MAGIC, 8) == 0;
+}
+
+int otp_padfile_open(struct otp_padfile *pad, const void *file, size_t length, const char **reason)
+{
+	const unsigned char *f = file;
+	const unsigned char *entry;
+	uint64_t dataOffset, segmentLength, i;
+
+	memset(pad, 0, sizeof(*pad));
+	if (!otp_padfile_is_container(file, length)) { *reason = "not a pad container"; return -1; }
+	if (get32(f + AT_HEADER_CHECKSUM) != otp_padfile_checksum(f, AT_HEADER_CHECKSUM)) { *reason = "pad header is damaged"; return -1; }
+	if (get32(f + AT_VERSION) != OTP_PADFILE_VERSION) { *reason = "pad container version not supported"; return -1; }
+
+	pad->file = f;
+	pad->alphabet = get32(f + AT_ALPHABET);
+	pad->length = get64(f + AT_LENGTH);
+	pad->segmentSize = get32(f + AT_SEGMENT_SIZE);
+	memcpy(pad->generator, f + AT_GENERATOR, OTP_PADFILE_GENERATOR);
+	dataOffset = get64(f + AT_DATA);
+	if (pad->alphabet != OTP_PADFILE_SYMBOLS && pad->alphabet != OTP_PADFILE_BYTES) { *reason = "pad alphabet not supported"; return -1; }
+	if (pad->segmentSize == 0) { *reason = "pad header is damaged"; return -1; }
+	pad->segmentCount = (pad->length + pad->segmentSize - 1) / pad->segmentSize;
+
+	// The index has to fit before the symbols, and the symbols have to be all there
+	if (pad->segmentCount > length / OTP_PADFILE_ENTRY || dataOffset != otp_padfile_data_offset(pad->segmentCount) || dataOffset > length) {
+		*reason = "pad index is damaged";
+		return -1;
+	}
+	if (length - dataOffset < pad->length) { *reason = "pad is truncated"; return -1; }
+	if (get32(f + AT_INDEX_CHECKSUM) != otp_padfile_checksum(f + OTP_PADFILE_HEADER, pad->segmentCount * OTP_PADFILE_ENTRY)) {
+		*reason = "pad index is damaged";
+		return -1;
+	}
+	for (i = 0; i < pad->segmentCount; i++) {
+		entry = f + OTP_PADFILE_HEADER + i * OTP_PADFILE_ENTRY;
+		segmentLength = i + 1 < pad->segmentCount ? pad->segmentSize : pad->length - i * pad->segmentSize;
+		if (get64(entry) != i * pad->segmentSize || get32(entry + 8) != segmentLength) { *reason = "pad index is damaged"; return -1; }
+	}
+	pad->data = (const char *)f + dataOffset;
+
+	// Shared, so a segment checked by one forked child or pool worker is not checked again by the others
+	if (pad->segmentCount > 0) {
+		pad->verified = mmap(NULL, pad->segmentCount, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (pad->verified == MAP_FAILED) { pad->verified = NULL; *reason = "out of memory"; return -1; }
+	}
+	return 0;
+}
+
+void otp_padfile_close(struct otp_padfile *pad)
+{
+	if (pad->verified != NULL) munmap(pad->verified, pad->segmentCount);
+	pad->verified = NULL;
+}
+
+const char *otp_padfile_symbols(struct otp_padfile *pad, uint64_t offset, size_t n, const char **reason)
+{
+	uint64_t s, last;
+	const unsigned char *entry;
+	unsigned char state;
+
+	if (offset > pad->length || n > pad->length - offset) { *reason = "range runs past the end of the pad"; return NULL; }
+	if (n == 0) return pad->data + offset;
+
+	// Check each segment the range touches the first time it is touched; two processes racing to check the same
+	// one both come to the same answer
+	last = (offset + n - 1) / pad->segmentSize;
+	for (s = offset / pad->segmentSize; s <= last; s++) {
+		state = __atomic_load_n(&pad->verified[s], __ATOMIC_RELAXED);
+		if (state == 0) {
+			entry = pad->file + OTP_PADFILE_HEADER + s * OTP_PADFILE_ENTRY;
+			state = otp_padfile_checksum(pad->data + s * pad->segmentSize, get32(entry + 8)) == get32(entry + 12) ? 1 : 2;
+
+			// A symbol pad must also hold nothing but symbols, or that byte would cipher as a space
+			if (state == 1 && pad->alphabet == OTP_PADFILE_SYMBOLS &&
+				otp_check_symbols(pad->data + s * pad->segmentSize, get32(entry + 8)) != get32(entry + 8)) state = 3;
+			__atomic_store_n(&pad->verified[s], state, __ATOMIC_RELAXED);
+		}
+		if (state == 2) { *reason = "pad segment failed its checksum"; return NULL; }
+		if (state == 3) { *reason = "pad segment holds a byte outside the alphabet"; return NULL; }
+	}
+	return pad->data + offset;
+}
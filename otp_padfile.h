@@ -0,0 +1,66 @@
+// Description: Pad container format, an alternative to the plain keygen key for large pads.
+// A plain key is one newline-terminated line, so using it from an offset means trusting every symbol before it,
+// and a truncated or damaged pad goes unnoticed until a message fails to decrypt. A container (keygen
+// --container) holds the same symbols in fixed-size segments, each with a CRC-32C checksum, behind a header and
+// an index of the segments:
+//   header (OTP_PADFILE_HEADER bytes)  magic, format version, alphabet, length in symbols, segment size,
+//                                      generator id, offset of the symbols, and checksums of the index and header
+//   index (16 bytes per segment)       the pad offset of the segment's first symbol, its length and its checksum
+//   symbols                            from a page aligned offset to the end of the file, with no newline
+// Numbers are stored in network byte order, so a pad can be carried between hosts. The symbols of all segments
+// lie end to end, so once the file is mapped, symbol i is at data + i for any i and a range can be handed to
+// sendmsg() or the cipher as it is. Opening a container checks the header, the index and that the file is long
+// enough, which catches truncation at once. A segment's checksum and alphabet are only checked the first time a
+// range touches it, so opening even a large pad reads little more than its index.
+
+#ifndef OTP_PADFILE_H
+#define OTP_PADFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTP_PADFILE_MAGIC "OTPPAD\r\n"      // 8 bytes; the CR LF catches a pad mangled by a text mode copy
+#define OTP_PADFILE_VERSION 1
+#define OTP_PADFILE_HEADER 64
+#define OTP_PADFILE_ENTRY 16                // size of one index entry
+#define OTP_PADFILE_SEGMENT (1 << 20)       // symbols per segment written by keygen
+#define OTP_PADFILE_ALIGN 4096              // the symbols start on a multiple of this
+#define OTP_PADFILE_GENERATOR 16            // bytes of the generator id, padded with NULs
+
+#define OTP_PADFILE_SYMBOLS 0               // alphabet: the 27 symbols 'A'..'Z' and ' '
+#define OTP_PADFILE_BYTES 1                 // alphabet: raw bytes, for binary mode
+
+// An opened container. It points into the mapping it was opened from, which must stay mapped.
+struct otp_padfile {
+	const unsigned char *file;
+	const char *data;                   // the first symbol
+	uint64_t length;                    // symbols in the pad
+	int alphabet;
+	uint32_t segmentSize;
+	uint64_t segmentCount;
+	char generator[OTP_PADFILE_GENERATOR + 1];
+	unsigned char *verified;            // per segment: 0 unchecked, 1 good, 2 damaged, 3 not symbols; shared with forked children
+};
+
+// Non-zero if the length bytes at file start like a container
+int otp_padfile_is_container(const void *file, size_t length);
+
+// Open the container mapped at file. Returns 0 on success, or -1 with *reason set if it is not a container, the
+// header or index is damaged, or the file is shorter than the header says.
+int otp_padfile_open(struct otp_padfile *pad, const void *file, size_t length, const char **reason);
+void otp_padfile_close(struct otp_padfile *pad);
+
+// Return the n symbols of the pad from offset, checking every segment in the range that has not been checked yet
+// (its checksum and, for a symbol pad, its alphabet). Returns NULL with *reason set if the range runs past the end
+// of the pad, a segment fails its checksum or a segment of a symbol pad holds a byte outside the alphabet.
+const char *otp_padfile_symbols(struct otp_padfile *pad, uint64_t offset, size_t n, const char **reason);
+
+// For writers: the offset of the symbols in a container of segmentCount segments, the header, one index entry
+// (for segment i, of length symbols), and the checksum of n symbols. The header's index checksum is taken from
+// the index entries, which must be filled in first.
+uint64_t otp_padfile_data_offset(uint64_t segmentCount);
+void otp_padfile_put_header(unsigned char *file, uint64_t length, int alphabet, uint32_t segmentSize, const char *generator);
+void otp_padfile_put_entry(unsigned char *file, uint64_t i, uint32_t segmentSize, uint32_t length, uint32_t checksum);
+uint32_t otp_padfile_checksum(const void *data, size_t n);
+
+#endif
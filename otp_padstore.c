@@ -0,0 +1,187 @@
+// Description: Implementation of the server-resident pad store declared in otp_padstore.h.
+// The index file is a small header followed by up to INDEX_CAPACITY intervals [start, end), sorted and never
+// touching (neighbouring claims are merged), so a pad used front to back stays a single interval. The file is
+// created sparse, so the capacity costs nothing until it is used.
+// A pad may also be a container (see otp_padfile.h): its symbols are then found through the container's header,
+// and every segment a claim touches is checked against its checksum and the alphabet the first time, before the
+// range is recorded.
+// Sources: mmap(2), fcntl(2) record locks
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "otp_padstore.h"
+#include "otp_padfile.h"
+#include "otp_cipher.h"
+
+#define MAX_PADS 16
+#define INDEX_MAGIC "OTPUSED1"
+#define INDEX_CAPACITY (1 << 20)            // intervals the index can hold
+
+struct interval {
+	uint64_t start;
+	uint64_t end;                       // one past the last consumed symbol
+};
+
+struct indexFile {
+	char magic[8];
+	uint64_t count;                     // intervals in use
+	struct interval intervals[INDEX_CAPACITY];
+};
+
+struct pad {
+	uint32_t id;
+	const char *data;                   // the mapped pad symbols
+	uint64_t length;                    // symbols before the terminating newline
+	int isContainer;
+	struct otp_padfile container;
+	int indexFD;                        // locked around every claim
+	struct indexFile *index;
+};
+
+static struct pad pads[MAX_PADS];
+static int padCount;
+
+int otp_padstore_add(uint32_t id, const char *path, const char *owner)
+{
+	struct pad *p;
+	struct stat info;
+	char indexPath[4096];
+	const char *reason;
+	size_t bad;
+	int fd, i;
+
+	if (padCount == MAX_PADS) { fprintf(stderr, "SERVER: ERROR too many pads (at most %d)\n", MAX_PADS); return -1; }
+	for (i = 0; i < padCount; i++) {
+		if (pads[i].id == id) { fprintf(stderr, "SERVER: ERROR pad id %u is given twice\n", (unsigned)id); return -1; }
+	}
+	p = &pads[padCount];
+
+	// Map the pad itself
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &info) < 0 || info.st_size == 0) {
+		fprintf(stderr, "SERVER: ERROR could not open pad %s\n", path);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	p->data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p->data == MAP_FAILED) { perror("SERVER: ERROR mapping pad"); return -1; }
+	p->length = info.st_size;
+	p->isContainer = otp_padfile_is_container(p->data, info.st_size);
+	if (p->isContainer) {
+		if (otp_padfile_open(&p->container, p->data, info.st_size, &reason) < 0) { fprintf(stderr, "SERVER: ERROR %s: %s\n", path, reason); return -1; }
+		if (p->container.alphabet != OTP_PADFILE_SYMBOLS) { fprintf(stderr, "SERVER: ERROR %s is a binary pad\n", path); return -1; }
+		p->data = p->container.data;
+		p->length = p->container.length;
+	}
+	else {
+		if (p->data[p->length - 1] == '\n') p->length--;
+
+		// A byte outside the alphabet would cipher as a space and leave that symbol of the text in the clear. A
+		// container's segments are checked as they are first claimed instead, so a large one is not read up front.
+		bad = otp_check_symbols(p->data, p->length);
+		if (bad < p->length) {
+			fprintf(stderr, "SERVER: ERROR invalid character in pad %s: symbol %zu is 0x%02x\n", path, bad, (unsigned char)p->data[bad]);
+			return -1;
+		}
+	}
+	p->id = id;
+
+	// Map (creating it the first time) the index of ranges this daemon has already used
+	snprintf(indexPath, sizeof(indexPath), "%s.%s.used", path, owner);
+	p->indexFD = open(indexPath, O_RDWR | O_CREAT, 0600);
+	if (p->indexFD < 0 || fstat(p->indexFD, &info) < 0) { perror("SERVER: ERROR opening pad index"); return -1; }
+	if (info.st_size < (off_t)sizeof(struct indexFile) && ftruncate(p->indexFD, sizeof(struct indexFile)) < 0) {
+		perror("SERVER: ERROR sizing pad index");
+		return -1;
+	}
+	p->index = mmap(NULL, sizeof(struct indexFile), PROT_READ | PROT_WRITE, MAP_SHARED, p->indexFD, 0);
+	if (p->index == MAP_FAILED) { perror("SERVER: ERROR mapping pad index"); return -1; }
+	if (memcmp(p->index->magic, INDEX_MAGIC, sizeof(p->index->magic)) != 0) {
+		if (p->index->count != 0) { fprintf(stderr, "SERVER: ERROR %s is not a pad index\n", indexPath); return -1; }
+		memcpy(p->index->magic, INDEX_MAGIC, sizeof(p->index->magic));
+	}
+
+	padCount++;
+	return 0;
+}
+
+// Take or drop the write lock on a pad's index (fcntl locks belong to the process, so forked children and pool
+// workers exclude each other, and the lock goes away if a holder dies)
+static int lockIndex(struct pad *p, int type)
+{
+	struct flock lock;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	while (fcntl(p->indexFD, F_SETLKW, &lock) < 0) {
+		if (errno != EINTR) return -1;
+	}
+	return 0;
+}
+
+// Record [start, end) as consumed. Returns -1 if any of it already is and -2 if the index is full.
+static int claimRange(struct indexFile *index, uint64_t start, uint64_t end)
+{
+	struct interval *v = index->intervals;
+	uint64_t low = 0, high = index->count;
+	uint64_t at;
+	int joinsPrevious, joinsNext;
+
+	// Binary search for the first interval that ends after start
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+
+		if (v[middle].end <= start) low = middle + 1;
+		else high = middle;
+	}
+	at = low;
+	if (at < index->count && v[at].start < end) return -1;
+
+	// Merge with the neighbours where the ranges touch, otherwise insert a new interval
+	joinsPrevious = at > 0 && v[at - 1].end == start;
+	joinsNext = at < index->count && v[at].start == end;
+	if (joinsPrevious && joinsNext) {
+		v[at - 1].end = v[at].end;
+		memmove(&v[at], &v[at + 1], (index->count - at - 1) * sizeof(*v));
+		index->count--;
+	}
+	else if (joinsPrevious) v[at - 1].end = end;
+	else if (joinsNext) v[at].start = start;
+	else {
+		if (index->count == INDEX_CAPACITY) return -2;
+		memmove(&v[at + 1], &v[at], (index->count - at) * sizeof(*v));
+		v[at].start = start;
+		v[at].end = end;
+		index->count++;
+	}
+	return 0;
+}
+
+const char *otp_padstore_claim(uint32_t id, uint64_t offset, size_t n, const char **reason)
+{
+	struct pad *p = NULL;
+	int i, result;
+
+	for (i = 0; i < padCount && p == NULL; i++) if (pads[i].id == id) p = &pads[i];
+	if (p == NULL) { *reason = "unknown pad"; return NULL; }
+	if (offset > p->length || n > p->length - offset) { *reason = "range runs past the end of the pad"; return NULL; }
+	if (p->isContainer && otp_padfile_symbols(&p->container, offset, n, reason) == NULL) return NULL;
+	if (n == 0) return p->data + offset;
+
+	if (lockIndex(p, F_WRLCK) < 0) { *reason = "could not lock the pad index"; return NULL; }
+	result = claimRange(p->index, offset, offset + n);
+	lockIndex(p, F_UNLCK);
+
+	if (result == -2) { *reason = "pad index is full"; return NULL; }
+	if (result < 0) { *reason = "pad range already used"; return NULL; }
+	return p->data + offset;
+}
@@ -0,0 +1,25 @@
+// Description: Server-resident pad store for otp_enc_d and otp_dec_d.
+// A daemon started with --pad ID:PATH maps the pad file (a keygen key or a pad container, see otp_padfile.h)
+// read-only, and clients then send only their text plus a (pad id, offset) reference instead of shipping the key.
+// Every range of the pad a daemon ciphers with is recorded as consumed, so the same pad symbols can never be used
+// twice. Consumed ranges are kept as a sorted array of disjoint, coalesced intervals in PATH.<daemon>.used, which
+// is mapped shared so forked children and pool workers all see the same index, and which survives restarts. A
+// claim is checked with a binary search under an fcntl() record lock.
+
+#ifndef OTP_PADSTORE_H
+#define OTP_PADSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Map the pad at path under id, with its consumed-range index named after owner (the daemon name).
+// Returns 0 on success and -1 with a message on stderr on failure, which includes an id already in use and a plain
+// key holding a byte outside the alphabet (a container's segments are checked by otp_padstore_claim() instead).
+int otp_padstore_add(uint32_t id, const char *path, const char *owner);
+
+// Claim n pad symbols starting at offset. Returns a pointer to the symbols, or NULL with *reason set if the pad
+// is unknown, the range runs past the end of the pad, any part of it has been used before or it touches a damaged
+// segment of a container, or one holding a byte outside the alphabet.
+const char *otp_padstore_claim(uint32_t id, uint64_t offset, size_t n, const char **reason);
+
+#endif
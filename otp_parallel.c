@@ -0,0 +1,176 @@
+// Description: Implementation of the thread pool declared in otp_parallel.h.
+// A batch is a table of blocks, and block i belongs to thread i % threads. One 64 bit word per thread describes its
+// share: the batch number, and the range [head, tail) of the blocks not taken yet, counted in steps of threads. The
+// owner takes from the head and thieves take from the tail, both with a compare-and-swap on the whole word. So a
+// block is handed out exactly once, and a thread still looking at an old batch can never take a block from a
+// new one. Idle helpers sleep on a condition variable until the next batch is submitted.
+// Sources: pthreads(7), https://gcc.gnu.org/onlinedocs/gcc/_005f_005fatomic-Builtins.html
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include "otp_cipher.h"
+#include "otp_pack.h"
+#include "otp_parallel.h"
+
+#define MAX_THREADS 64
+#define MAX_STEPS (1 << 20)                 // blocks one thread's share can hold
+
+#define SHARE(batch, head, tail) ((uint64_t)(batch) << 40 | (uint64_t)(head) << 20 | (tail))
+#define SHARE_BATCH(s) ((s) >> 40)
+#define SHARE_HEAD(s) ((s) >> 20 & (MAX_STEPS - 1))
+#define SHARE_TAIL(s) ((s) & (MAX_STEPS - 1))
+#define BATCH_MASK ((1 << 24) - 1)
+
+// A run of symbols of one frame
+struct block {
+	struct otp_parallel_frame *frame;
+	size_t offset;
+	size_t n;
+};
+
+// One thread's blocks, on a cache line of its own so the threads do not fight over it
+struct share {
+	uint64_t word;
+	char pad[64 - sizeof(uint64_t)];
+};
+
+static struct share shares[MAX_THREADS];
+static struct block *blocks;
+static size_t blockCapacity;
+static int direction;
+static int threadCount = 1;
+static uint64_t batch;                      // batches submitted so far; helpers wait for it to change
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submitted = PTHREAD_COND_INITIALIZER;
+
+// Take a block of owner's share in batch current, from the front or (when stealing) from the back.
+// Returns the block's index, or -1 if the share is empty.
+static long takeBlock(int owner, int fromBack, uint64_t current)
+{
+	uint64_t s = __atomic_load_n(&shares[owner].word, __ATOMIC_ACQUIRE), next, head, tail;
+
+	do {
+		head = SHARE_HEAD(s);
+		tail = SHARE_TAIL(s);
+		if (SHARE_BATCH(s) != current || head >= tail) return -1;
+		next = fromBack ? SHARE(current, head, tail - 1) : SHARE(current, head + 1, tail);
+	} while (!__atomic_compare_exchange_n(&shares[owner].word, &s, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return (long)(fromBack ? tail - 1 : head) * threadCount + owner;
+}
+
+// Cipher one block, from thread self's own share if it has any left and otherwise stolen from another thread.
+// Returns 0 if there was nothing left to do.
+static int runBlock(int self, uint64_t current)
+{
+	struct otp_parallel_frame *f;
+	struct block *b;
+	long i = takeBlock(self, 0, current);
+	int victim;
+
+	for (victim = (self + 1) % threadCount; i < 0 && victim != self; victim = (victim + 1) % threadCount)
+		i = takeBlock(victim, 1, current);
+	if (i < 0) return 0;
+
+	// The frame may be handed back to the caller the moment its last block is counted, so count last
+	b = &blocks[i];
+	f = b->frame;
+	if (f->packing == 0) otp_cipher(f->binary ? OTP_XOR : direction, f->text + b->offset, f->text + b->offset, f->key + b->offset, b->n);
+	else otp_cipher_packed(direction, (unsigned char *)f->text + OTP_PACKED_OFFSET(b->offset),
+		f->key + (f->packing & OTP_PACKED_KEY ? OTP_PACKED_OFFSET(b->offset) : b->offset), f->packing, b->n);
+	__atomic_sub_fetch(&f->pending, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static void *helper(void *argument)
+{
+	int self = (int)(intptr_t)argument;
+	uint64_t seen = 0;
+
+	while (1) {
+		pthread_mutex_lock(&lock);
+		while (batch == seen) pthread_cond_wait(&submitted, &lock);
+		seen = batch;
+		pthread_mutex_unlock(&lock);
+
+		while (runBlock(self, seen & BATCH_MASK));
+	}
+	return NULL;
+}
+
+int otp_parallel_start(int threads)
+{
+	sigset_t all, previous;
+	pthread_t thread;
+	int i;
+
+	if (threadCount > 1 || threads <= 1) return threadCount;
+	if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+	// Helpers leave every signal to the thread that started them
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &previous);
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&thread, NULL, helper, (void *)(intptr_t)i) != 0) break;
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	threadCount = i;
+	return threadCount;
+}
+
+void otp_parallel_submit(int d, struct otp_parallel_frame *frames, int count)
+{
+	size_t total = 0, b = 0, offset, n;
+	uint64_t current;
+	int f, t;
+
+	for (f = 0; f < count; f++) total += (frames[f].n + OTP_PARALLEL_BLOCK - 1) / OTP_PARALLEL_BLOCK;
+
+	// Make room for the block table, or cipher the batch right here if it cannot be split up
+	if (total > blockCapacity) {
+		struct block *bigger = total / threadCount < MAX_STEPS ? realloc(blocks, total * sizeof(*blocks)) : NULL;
+
+		if (bigger == NULL) {
+			for (f = 0; f < count; f++) {
+				if (frames[f].packing == 0) otp_cipher(frames[f].binary ? OTP_XOR : d, frames[f].text, frames[f].text, frames[f].key, frames[f].n);
+				else otp_cipher_packed(d, (unsigned char *)frames[f].text, frames[f].key, frames[f].packing, frames[f].n);
+				frames[f].pending = 0;
+			}
+			return;
+		}
+		blocks = bigger;
+		blockCapacity = total;
+	}
+
+	for (f = 0; f < count; f++) {
+		frames[f].pending = 0;
+		for (offset = 0; offset < frames[f].n; offset += n) {
+			n = frames[f].n - offset < OTP_PARALLEL_BLOCK ? frames[f].n - offset : OTP_PARALLEL_BLOCK;
+			blocks[b].frame = &frames[f];
+			blocks[b].offset = offset;
+			blocks[b].n = n;
+			frames[f].pending++;
+			b++;
+		}
+	}
+	direction = d;
+
+	// Publish every share under the new batch number, then wake the helpers
+	pthread_mutex_lock(&lock);
+	batch++;
+	current = batch & BATCH_MASK;
+	for (t = 0; t < threadCount; t++)
+		__atomic_store_n(&shares[t].word, SHARE(current, 0, total > (size_t)t ? (total - t + threadCount - 1) / threadCount : 0), __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&submitted);
+	pthread_mutex_unlock(&lock);
+}
+
+void otp_parallel_wait(struct otp_parallel_frame *frame)
+{
+	// Thread 0's share holds the first block of every round, so the caller works on the front of the batch
+	while (__atomic_load_n(&frame->pending, __ATOMIC_ACQUIRE) > 0)
+		if (!runBlock(0, batch & BATCH_MASK)) sched_yield();
+}
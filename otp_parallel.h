@@ -0,0 +1,41 @@
+// Description: Work-stealing thread pool that spreads the ciphering of one large request over several cores.
+// The daemon hands it a batch of frames. Each frame is cut into blocks of OTP_PARALLEL_BLOCK symbols, small
+// enough that a block's text and key stay in a core's cache while it is ciphered, and a whole number of packed
+// groups (see otp_pack.h) so packed frames split on byte boundaries. Blocks are dealt out round robin,
+// so the leading blocks of the batch are ciphered first. Each thread takes its own blocks from the front of its
+// share, and once that is empty it steals from the back of another thread's share, so one slow or descheduled
+// thread does not hold the batch up. The calling thread works as well while it waits.
+// Every frame counts the blocks it still has outstanding, so the caller can wait for the frames in order and send
+// each one as soon as it is done while later ones are still being ciphered. Blocks are ciphered in place, so the
+// output keeps the input order whatever order the blocks finish in.
+
+#ifndef OTP_PARALLEL_H
+#define OTP_PARALLEL_H
+
+#include <stddef.h>
+
+#define OTP_PARALLEL_BLOCK 12288            // symbols per block: text and key together take 24 KiB
+#define OTP_PARALLEL_MIN (1 << 20)          // a request is only ciphered in parallel past this many symbols
+
+// One frame of a batch
+struct otp_parallel_frame {
+	char *text;                         // ciphered in place
+	const char *key;
+	size_t n;
+	int packing;                        // OTP_PACKED_TEXT / OTP_PACKED_KEY if text / key are packed, else 0
+	int binary;                         // raw bytes, ciphered with OTP_XOR whatever the batch's direction
+	int pending;                        // blocks not ciphered yet, set by otp_parallel_submit()
+};
+
+// Start threads - 1 helper threads (the caller is the last one) unless they are already running.
+// Returns the number of threads ciphering, which is 1 if none could be started.
+int otp_parallel_start(int threads);
+
+// Queue every block of count frames. frames must stay put until otp_parallel_wait() has returned for each of them,
+// and the next batch may only be submitted after that.
+void otp_parallel_submit(int direction, struct otp_parallel_frame *frames, int count);
+
+// Cipher queued blocks until frame is done
+void otp_parallel_wait(struct otp_parallel_frame *frame);
+
+#endif
@@ -0,0 +1,621 @@
+// Description: Implementation of the framing helpers declared in otp_protocol.h.
+// Sources: Beej's Guide - http://beej.us/guide/bgnet/html/single/bgnet.html (sendall), mmap(2), sendmsg(2), unix(7),
+// tcp(7) TCP_NODELAY and TCP_FASTOPEN_CONNECT, getaddrinfo(3)
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "otp_pack.h"
+#include "otp_protocol.h"
+
+struct otp_io_counters otp_io;
+char otp_reject_reason[OTP_REASON_MAX + 1];
+uint32_t otp_busy_hint;
+int otp_pack_frames;
+int otp_binary_frames;
+int otp_fast_open;
+
+void otp_print_io_counters(const char *who)
+{
+	fprintf(stderr, "%s: %lu syscalls, %lu bytes sent, %lu bytes received, %lu bytes copied in user space, %lu zero-copy sends\n",
+		who, otp_io.syscalls, otp_io.bytesSent, otp_io.bytesReceived, otp_io.bytesCopied, otp_io.zeroCopySends);
+}
+
+void otp_add_io_counters(const struct otp_io_counters *counters)
+{
+	__atomic_fetch_add(&otp_io.syscalls, counters->syscalls, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&otp_io.bytesSent, counters->bytesSent, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&otp_io.bytesReceived, counters->bytesReceived, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&otp_io.bytesCopied, counters->bytesCopied, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&otp_io.zeroCopySends, counters->zeroCopySends, __ATOMIC_RELAXED);
+}
+
+int otp_map_file(const char *path, struct otp_mapping *mapping)
+{
+	struct stat info;
+	char *data = NULL;
+	size_t capacity = 0, length = 0;
+	ssize_t nb;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	// Regular files are mapped so the symbols can be sent straight from the page cache
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+		data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, info.st_size, MADV_SEQUENTIAL);
+			close(fd);
+			mapping->data = data;
+			mapping->length = info.st_size;
+			mapping->mapped = 1;
+			return 0;
+		}
+		data = NULL;
+	}
+
+	// Anything else (pipes, empty files) is read into memory
+	while (1) {
+		if (length == capacity) {
+			char *bigger = realloc(data, capacity ? 2 * capacity : 65536);
+
+			if (bigger == NULL) { free(data); close(fd); errno = ENOMEM; return -1; }
+			data = bigger;
+			capacity = capacity ? 2 * capacity : 65536;
+		}
+		nb = read(fd, data + length, capacity - length);
+		if (nb < 0) {
+			if (errno == EINTR) continue;
+			free(data);
+			close(fd);
+			return -1;
+		}
+		if (nb == 0) break;
+		length += nb;
+		otp_io.bytesCopied += nb;
+	}
+	close(fd);
+	mapping->data = data;
+	mapping->length = length;
+	mapping->mapped = 0;
+	return 0;
+}
+
+void otp_unmap_file(struct otp_mapping *mapping)
+{
+	if (mapping->mapped) munmap((void *)mapping->data, mapping->length);
+	else free((void *)mapping->data);
+	mapping->data = NULL;
+	mapping->length = 0;
+}
+
+int otp_connect(const char *address)
+{
+	struct sockaddr_storage storage;
+	socklen_t length;
+	int socketFD;
+
+	if (otp_address(address, &storage, &length) < 0) return -1;
+	socketFD = socket(storage.ss_family, SOCK_STREAM, 0);
+	if (socketFD < 0) return -1;
+
+	// Small frames go out at once, and with Fast Open the first send carries the SYN (kernels without it just connect)
+	if (storage.ss_family == AF_INET) {
+		int yes = 1;
+
+		setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		if (otp_fast_open) setsockopt(socketFD, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes, sizeof(yes));
+	}
+	if (connect(socketFD, (struct sockaddr *)&storage, length) < 0) {
+		int saved = errno;
+
+		close(socketFD);
+		errno = saved;
+		return -1;
+	}
+	return socketFD;
+}
+
+int otp_address(const char *address, struct sockaddr_storage *storage, socklen_t *length)
+{
+	memset(storage, 0, sizeof(*storage));
+
+	// A path means a Unix domain socket
+	if (otp_is_socket_path(address)) {
+		struct sockaddr_un *unixAddress = (struct sockaddr_un *)storage;
+
+		if (strlen(address) >= sizeof(unixAddress->sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		unixAddress->sun_family = AF_UNIX;
+		strcpy(unixAddress->sun_path, address);
+		*length = sizeof(*unixAddress);
+	}
+
+	// HOST:PORT means a daemon on another host (or on this one, by name), resolved to its first IPv4 address
+	else if (strchr(address, ':') != NULL) {
+		struct addrinfo hints, *found;
+		char host[256];
+		const char *colon = strrchr(address, ':');
+
+		if ((size_t)(colon - address) >= sizeof(host)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(host, address, colon - address);
+		host[colon - address] = '\0';
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host, colon + 1, &hints, &found) != 0) {
+			errno = ENXIO;
+			return -1;
+		}
+		memcpy(storage, found->ai_addr, found->ai_addrlen);
+		*length = found->ai_addrlen;
+		freeaddrinfo(found);
+	}
+
+	// Anything else is a port on the loopback interface
+	else {
+		struct sockaddr_in *inetAddress = (struct sockaddr_in *)storage;
+
+		inetAddress->sin_family = AF_INET;
+		inetAddress->sin_port = htons(atoi(address));
+		inetAddress->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		*length = sizeof(*inetAddress);
+	}
+	return 0;
+}
+
+int otp_is_socket_path(const char *address)
+{
+	return strchr(address, '/') != NULL;
+}
+
+int otp_send_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	size_t total = 0;
+	ssize_t nb;
+
+	// Loop until the whole buffer is sent
+	while (total < len) {
+		nb = send(fd, p + total, len - total, MSG_NOSIGNAL);
+		otp_io.syscalls++;
+		if (nb < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		total += nb;
+		otp_io.bytesSent += nb;
+	}
+	return 0;
+}
+
+// otp_recv_all(), counting into io
+static int recvAll(int fd, void *buf, size_t len, struct otp_io_counters *io)
+{
+	char *p = buf;
+	size_t total = 0;
+	ssize_t nb;
+
+	// Loop until we have read everything that was asked for
+	while (total < len) {
+		nb = recv(fd, p + total, len - total, 0);
+		io->syscalls++;
+		if (nb < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (nb == 0) return 1;          // peer closed the connection early
+		total += nb;
+		io->bytesReceived += nb;
+	}
+	return 0;
+}
+
+int otp_recv_all(int fd, void *buf, size_t len)
+{
+	return recvAll(fd, buf, len, &otp_io);
+}
+
+void otp_put_header(unsigned char *header, int type, uint32_t id, uint32_t length)
+{
+	uint32_t netId = htonl(id);
+	uint32_t netLength = htonl(length);
+
+	header[0] = (unsigned char)type;
+	memcpy(header + 1, &netId, sizeof(netId));
+	memcpy(header + 5, &netLength, sizeof(netLength));
+}
+
+void otp_get_header(const unsigned char *header, int *type, uint32_t *id, uint32_t *length)
+{
+	uint32_t netId, netLength;
+
+	memcpy(&netId, header + 1, sizeof(netId));
+	memcpy(&netLength, header + 5, sizeof(netLength));
+	*type = header[0];
+	*id = ntohl(netId);
+	*length = ntohl(netLength);
+}
+
+void otp_put_hello(unsigned char *hello, char tag, int flags, uint32_t requests, uint64_t symbols)
+{
+	uint32_t netRequests = htonl(requests);
+	uint32_t netHigh = htonl((uint32_t)(symbols >> 32));
+	uint32_t netLow = htonl((uint32_t)symbols);
+
+	memcpy(hello, OTP_HELLO_MAGIC, 3);
+	hello[3] = OTP_HELLO_VERSION;
+	hello[4] = tag;
+	hello[5] = flags;
+	memcpy(hello + 6, &netRequests, 4);
+	memcpy(hello + 10, &netHigh, 4);
+	memcpy(hello + 14, &netLow, 4);
+}
+
+int otp_get_hello(const unsigned char *hello, char *tag, int *flags, uint32_t *requests, uint64_t *symbols)
+{
+	uint32_t netRequests, netHigh, netLow;
+
+	if (memcmp(hello, OTP_HELLO_MAGIC, 3) != 0) return -1;
+	*tag = hello[4];
+	*flags = hello[5];
+	memcpy(&netRequests, hello + 6, 4);
+	memcpy(&netHigh, hello + 10, 4);
+	memcpy(&netLow, hello + 14, 4);
+	*requests = ntohl(netRequests);
+	*symbols = ((uint64_t)ntohl(netHigh) << 32) | ntohl(netLow);
+	return hello[3];
+}
+
+unsigned otp_busy_backoff(unsigned attempt, uint32_t hint)
+{
+	static _Thread_local uint64_t state;
+	uint64_t wait = hint > 0 ? hint : 1;
+
+	// Seed once per thread (the state's address tells the threads of a process apart), so clients started together
+	// and the connection threads of one client draw different waits
+	if (state == 0) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		state = ((uint64_t)getpid() << 32 ^ (uint64_t)(uintptr_t)&state ^ (uint64_t)ts.tv_sec ^ (uint64_t)ts.tv_nsec) | 1;
+	}
+	while (attempt-- > 0 && wait < OTP_BUSY_BACKOFF_MAX) wait *= 2;
+	if (wait > OTP_BUSY_BACKOFF_MAX) wait = OTP_BUSY_BACKOFF_MAX;
+
+	// xorshift64*: half the wait is fixed, the other half random
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return wait / 2 + (state * 0x2545F4914F6CDD1DULL >> 33) % (wait - wait / 2 + 1);
+}
+
+void otp_put_pad_ref(unsigned char *ref, uint32_t padId, uint64_t offset)
+{
+	uint32_t netId = htonl(padId);
+	uint32_t netHigh = htonl((uint32_t)(offset >> 32));
+	uint32_t netLow = htonl((uint32_t)offset);
+
+	memcpy(ref, &netId, 4);
+	memcpy(ref + 4, &netHigh, 4);
+	memcpy(ref + 8, &netLow, 4);
+}
+
+void otp_get_pad_ref(const unsigned char *ref, uint32_t *padId, uint64_t *offset)
+{
+	uint32_t netId, netHigh, netLow;
+
+	memcpy(&netId, ref, 4);
+	memcpy(&netHigh, ref + 4, 4);
+	memcpy(&netLow, ref + 8, 4);
+	*padId = ntohl(netId);
+	*offset = ((uint64_t)ntohl(netHigh) << 32) | ntohl(netLow);
+}
+
+int otp_read_header(int fd, int *type, uint32_t *id, uint32_t *length)
+{
+	unsigned char header[OTP_HEADER_SIZE];
+	int result = otp_recv_all(fd, header, sizeof(header));
+
+	if (result == 0) otp_get_header(header, type, id, length);
+	return result;
+}
+
+// Write all of buf to a (possibly non-socket) file descriptor such as stdout
+static int writeAll(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	size_t total = 0;
+	ssize_t nb;
+
+	while (total < len) {
+		nb = write(fd, p + total, len - total);
+		otp_io.syscalls++;
+		if (nb < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		total += nb;
+	}
+	return 0;
+}
+
+int otp_stream_run(int fd, char tag, const struct otp_request *requests, size_t count, struct otp_stream *stream)
+{
+	unsigned char *recvBuffer = stream->buffers;                              // one piece of an incoming frame (or all of a packed one)
+	unsigned char *packBuffer = recvBuffer + OTP_STREAM_RECV;                 // packed text and key of the outgoing frame
+	char *unpackBuffer = (char *)packBuffer + 2 * OTP_PACKED_SIZE(OTP_CHUNK_MAX);     // symbols of the last packed answer
+	unsigned char sendHeader[OTP_HEADER_SIZE + OTP_PAD_REF_SIZE];             // header (and pad reference) of the outgoing frame
+	unsigned char header[OTP_HEADER_SIZE];                                    // incoming header being assembled
+	unsigned char hello[OTP_HELLO_SIZE];
+	struct iovec frame[4];                  // outgoing frame: hello (first frame only), header, text slice, key slice
+	                                        // (or header + pad reference, text slice)
+	size_t frameOffset = 0, frameLength = 0;
+	size_t headerFill = 0;
+	size_t sending = 0;                     // request whose frames are going out
+	size_t receiving = 0;                   // oldest request still waiting for its answer
+	size_t position = 0;                    // symbols of the sending request already framed
+	uint32_t payloadLeft = 0;
+	uint32_t packedSymbols = 0;             // symbols in the packed answer being received, 0 for a plain one
+	size_t packedFill = 0;
+	struct pollfd pfd;
+	int pack = stream->pack && !stream->binary;
+	ssize_t nb;
+
+	stream->answered = 0;
+
+	// A new connection starts with the hello, which rides along with the first frame
+	frame[0].iov_base = hello;
+	frame[0].iov_len = 0;
+	if (tag != 0) {
+		uint64_t symbols = 0;
+		int flags = stream->binary ? OTP_HELLO_BINARY : pack ? OTP_HELLO_PACKED : 0;
+		size_t r;
+
+		for (r = 0; r < count; r++) {
+			symbols += requests[r].textLength;
+			if (requests[r].key == NULL) flags |= OTP_HELLO_PAD;
+		}
+		otp_put_hello(hello, tag, flags, count, symbols);
+		frame[0].iov_len = OTP_HELLO_SIZE;
+	}
+
+	while (receiving < count) {
+		// Describe the next frame once the previous one has been handed to the kernel
+		if (frameOffset == frameLength && sending < count) {
+			const struct otp_request *r = &requests[sending];
+			size_t n = r->textLength - position < OTP_CHUNK_MAX ? r->textLength - position : OTP_CHUNK_MAX;
+
+			// The text chunk comes first, then the key symbols that go with it, both straight from the mapping.
+			// Only the first frame carries the hello.
+			if (frameLength > 0) frame[0].iov_len = 0;
+			frame[1].iov_base = sendHeader;
+			frame[1].iov_len = OTP_HEADER_SIZE;
+			frame[2].iov_base = (void *)(r->text + position);
+			frame[2].iov_len = n;
+			frame[3].iov_base = (void *)(r->key + position);
+			frame[3].iov_len = n;
+			if (n > 0 && r->key == NULL) {
+				// No key to send: point the daemon at the matching spot in its pad instead
+				otp_put_header(sendHeader, pack ? OTP_FRAME_PACKED_PAD : OTP_FRAME_PAD, r->id, n);
+				otp_put_pad_ref(sendHeader + OTP_HEADER_SIZE, r->padId, r->padOffset + position);
+				frame[1].iov_len = OTP_HEADER_SIZE + OTP_PAD_REF_SIZE;
+				frame[3].iov_len = 0;
+				if (pack) {
+					otp_pack(packBuffer, r->text + position, n);
+					frame[2].iov_base = packBuffer;
+					frame[2].iov_len = OTP_PACKED_SIZE(n);
+				}
+				position += n;
+			}
+			else if (n > 0) {
+				otp_put_header(sendHeader, pack ? OTP_FRAME_PACKED_DATA : stream->binary ? OTP_FRAME_BINARY : OTP_FRAME_DATA, r->id, n);
+				if (pack) {
+					// Packing costs one pass over the chunk but sends 37.5% fewer bytes
+					otp_pack(packBuffer, r->text + position, n);
+					otp_pack(packBuffer + OTP_PACKED_SIZE(n), r->key + position, n);
+					frame[2].iov_base = packBuffer;
+					frame[2].iov_len = 2 * OTP_PACKED_SIZE(n);
+					frame[3].iov_len = 0;
+				}
+				position += n;
+			}
+			else {
+				// Close off this request and move straight on to the next one
+				otp_put_header(sendHeader, OTP_FRAME_END, r->id, 0);
+				sending++;
+				position = 0;
+			}
+			frameOffset = 0;
+			frameLength = frame[0].iov_len + frame[1].iov_len + frame[2].iov_len + frame[3].iov_len;
+		}
+
+		// Wait until we can send more or the daemon has something for us
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (frameOffset < frameLength) pfd.events |= POLLOUT;
+		stream->io.syscalls++;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		if (pfd.revents & POLLOUT) {
+			struct iovec rest[4];
+			struct msghdr message;
+			size_t skip = frameOffset;
+			int parts = 0, i;
+
+			// Skip whatever part of the frame already went out
+			for (i = 0; i < 4; i++) {
+				if (skip >= frame[i].iov_len) { skip -= frame[i].iov_len; continue; }
+				rest[parts].iov_base = (char *)frame[i].iov_base + skip;
+				rest[parts].iov_len = frame[i].iov_len - skip;
+				parts++;
+				skip = 0;
+			}
+			memset(&message, 0, sizeof(message));
+			message.msg_iov = rest;
+			message.msg_iovlen = parts;
+
+			nb = sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+			stream->io.syscalls++;
+			if (nb < 0 && errno == ECONNREFUSED) return 1;        // a Fast Open connect that found no daemon
+			if (nb < 0 && errno == EPIPE) {
+				// The daemon stopped reading (it refused a frame); stop sending and go read why
+				sending = count;
+				frameLength = frameOffset;
+			}
+			else if (nb < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != EINPROGRESS) return -1;
+			if (nb > 0) {
+				frameOffset += nb;
+				stream->io.bytesSent += nb;
+			}
+		}
+
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (payloadLeft == 0) {
+				// Still assembling the next frame header
+				nb = recv(fd, header + headerFill, OTP_HEADER_SIZE - headerFill, MSG_DONTWAIT);
+				stream->io.syscalls++;
+				if (nb == 0) return 1;
+				if (nb < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+					return -1;
+				}
+				stream->io.bytesReceived += nb;
+				headerFill += nb;
+				if (headerFill == OTP_HEADER_SIZE) {
+					uint32_t id;
+					int type;
+
+					// Answers come back in order, so they must belong to the oldest open request
+					otp_get_header(header, &type, &id, &payloadLeft);
+					if (type == OTP_FRAME_BUSY) {
+						uint32_t netHint = 0;
+
+						// The daemon is full and has not looked at anything we sent; try again later
+						if (payloadLeft != OTP_BUSY_SIZE || recvAll(fd, &netHint, sizeof(netHint), &stream->io) != 0) netHint = 0;
+						stream->busyHint = ntohl(netHint);
+						return 4;
+					}
+					if (type == OTP_FRAME_ERROR) {
+						size_t length = payloadLeft < OTP_REASON_MAX ? payloadLeft : OTP_REASON_MAX;
+
+						// Collect the reason and give up; the rest of the connection is of no use
+						if (recvAll(fd, stream->reason, length, &stream->io) != 0) length = 0;
+						stream->reason[length] = '\0';
+						return id == OTP_HELLO_ID ? 3 : 2;
+					}
+					if (id != requests[receiving].id || (type != OTP_FRAME_DATA && type != OTP_FRAME_PACKED_DATA && type != OTP_FRAME_BINARY && type != OTP_FRAME_END)) {
+						errno = EPROTO;
+						return -1;
+					}
+					if (type == OTP_FRAME_PACKED_DATA) {
+						if (payloadLeft > OTP_CHUNK_MAX) {
+							errno = EPROTO;
+							return -1;
+						}
+						packedSymbols = payloadLeft;
+						packedFill = 0;
+						payloadLeft = OTP_PACKED_SIZE(packedSymbols);
+					}
+					if (type == OTP_FRAME_END) {
+						if (stream->end(stream, receiving) < 0) return -1;
+						stream->answered = ++receiving;
+					}
+					headerFill = 0;
+				}
+			}
+			else if (packedSymbols > 0) {
+				// Collect the whole packed answer, then unpack it to the output
+				nb = recv(fd, recvBuffer + packedFill, payloadLeft, MSG_DONTWAIT);
+				stream->io.syscalls++;
+				if (nb == 0) return 1;
+				if (nb < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+					return -1;
+				}
+				stream->io.bytesReceived += nb;
+				packedFill += nb;
+				payloadLeft -= nb;
+				if (payloadLeft == 0) {
+					otp_unpack(unpackBuffer, recvBuffer, packedSymbols);
+					if (stream->answer(stream, receiving, unpackBuffer, packedSymbols) < 0) return -1;
+					packedSymbols = 0;
+				}
+			}
+			else {
+				// Pass the ciphered symbols straight through to the output
+				size_t want = payloadLeft < OTP_STREAM_RECV ? payloadLeft : OTP_STREAM_RECV;
+
+				nb = recv(fd, recvBuffer, want, MSG_DONTWAIT);
+				stream->io.syscalls++;
+				if (nb == 0) return 1;
+				if (nb < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+					return -1;
+				}
+				stream->io.bytesReceived += nb;
+				if (stream->answer(stream, receiving, (const char *)recvBuffer, nb) < 0) return -1;
+				payloadLeft -= nb;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// otp_stream_requests() passes the answers through to the file descriptor its stream's context points to
+static int writeAnswer(struct otp_stream *stream, size_t request, const char *symbols, size_t n)
+{
+	(void)request;
+	return writeAll(*(const int *)stream->context, symbols, n);
+}
+
+static int writeNewline(struct otp_stream *stream, size_t request)
+{
+	(void)request;
+	return stream->binary ? 0 : writeAll(*(const int *)stream->context, "\n", 1);
+}
+
+int otp_stream_requests(int fd, char tag, const struct otp_request *requests, size_t count, int outFD)
+{
+	static unsigned char buffers[OTP_STREAM_BUFFERS];
+	struct otp_stream stream;
+	int result;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.pack = otp_pack_frames;
+	stream.binary = otp_binary_frames;
+	stream.answer = writeAnswer;
+	stream.end = writeNewline;
+	stream.context = &outFD;
+	stream.buffers = buffers;
+	result = otp_stream_run(fd, tag, requests, count, &stream);
+	otp_add_io_counters(&stream.io);
+	memcpy(otp_reject_reason, stream.reason, sizeof(otp_reject_reason));
+	otp_busy_hint = stream.busyHint;
+	return result;
+}
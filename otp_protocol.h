@@ -0,0 +1,193 @@
+// Description: Shared wire protocol used by otp_enc/otp_dec and otp_enc_d/otp_dec_d.
+// A client opens every connection with a HELLO: a magic, the protocol version, the tag of the daemon it wants ('t'
+// for otp_enc_d, 'p' for otp_dec_d), flags for the features it may use, and the number of requests and symbols it
+// is about to send (0 when it does not know). The hello goes out in the same write as the first frames, and the
+// daemon answers nothing until the first frame is done, so a request costs a single round trip. A daemon that
+// cannot serve the client (wrong tag, version or flags) refuses it with an ERROR frame carrying OTP_HELLO_ID.
+// A daemon that is full (serving as many clients as it admits, with its queue of waiting ones full too) answers
+// the hello with a BUSY frame instead, whose payload is how long it suggests waiting, and hangs up; nothing has
+// been ciphered, so the client can connect again later and resend everything (see otp_busy_backoff()).
+// After the hello, everything on the connection travels in frames. A frame is a 9 byte header
+// (one type byte, a 4 byte request id and a 4 byte payload length, both in network byte order) and then the payload.
+// The client streams each request as DATA frames, each carrying n plaintext (or ciphertext) symbols followed by
+// the matching n key symbols, and finishes it with an END frame. The daemon answers every DATA frame with a
+// DATA frame holding the n ciphered symbols as soon as it has been processed, and echoes the END frame once
+// the request is complete. Every answer carries the id of the frame it answers.
+// A connection stays open for any number of requests: the client can send the next request (or many) without
+// waiting for earlier answers, and closes the connection when it has nothing more to send. The daemon answers
+// frames in the order they arrive. No frame carries more than OTP_CHUNK_MAX symbols, so both sides only ever
+// hold one chunk in memory no matter how large the file is.
+// Instead of DATA frames a request can use PAD frames, whose payload is a pad reference (the id of a pad the
+// daemon holds and an offset into it) followed by n text symbols; the daemon then ciphers with its own copy of the
+// pad. If the daemon refuses a frame (for example because that part of the pad was already used) it answers with
+// an ERROR frame whose payload is the reason.
+// A client can ask for the packed encoding (see otp_pack.h) frame by frame: a PACKED_DATA or PACKED_PAD frame
+// carries its symbols packed, while the length in its header still counts symbols. The daemon answers a packed
+// frame with a PACKED_DATA frame, and answers plain frames with plain DATA frames, so the two can be mixed freely.
+// In binary mode the client sends BINARY frames instead: they are laid out like DATA frames, but carry raw bytes of
+// any value, which the daemon XORs with the key bytes and answers with a BINARY frame. Their lengths are exact byte
+// counts, and the client writes the answers out without a newline. Binary mode has no pad or packed frames.
+// Clients map their input files and send frames with one sendmsg() per frame straight out of the page cache, so
+// text and key symbols are never copied in user space. The I/O helpers count their system calls and user space
+// copies in otp_io so the cost of each path can be compared.
+
+#ifndef OTP_PROTOCOL_H
+#define OTP_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "otp_pack.h"
+
+#define OTP_CHUNK_MAX 65536                 // largest number of symbols carried by a single frame
+#define OTP_HEADER_SIZE 9                   // type byte + 4 byte request id + 4 byte length
+
+#define OTP_HELLO_MAGIC "OTP"
+#define OTP_HELLO_VERSION 1
+#define OTP_HELLO_SIZE 18                   // magic, version, tag, flags, 4 byte request count, 8 byte symbol count
+#define OTP_HELLO_ID 0                      // request id of an ERROR frame that refuses the hello itself
+#define OTP_HELLO_PAD 1                     // flag: the client may cipher with pads the daemon holds
+#define OTP_HELLO_PACKED 2                  // flag: the client may send packed frames
+#define OTP_HELLO_BINARY 4                  // flag: the client may send binary frames
+#define OTP_HELLO_FLAGS 7                   // every flag this version knows
+
+#define OTP_FRAME_DATA 'D'                  // payload is a chunk of symbols
+#define OTP_FRAME_END 'E'                   // the request has no more chunks, payload is empty
+#define OTP_FRAME_PAD 'P'                   // payload is a pad reference followed by a chunk of text symbols
+#define OTP_FRAME_ERROR 'X'                 // the daemon refused the request, payload is the reason
+#define OTP_FRAME_PACKED_DATA 'd'           // DATA with the text and key symbols (or the answer) packed
+#define OTP_FRAME_PACKED_PAD 'p'            // PAD with the text symbols packed
+#define OTP_FRAME_BINARY 'B'                // DATA with raw bytes, ciphered with a XOR in either direction
+#define OTP_FRAME_BUSY 'W'                  // the daemon is full, payload is a 4 byte wait in milliseconds
+
+#define OTP_PAD_REF_SIZE 12                 // pad id (4 bytes) + offset (8 bytes), network byte order
+#define OTP_REASON_MAX 255                  // longest reason an ERROR frame carries
+#define OTP_BUSY_SIZE 4                     // payload of a BUSY frame
+#define OTP_BUSY_RETRIES 8                  // times a client connects again after BUSY answers before it gives up
+#define OTP_BUSY_BACKOFF_MAX 2000           // longest wait between those attempts, in milliseconds
+
+// One request for otp_stream_requests()
+struct otp_request {
+	uint32_t id;                        // tag carried by every frame of the request
+	const char *text;                   // first text symbol
+	const char *key;                    // first key symbol, or NULL to use the daemon's pad
+	size_t textLength;                  // symbols to send from each
+	uint32_t padId;                     // pad and offset to cipher with when key is NULL
+	uint64_t padOffset;
+};
+
+// A whole input file, mapped read-only (or read into memory if it cannot be mapped, e.g. a pipe)
+struct otp_mapping {
+	const char *data;
+	size_t length;
+	int mapped;                         // data came from mmap() rather than malloc()
+};
+
+// Per process I/O counters
+struct otp_io_counters {
+	unsigned long syscalls;             // send, recv, sendmsg, write and poll calls
+	unsigned long bytesSent;
+	unsigned long bytesReceived;
+	unsigned long bytesCopied;          // bytes copied between user space buffers (the cipher itself not included)
+	unsigned long zeroCopySends;        // sends that went out with MSG_ZEROCOPY
+};
+
+extern struct otp_io_counters otp_io;
+
+// Print otp_io to stderr, prefixed with who
+void otp_print_io_counters(const char *who);
+
+// Add counters kept elsewhere (such as a stream's) to otp_io; safe to call from several threads at once
+void otp_add_io_counters(const struct otp_io_counters *counters);
+
+// Map path into memory. Returns 0 on success and -1 with errno set if the file cannot be opened or read.
+int otp_map_file(const char *path, struct otp_mapping *mapping);
+void otp_unmap_file(struct otp_mapping *mapping);
+
+// An address is a port on the loopback interface or, if it contains a '/', the path of a Unix domain socket (which
+// skips the TCP/IP stack altogether). A client can also reach a daemon on another host as HOST:PORT (see
+// otp_balance.h for lists of daemons); daemons listen on a port on every interface, or on a path.
+// otp_address fills in the socket address for one; it returns 0 on success and -1 with errno set if the path
+// is too long or the host cannot be resolved. otp_connect opens a stream socket connected to it, or returns -1
+// with errno set.
+// otp_is_socket_path tells the two apart.
+int otp_address(const char *address, struct sockaddr_storage *storage, socklen_t *length);
+int otp_connect(const char *address);
+int otp_is_socket_path(const char *address);
+
+// Daemons and clients run on the same host, so Nagle's algorithm only ever delays the last small segment of an
+// answer: otp_connect and the daemons set TCP_NODELAY on every TCP connection. With otp_fast_open set (OTP_FASTOPEN
+// in a client's environment), otp_connect also asks for TCP Fast Open, so the hello and the first frames ride in
+// the SYN to a daemon started with --fastopen; connect() then returns at once and a refused connection shows up
+// on the first send instead.
+extern int otp_fast_open;
+
+// Send or receive exactly len bytes, retrying on short transfers and EINTR.
+// otp_send_all returns 0 on success and -1 on error. otp_recv_all returns 0 on success, 1 if the peer
+// closed the connection before len bytes arrived and -1 on error.
+int otp_send_all(int fd, const void *buf, size_t len);
+int otp_recv_all(int fd, void *buf, size_t len);
+
+// Fill in / decode a frame header
+void otp_put_header(unsigned char *header, int type, uint32_t id, uint32_t length);
+void otp_get_header(const unsigned char *header, int *type, uint32_t *id, uint32_t *length);
+
+// Fill in / decode a hello. otp_get_hello returns the version, or -1 if the magic is wrong.
+void otp_put_hello(unsigned char *hello, char tag, int flags, uint32_t requests, uint64_t symbols);
+int otp_get_hello(const unsigned char *hello, char *tag, int *flags, uint32_t *requests, uint64_t *symbols);
+
+// How many milliseconds to wait before connecting again after the attempt-th BUSY answer in a row (counting
+// from 0), which suggested hint: the wait doubles from the hint with every attempt up to OTP_BUSY_BACKOFF_MAX,
+// and a random half of it is jittered, so clients turned away together do not all come back together. Every
+// thread draws from its own generator, so it is safe to call from several at once.
+unsigned otp_busy_backoff(unsigned attempt, uint32_t hint);
+
+// Fill in / decode the pad reference at the start of a PAD frame's payload
+void otp_put_pad_ref(unsigned char *ref, uint32_t padId, uint64_t offset);
+void otp_get_pad_ref(const unsigned char *ref, uint32_t *padId, uint64_t *offset);
+
+// Read one frame header from fd. Returns the same values as otp_recv_all.
+int otp_read_header(int fd, int *type, uint32_t *id, uint32_t *length);
+
+// Client side of a transfer: pipeline count requests over one connection, sending each one's text together with
+// the matching key symbols, and write the daemon's answers to outFD as they arrive, each followed by a newline.
+// Sending and receiving are interleaved with poll() so neither side blocks on a full socket buffer, and later
+// requests go out while earlier answers are still coming back. The input must already be validated.
+// With otp_pack_frames set, the symbols travel packed: they are packed into a buffer as each frame is described,
+// and the answers are unpacked before they are written. With otp_binary_frames set, text and key are raw bytes that
+// travel in BINARY frames (otp_pack_frames is then ignored), and no newline follows each answer.
+// On a new connection pass the tag of the daemon to open it with a hello for; later calls on it pass 0.
+// Returns 0 on success, 1 if the daemon closed the connection early, 2 if the daemon refused a request (the
+// reason is left in otp_reject_reason), 3 if it refused the hello (the reason is left there too), 4 if it was
+// busy (nothing was written; its suggested wait is left in otp_busy_hint) and -1 on error.
+extern char otp_reject_reason[OTP_REASON_MAX + 1];
+extern uint32_t otp_busy_hint;
+extern int otp_pack_frames;
+extern int otp_binary_frames;
+int otp_stream_requests(int fd, char tag, const struct otp_request *requests, size_t count, int outFD);
+
+// The engine under otp_stream_requests(), for callers that want the answers somewhere other than a file descriptor,
+// or that stream on several connections from several threads at once: the options, buffers and results live in the
+// stream instead of the globals above. Every piece of an answer is handed to answer() as it arrives, and end() is
+// called once the request is complete, both with the request's index; either can return -1 to stop with an error.
+// answered counts the requests that were complete before it returned. The return values are those of
+// otp_stream_requests(); a 2 refuses requests[answered].
+#define OTP_STREAM_RECV (4 * OTP_CHUNK_MAX)
+#define OTP_STREAM_BUFFERS (OTP_STREAM_RECV + 2 * OTP_PACKED_SIZE(OTP_CHUNK_MAX) + OTP_CHUNK_MAX)       // receive, pack and unpack buffers
+
+struct otp_stream {
+	int pack;                           // send packed frames (like otp_pack_frames)
+	int binary;                         // send BINARY frames (like otp_binary_frames)
+	int (*answer)(struct otp_stream *stream, size_t request, const char *symbols, size_t n);
+	int (*end)(struct otp_stream *stream, size_t request);
+	void *context;                      // for the callbacks
+	unsigned char *buffers;             // OTP_STREAM_BUFFERS bytes that no other stream uses at the same time
+	size_t answered;
+	char reason[OTP_REASON_MAX + 1];    // like otp_reject_reason
+	uint32_t busyHint;                  // like otp_busy_hint
+	struct otp_io_counters io;          // what this stream did, added up over its runs instead of in otp_io
+};
+
+int otp_stream_run(int fd, char tag, const struct otp_request *requests, size_t count, struct otp_stream *stream);
+
+#endif
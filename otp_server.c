@@ -0,0 +1,1448 @@
+// Description: Implementation of the shared daemon declared in otp_server.h.
+// In fork mode the parent only accepts connections; the handshake, the chunk loop and the ciphering all happen in
+// the child, and the parent reaps children as they finish so they never pile up as zombies. A child whose request grows
+// past OTP_PARALLEL_MIN symbols hands the rest of it to a thread pool in batches (see otp_parallel.h).
+// Connections are persistent: after the hello a client may pipeline any number of requests, and the daemon
+// answers each frame in arrival order, tagged with the frame's request id, until the client hangs up.
+// In epoll mode every connection is a small state machine (hello -> frame header -> payload -> cipher -> send)
+// advanced whenever its socket is ready, so one process can hold thousands of connections open at once. Each
+// connection only owns a buffer big enough for the largest chunk it has sent so far, and the chunk is ciphered in
+// place so the response goes out of the same buffer.
+// In pool mode the parent binds one SO_REUSEPORT listener per worker and forks the workers up front. Each worker
+// runs its own event loop on its own listener, so the kernel spreads new connections across them without a shared
+// accept lock, and workers can be pinned to CPUs. The parent reports each worker's request count (on SIGUSR1 and
+// at shutdown) from the worker's metrics slot (see otp_metrics.h).
+// Admission control: with --max-inflight N the daemon serves at most N clients at once (split evenly between pool
+// workers). Clients beyond that are still accepted and wait their turn in a queue of up to --backlog connections;
+// those that find the queue full are answered with a BUSY frame right away, which costs neither a fork nor a buffer,
+// and the clients back off and retry. The queue is kept in the daemon rather than in the kernel's listen backlog,
+// because a listen backlog that overflows drops SYNs (the client retries after a second) or falls back to SYN
+// cookies, instead of answering. --deadline cuts off a request that takes too long, a connection that sits idle
+// that long (and so holds a slot for nothing), and one that waits that long in the queue.
+// Sources: http://beej.us/guide/bgnet/, epoll(7), accept4(2), socket(7) SO_REUSEPORT, sched_setaffinity(2)
+
+#define _GNU_SOURCE                         // accept4(), sched_setaffinity()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "otp_cipher.h"
+#include "otp_metrics.h"
+#include "otp_pack.h"
+#include "otp_padstore.h"
+#include "otp_parallel.h"
+#include "otp_protocol.h"
+#include "otp_server.h"
+#include "otp_trace.h"
+
+#define MODE_FORK 0
+#define MODE_EPOLL 1
+#define MODE_POOL 2
+
+#define MAX_EVENTS 256                      // epoll events handled per wakeup
+#define BUSY_WAIT 10                        // milliseconds a full daemon asks clients to wait before they back off further
+#define DRAIN_MAX 64                        // busy clients the fork mode parent waits on to hang up
+#define DRAIN_LINGER 1000                   // milliseconds it waits for each at most
+#define SWEEP_INTERVAL 100                  // milliseconds between --deadline checks in the event loop
+
+static void error(const char *msg) { perror(msg); exit(1); }                  // Error function used for reporting issues
+
+// A pool worker; worker i counts into metrics slot i + 1
+struct worker {
+	int cpu;                            // CPU the worker is pinned to, or -1
+	pid_t pid;
+};
+
+static int padsLoaded;                  // at least one --pad was given, so PAD frames are accepted
+static int useZeroCopy;                 // --zerocopy: send responses with MSG_ZEROCOPY in fork mode
+static int printIoStats;                // --io-stats: children report their I/O counters when they finish
+static pid_t statsPid;                  // --stats: the process serving the metrics, 0 if there is none
+static int cipherThreads;               // --cipher-threads: threads a fork mode child ciphers large requests with
+static int fastOpen;                    // --fastopen: accept TCP Fast Open connections, whose SYN carries the request
+static int maxInflight;                 // --max-inflight: clients served at once, 0 for no limit
+static int backlog = SOMAXCONN;         // --backlog: accepted clients that may wait for one of those, the rest are turned away
+static int admitLimit;                  // this event loop's share of maxInflight (all of it unless it is a pool worker)
+static int queueLimit;                  // and of backlog, at most what the descriptor limit leaves room for
+static int deadline;                    // --deadline: milliseconds a request (or an idle connection) may take, 0 for no limit
+static volatile sig_atomic_t dumpRequested = 0;     // --trace: SIGUSR2 arrived, write the trace rings out
+
+//////////////////////////////////////////////////////////////////////
+// setup
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "USAGE: %s port|path [--epoll] [--workers N] [--pin] [--zerocopy] [--io-stats] [--pad ID:PATH]... [--stats PORT|PATH] [--trace PATH] [--cipher-threads N] [--fastopen] [--backlog N] [--max-inflight N] [--deadline MS]\n", program);
+	exit(1);
+}
+
+// Create the listening socket on address (a port, or the path of a Unix domain socket), optionally non-blocking
+// for the event loop and shareable between workers (TCP only)
+static int openListener(const char *address, int nonBlocking, int reusePort)
+{
+	struct sockaddr_storage serverAddress;
+	struct sockaddr_in *inetAddress = (struct sockaddr_in *)&serverAddress;
+	socklen_t addressLength = sizeof(*inetAddress);
+	struct stat info;
+	int listenSocketFD;
+	int yes = 1;
+
+	// Set up the address struct for this process (the server)
+	memset((char *)&serverAddress, '\0', sizeof(serverAddress));        // Clear out the address struct
+	if (otp_is_socket_path(address)) {
+		// A Unix domain socket; clear away the socket a previous run left behind, but never any other kind of file
+		if (otp_address(address, &serverAddress, &addressLength) < 0) error("ERROR with socket path");
+		if (lstat(address, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(address);
+		reusePort = 0;
+	}
+	else {
+		inetAddress->sin_family = AF_INET;                              // Create a network-capable socket
+		inetAddress->sin_port = htons(atoi(address));                   // Store the port number
+		inetAddress->sin_addr.s_addr = INADDR_ANY;                      // Automatically fill with my IP
+	}
+
+	// Set up the socket
+	listenSocketFD = socket(serverAddress.ss_family, SOCK_STREAM | (nonBlocking ? SOCK_NONBLOCK : 0), 0);
+	if (listenSocketFD < 0) error("ERROR opening socket");
+	setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if (reusePort && setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0)
+		error("ERROR setting SO_REUSEPORT");
+
+	// Accepted connections inherit TCP_NODELAY, so the last small segment of an answer never waits for an ACK
+	if (serverAddress.ss_family == AF_INET) {
+		int queue = SOMAXCONN;
+
+		setsockopt(listenSocketFD, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		if (fastOpen && setsockopt(listenSocketFD, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) < 0)
+			perror("SERVER: ERROR enabling TCP Fast Open");
+	}
+
+	// Enable the socket to begin listening
+	if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, addressLength) < 0) // Connect socket to port
+		error("ERROR on binding");
+	if (listen(listenSocketFD, SOMAXCONN) < 0) error("ERROR on listen");  // Let the kernel queue as many connections as it allows
+
+	return listenSocketFD;
+}
+
+static void onDump(int signo) { (void)signo; dumpRequested = 1; }
+
+static uint64_t milliseconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Write the trace rings out if SIGUSR2 asked for it; called from each mode's main loop
+static void dumpTraceIfRequested(const struct otp_service *service)
+{
+	long records;
+
+	if (!dumpRequested) return;
+	dumpRequested = 0;
+	records = otp_trace_dump();
+	if (records >= 0) fprintf(stderr, "%s: wrote %ld trace records\n", service->name, records);
+}
+
+//////////////////////////////////////////////////////////////////////
+// fork mode
+
+// Wait until the kernel has released every buffer handed over with MSG_ZEROCOPY, so it can be reused
+static int waitZeroCopy(int fd, unsigned long *pending)
+{
+	char control[128];
+	struct msghdr message;
+	struct cmsghdr *cm;
+	struct pollfd pfd;
+
+	while (*pending > 0) {
+		// Completions arrive on the socket's error queue
+		pfd.fd = fd;
+		pfd.events = 0;
+		otp_io.syscalls++;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		memset(&message, 0, sizeof(message));
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		otp_io.syscalls++;
+		if (recvmsg(fd, &message, MSG_ERRQUEUE) < 0) {
+			if (errno == EAGAIN || errno == EINTR) continue;
+			return -1;
+		}
+
+		// Each notification covers a range of sends
+		for (cm = CMSG_FIRSTHDR(&message); cm != NULL; cm = CMSG_NXTHDR(&message, cm)) {
+			struct sock_extended_err *notice = (struct sock_extended_err *)CMSG_DATA(cm);
+
+			if (notice->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			*pending -= notice->ee_data - notice->ee_info + 1;
+		}
+	}
+	return 0;
+}
+
+// Send a whole response, with MSG_ZEROCOPY if the socket was set up for it
+static int sendResponse(int fd, const char *buf, size_t len, int zeroCopy, unsigned long *pending)
+{
+	size_t total = 0;
+	ssize_t nb;
+
+	if (!zeroCopy) {
+		if (otp_send_all(fd, buf, len) < 0) {
+			OTP_COUNT(sendErrors, 1);
+			return -1;
+		}
+		OTP_COUNT(bytesSent, len);
+		return 0;
+	}
+	while (total < len) {
+		nb = send(fd, buf + total, len - total, MSG_NOSIGNAL | MSG_ZEROCOPY);
+		otp_io.syscalls++;
+		if (nb < 0) {
+			if (errno == EINTR) continue;
+			if (errno == ENOBUFS && waitZeroCopy(fd, pending) == 0) continue;
+			OTP_COUNT(sendErrors, 1);
+			return -1;
+		}
+		total += nb;
+		otp_io.bytesSent += nb;
+		OTP_COUNT(bytesSent, nb);
+		otp_io.zeroCopySends++;
+		(*pending)++;
+	}
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// frame handling shared by every mode
+
+// Size on the wire of a frame holding n symbols, or 0 if the client has no business sending it
+static size_t frameSize(int frameType, uint32_t n)
+{
+	if (n > OTP_CHUNK_MAX) return 0;
+	if (frameType == OTP_FRAME_DATA || frameType == OTP_FRAME_BINARY) return OTP_HEADER_SIZE + 2 * (size_t)n;
+	if (frameType == OTP_FRAME_PACKED_DATA) return OTP_HEADER_SIZE + 2 * OTP_PACKED_SIZE((size_t)n);
+	if (frameType == OTP_FRAME_PAD && padsLoaded) return OTP_HEADER_SIZE + OTP_PAD_REF_SIZE + n;
+	if (frameType == OTP_FRAME_PACKED_PAD && padsLoaded) return OTP_HEADER_SIZE + OTP_PAD_REF_SIZE + OTP_PACKED_SIZE((size_t)n);
+	return 0;
+}
+
+// Find the text and key of the complete DATA or PAD frame (plain, packed or binary) at frame and describe them in work,
+// and put the answer's header directly in front of the text, where the ciphered symbols will follow it.
+// Returns the answer's offset within frame, or -1 with *reason set if the frame is refused.
+static long prepareFrame(unsigned char *frame, struct otp_parallel_frame *work, const char **reason)
+{
+	long answerAt = 0;
+	uint32_t requestId, n, padId;
+	uint64_t padOffset;
+	int frameType, packed;
+
+	otp_get_header(frame, &frameType, &requestId, &n);
+	packed = frameType == OTP_FRAME_PACKED_DATA || frameType == OTP_FRAME_PACKED_PAD;
+	work->text = (char *)frame + OTP_HEADER_SIZE;
+	work->n = n;
+	work->binary = frameType == OTP_FRAME_BINARY;
+	if (frameType == OTP_FRAME_PAD || frameType == OTP_FRAME_PACKED_PAD) {
+		// Cipher with our own copy of the pad, as long as that part of it has never been used
+		otp_get_pad_ref((unsigned char *)work->text, &padId, &padOffset);
+		work->text += OTP_PAD_REF_SIZE;
+		answerAt = OTP_PAD_REF_SIZE;
+		work->key = otp_padstore_claim(padId, padOffset, n, reason);
+		work->packing = packed ? OTP_PACKED_TEXT : 0;
+		if (work->key == NULL) {
+			OTP_COUNT(refusals, 1);
+			return -1;
+		}
+	}
+	else {
+		// The key symbols follow the text in the frame
+		work->key = work->text + (packed ? OTP_PACKED_SIZE((size_t)n) : n);
+		work->packing = packed ? OTP_PACKED_TEXT | OTP_PACKED_KEY : 0;
+	}
+
+	// Packed and binary frames are answered in kind
+	otp_put_header(frame + answerAt, packed ? OTP_FRAME_PACKED_DATA : work->binary ? OTP_FRAME_BINARY : OTP_FRAME_DATA, requestId, n);
+	return answerAt;
+}
+
+// Size on the wire of the answer to a prepared frame
+static size_t answerSize(const struct otp_parallel_frame *work)
+{
+	return OTP_HEADER_SIZE + (work->packing ? OTP_PACKED_SIZE(work->n) : work->n);
+}
+
+// Cipher the complete DATA or PAD frame at frame in place. The answer (a DATA header followed by the ciphered
+// symbols) is left directly in front of the text; returns its offset within frame and sets *answerLength to
+// its size. Returns -1 with *reason set if the frame is refused.
+static long answerFrame(unsigned char *frame, const struct otp_service *service, size_t *answerLength, const char **reason)
+{
+	struct otp_parallel_frame work;
+	long answerAt = prepareFrame(frame, &work, reason);
+
+	if (answerAt < 0) return -1;
+	if (work.packing == 0) otp_cipher(work.binary ? OTP_XOR : service->direction, work.text, work.text, work.key, work.n);
+	else otp_cipher_packed(service->direction, (unsigned char *)work.text, work.key, work.packing, work.n);
+	OTP_COUNT(symbolsCiphered, work.n);
+	*answerLength = answerSize(&work);
+	return answerAt;
+}
+
+// Build the ERROR frame that tells the client why request requestId was refused; returns its length
+static size_t refusalFrame(unsigned char *frame, uint32_t requestId, const char *reason)
+{
+	size_t length = strlen(reason) < OTP_REASON_MAX ? strlen(reason) : OTP_REASON_MAX;
+
+	otp_put_header(frame, OTP_FRAME_ERROR, requestId, length);
+	memcpy(frame + OTP_HEADER_SIZE, reason, length);
+	return OTP_HEADER_SIZE + length;
+}
+
+// Build the BUSY frame that turns a client away until it has waited a while; returns its length
+static size_t busyFrame(unsigned char *frame)
+{
+	uint32_t netWait = htonl(BUSY_WAIT);
+
+	otp_put_header(frame, OTP_FRAME_BUSY, OTP_HELLO_ID, OTP_BUSY_SIZE);
+	memcpy(frame + OTP_HEADER_SIZE, &netWait, OTP_BUSY_SIZE);
+	return OTP_HEADER_SIZE + OTP_BUSY_SIZE;
+}
+
+// Check the hello a connection opens with and pass on how many symbols the client means to send.
+// Returns 0 if we can serve the client and -1 with *reason set if not.
+static int checkHello(const unsigned char *hello, const struct otp_service *service, uint64_t *symbols, const char **reason)
+{
+	static char text[OTP_REASON_MAX];
+	uint32_t requests;
+	char tag;
+	int version, flags;
+
+	version = otp_get_hello(hello, &tag, &flags, &requests, symbols);
+	if (version < 0) *reason = "not an otp client";
+	else if (version != OTP_HELLO_VERSION) {
+		snprintf(text, sizeof(text), "%s speaks protocol version %d, not %d", service->name, OTP_HELLO_VERSION, version);
+		*reason = text;
+	}
+	else if (tag != service->tag) {
+		snprintf(text, sizeof(text), "this is %s", service->name);
+		*reason = text;
+	}
+	else if (flags & ~OTP_HELLO_FLAGS) *reason = "unknown flags in the hello";
+	else if (flags & OTP_HELLO_PAD && !padsLoaded) {
+		snprintf(text, sizeof(text), "%s holds no pads", service->name);
+		*reason = text;
+	}
+	else return 0;
+	OTP_COUNT(handshakeRejections, 1);
+	return -1;
+}
+
+// Room for two whole frames, so a recv() can pick up the next frame while the current one is handled
+#define FRAME_BUFFER_SIZE (2 * (OTP_HEADER_SIZE + 2 * OTP_CHUNK_MAX))
+
+// With --cipher-threads the buffer holds a batch of frames for the thread pool instead
+#define BATCH_FRAMES 16
+#define BATCH_BUFFER_SIZE (BATCH_FRAMES * (OTP_HEADER_SIZE + 2 * OTP_CHUNK_MAX))
+
+// Slide buffer[*start..*end) to the front of the buffer, once the kernel is done sending from it
+static int slideBuffer(int fd, char *buffer, size_t *start, size_t *end, int zeroCopy, unsigned long *pending)
+{
+	if (zeroCopy && waitZeroCopy(fd, pending) < 0) return -1;
+	memmove(buffer, buffer + *start, *end - *start);
+	otp_io.bytesCopied += *end - *start;
+	*end -= *start;
+	*start = 0;
+	return 0;
+}
+
+// Receive until buffer[*start..*end) holds at least needed bytes, sliding leftovers to the front when the frame
+// would run off the end of the size byte buffer. Returns 0 when the bytes are there, 1 if the client hung up
+// between frames, 2 if nothing came for --deadline and -1 on error.
+static int fillBuffer(int fd, char *buffer, size_t size, size_t *start, size_t *end, size_t needed, int zeroCopy, unsigned long *pending)
+{
+	ssize_t nb;
+
+	while (*end - *start < needed) {
+		if (*start + needed > size && slideBuffer(fd, buffer, start, end, zeroCopy, pending) < 0) return -1;
+		nb = recv(fd, buffer + *end, size - *end, 0);
+		otp_io.syscalls++;
+		if (nb < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				OTP_COUNT(deadlineMisses, 1);
+				return 2;
+			}
+			OTP_COUNT(recvErrors, 1);
+			return -1;
+		}
+		if (nb == 0) return *end == *start ? 1 : -1;
+		*end += nb;
+		otp_io.bytesReceived += nb;
+		OTP_COUNT(bytesReceived, nb);
+	}
+	return 0;
+}
+
+// Tell the client why request requestId was refused and hang up, reading out whatever it already sent so closing
+// the socket does not reset the connection before the client has seen the refusal
+static void refuseClient(int fd, uint32_t requestId, const char *reason)
+{
+	static char discard[FRAME_BUFFER_SIZE];
+	unsigned char refusal[OTP_HEADER_SIZE + OTP_REASON_MAX];
+	struct timeval patience = { 5, 0 };
+
+	otp_send_all(fd, refusal, refusalFrame(refusal, requestId, reason));
+	shutdown(fd, SHUT_WR);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &patience, sizeof(patience));
+	while (recv(fd, discard, sizeof(discard), 0) > 0);
+}
+
+// Add whatever else the client has already sent to the buffer, without waiting for more, so the next batch is as
+// large as it can be. Returns 0 on success and -1 on error.
+static int topUpBuffer(int fd, char *buffer, size_t size, size_t *start, size_t *end, int zeroCopy, unsigned long *pending)
+{
+	ssize_t nb;
+
+	if (*start > size / 2 && slideBuffer(fd, buffer, start, end, zeroCopy, pending) < 0) return -1;
+	while (*end < size) {
+		nb = recv(fd, buffer + *end, size - *end, MSG_DONTWAIT);
+		otp_io.syscalls++;
+		if (nb <= 0) break;             // nothing more for now; a hang up or error shows up on the next blocking recv()
+		*end += nb;
+		otp_io.bytesReceived += nb;
+		OTP_COUNT(bytesReceived, nb);
+	}
+	return 0;
+}
+
+// Answer the run of complete frames of one request at buffer[*start..end) as a batch: the thread pool ciphers
+// them all at once, and each answer is sent as soon as it and every answer before it are done. The first frame
+// must be complete. *start is moved past the frames answered.
+// Returns 0 on success, 1 if a frame was refused (its id and the reason are left in *requestId and *reason) and
+// -1 on error.
+static int answerBatch(int fd, char *buffer, size_t *start, size_t end, const struct otp_service *service,
+	int zeroCopy, unsigned long *pending, uint32_t *requestId, const char **reason)
+{
+	struct otp_parallel_frame frames[BATCH_FRAMES];
+	size_t answerAt[BATCH_FRAMES];      // where each answer starts in buffer
+	size_t next = *start, frameLength;
+	uint64_t phaseStart = otp_trace_clock();
+	uint32_t n;
+	long at;
+	int frameType, count = 0, refused = 0, i;
+
+	// Take the request's complete frames until the batch is full or the buffer runs out of them (an END frame stops it)
+	while (count < BATCH_FRAMES && end - next >= OTP_HEADER_SIZE) {
+		otp_get_header((unsigned char *)buffer + next, &frameType, requestId, &n);
+		frameLength = frameSize(frameType, n);
+		if (frameLength == 0 || end - next < frameLength) break;
+		at = prepareFrame((unsigned char *)buffer + next, &frames[count], reason);
+		if (at < 0) {
+			refused = 1;
+			break;
+		}
+		answerAt[count] = next + at;
+		next += frameLength;
+		count++;
+	}
+
+	otp_parallel_submit(service->direction, frames, count);
+	for (i = 0; i < count; i++) {
+		otp_parallel_wait(&frames[i]);
+		OTP_COUNT(symbolsCiphered, frames[i].n);
+		phaseStart = otp_trace_record(OTP_PHASE_CIPHER, *requestId, frames[i].n, phaseStart);
+		if (sendResponse(fd, buffer + answerAt[i], answerSize(&frames[i]), zeroCopy, pending) < 0) {
+			// The pool must be finished with the buffer before anyone else touches it
+			while (++i < count) otp_parallel_wait(&frames[i]);
+			return -1;
+		}
+		phaseStart = otp_trace_record(OTP_PHASE_RESPONSE_SEND, *requestId, answerSize(&frames[i]), phaseStart);
+	}
+	*start = next;
+	return refused;
+}
+
+// Serve one client on a blocking socket: check its hello, then answer frames until the client hangs up.
+// Frames are received into one reusable buffer, as many as fit per recv(), and each chunk is ciphered in place
+// and sent back from where it arrived, so the payload is never copied in user space. Once a request has passed
+// OTP_PARALLEL_MIN symbols, the rest of it is ciphered in batches on the --cipher-threads pool, which is started
+// as soon as the hello announces that much. With --deadline, a request still going that long after its first
+// frame is refused, and a client that sends nothing for that long is dropped.
+// Returns 0 when the client was served and -1 if it was rejected or the connection failed.
+static int handleClient(int establishedConnectionFD, const struct otp_service *service)
+{
+	static char frameBuffer[FRAME_BUFFER_SIZE];
+	static char *batchBuffer;           // BATCH_BUFFER_SIZE bytes for --cipher-threads, kept for the process' life
+	char *buffer = frameBuffer;
+	size_t bufferSize = sizeof(frameBuffer);
+	size_t start = 0, end = 0;          // unprocessed bytes are buffer[start..end)
+	size_t requestSymbols = 0;          // symbols of the current request answered so far
+	unsigned long pending = 0;          // MSG_ZEROCOPY sends the kernel has not released yet
+	int zeroCopy = useZeroCopy;
+	uint64_t announced;                 // symbols the hello says are coming
+	uint64_t requestStarted = 0;        // when the current request's first frame came in, 0 between requests
+	const char *reason;
+	uint32_t chunkLength;
+	uint32_t requestId = 0;
+	size_t frameLength, answerLength;
+	uint64_t phaseStart;
+	long answerAt;
+	int frameType;
+	int result;
+	int one = 1;
+
+	if (zeroCopy && setsockopt(establishedConnectionFD, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) zeroCopy = 0;
+	if (deadline > 0) {
+		struct timeval patience = { deadline / 1000, deadline % 1000 * 1000 };
+
+		setsockopt(establishedConnectionFD, SOL_SOCKET, SO_RCVTIMEO, &patience, sizeof(patience));
+	}
+
+	// Batches need room for more than two frames; the pages are only touched if a request gets that large
+	if (cipherThreads > 1 && batchBuffer == NULL) batchBuffer = malloc(BATCH_BUFFER_SIZE);
+	if (cipherThreads > 1 && batchBuffer != NULL) {
+		buffer = batchBuffer;
+		bufferSize = BATCH_BUFFER_SIZE;
+	}
+
+	// Make sure we are communicating with the right client: its hello arrives together with the first frames
+	phaseStart = otp_trace_clock();
+	result = fillBuffer(establishedConnectionFD, buffer, bufferSize, &start, &end, OTP_HELLO_SIZE, zeroCopy, &pending);
+	if (result == 2) refuseClient(establishedConnectionFD, OTP_HELLO_ID, "deadline exceeded");
+	if (result != 0) return -1;
+	otp_trace_record(OTP_PHASE_HANDSHAKE_RECV, 0, OTP_HELLO_SIZE, phaseStart);
+	if (checkHello((unsigned char *)buffer, service, &announced, &reason) < 0) {
+		refuseClient(establishedConnectionFD, OTP_HELLO_ID, reason);
+		return -1;
+	}
+	start += OTP_HELLO_SIZE;
+	if (bufferSize == BATCH_BUFFER_SIZE && announced >= OTP_PARALLEL_MIN) otp_parallel_start(cipherThreads);
+
+	// Handle frames until the client closes the connection
+	while (1) {
+		// Get the frame header; the client hanging up between frames is the normal way to finish, and one that has
+		// said nothing for --deadline between requests is simply dropped
+		phaseStart = otp_trace_clock();
+		result = fillBuffer(establishedConnectionFD, buffer, bufferSize, &start, &end, OTP_HEADER_SIZE, zeroCopy, &pending);
+		if (result == 2 && (requestStarted != 0 || end > start)) refuseClient(establishedConnectionFD, requestId, "deadline exceeded");
+		if (result == 1) break;
+		if (result != 0) return -1;
+		otp_get_header((unsigned char *)buffer + start, &frameType, &requestId, &chunkLength);
+		phaseStart = otp_trace_record(OTP_PHASE_HEADER_READ, requestId, OTP_HEADER_SIZE, phaseStart);
+
+		// Echo the END frame to let the client know every chunk of that request has been answered
+		if (frameType == OTP_FRAME_END) {
+			if (sendResponse(establishedConnectionFD, buffer + start, OTP_HEADER_SIZE, zeroCopy, &pending) < 0) return -1;
+			otp_trace_record(OTP_PHASE_RESPONSE_SEND, requestId, OTP_HEADER_SIZE, phaseStart);
+			OTP_COUNT(requests, 1);
+			start += OTP_HEADER_SIZE;
+			requestSymbols = 0;
+			requestStarted = 0;
+			continue;
+		}
+
+		// Cut off a request that has run past its deadline rather than keep a slot busy with it
+		if (deadline > 0) {
+			if (requestStarted == 0) requestStarted = milliseconds();
+			else if (milliseconds() - requestStarted > (uint64_t)deadline) {
+				OTP_COUNT(deadlineMisses, 1);
+				refuseClient(establishedConnectionFD, requestId, "deadline exceeded");
+				break;
+			}
+		}
+		frameLength = frameSize(frameType, chunkLength);
+		if (frameLength == 0) {
+			fprintf(stderr, "SERVER: ERROR bad frame from client\n");
+			return -1;
+		}
+
+		// Read the text symbols followed by the matching key symbols (or the pad reference and the text)
+		result = fillBuffer(establishedConnectionFD, buffer, bufferSize, &start, &end, frameLength, zeroCopy, &pending);
+		if (result == 2) refuseClient(establishedConnectionFD, requestId, "deadline exceeded");
+		if (result != 0) return -1;
+		phaseStart = otp_trace_record(OTP_PHASE_PAYLOAD_RECV, requestId, frameLength - OTP_HEADER_SIZE, phaseStart);
+
+		// A large request hands this frame and the ones already buffered behind it to the thread pool
+		if (bufferSize == BATCH_BUFFER_SIZE && requestSymbols >= OTP_PARALLEL_MIN) {
+			otp_parallel_start(cipherThreads);
+			if (topUpBuffer(establishedConnectionFD, buffer, bufferSize, &start, &end, zeroCopy, &pending) < 0) return -1;
+			result = answerBatch(establishedConnectionFD, buffer, &start, end, service, zeroCopy, &pending, &requestId, &reason);
+			if (result < 0) return -1;
+			if (result > 0) {
+				refuseClient(establishedConnectionFD, requestId, reason);
+				break;
+			}
+			continue;
+		}
+		requestSymbols += chunkLength;
+
+		// Cipher the text in place, then send the chunk straight back (header and text are already contiguous)
+		// so the client can start writing output before the upload is done
+		answerAt = answerFrame((unsigned char *)buffer + start, service, &answerLength, &reason);
+		phaseStart = otp_trace_record(OTP_PHASE_CIPHER, requestId, chunkLength, phaseStart);
+		if (answerAt < 0) {
+			refuseClient(establishedConnectionFD, requestId, reason);
+			break;
+		}
+		if (sendResponse(establishedConnectionFD, buffer + start + answerAt, answerLength, zeroCopy, &pending) < 0) return -1;
+		otp_trace_record(OTP_PHASE_RESPONSE_SEND, requestId, answerLength, phaseStart);
+		start += frameLength;
+	}
+
+	// Do not let the buffer go while the kernel may still be sending from it
+	if (zeroCopy) waitZeroCopy(establishedConnectionFD, &pending);
+	return 0;
+}
+
+// A connection the fork mode parent holds on to: waiting for a child to serve it, or turned away busy and waiting
+// for the client to hang up
+struct held {
+	int fd;
+	uint64_t since;                     // when it was accepted, or turned away
+	uint64_t acceptedAt;                // otp_trace_clock() at accept, for --trace
+};
+
+static struct held *queued;             // FIFO of connections waiting for a child, queueLimit long
+static int queueHead, queueCount;
+static struct held draining[DRAIN_MAX]; // clients turned away busy
+static int drainCount;
+
+static void onChildExit(int signo) { (void)signo; }
+
+// Tell a client that we are full, and keep its socket until it hangs up: closing it with the client's hello still
+// unread would reset the connection, and the client might never see the BUSY frame
+static void turnAwayBusy(int fd)
+{
+	unsigned char busy[OTP_HEADER_SIZE + OTP_BUSY_SIZE];
+
+	OTP_COUNT(busyRejections, 1);
+	(void)!send(fd, busy, busyFrame(busy), MSG_NOSIGNAL | MSG_DONTWAIT);
+	shutdown(fd, SHUT_WR);
+
+	// Make room by giving up on the client that has had the longest
+	if (drainCount == DRAIN_MAX) {
+		close(draining[0].fd);
+		memmove(draining, draining + 1, (DRAIN_MAX - 1) * sizeof(*draining));
+		drainCount--;
+	}
+	draining[drainCount].fd = fd;
+	draining[drainCount].since = milliseconds();
+	drainCount++;
+}
+
+// Read out what the busy clients sent, and close the sockets of those that hung up or took too long
+static void drainBusy(const struct pollfd *ready)
+{
+	static char discard[65536];
+	uint64_t now = milliseconds();
+	int i, kept = 0;
+	ssize_t nb = 0;
+
+	for (i = 0; i < drainCount; i++) {
+		if (ready[i].revents != 0) while ((nb = recv(draining[i].fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0);
+		if ((ready[i].revents != 0 && (nb == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))) || now - draining[i].since >= DRAIN_LINGER)
+			close(draining[i].fd);
+		else draining[kept++] = draining[i];
+	}
+	drainCount = kept;
+}
+
+// Fork a child to do the handshake and the ciphering for one connection, with a metrics slot of its own.
+// Returns 0 once the child is running and -1 if it could not be started.
+static int serveInChild(int fd, uint64_t acceptedAt, int listenSocketFD, const struct otp_service *service, const sigset_t *signals)
+{
+	int slot = otp_metrics_claim();
+	pid_t pid = fork();
+	int i;
+
+	if (pid < 0) {
+		perror("SERVER: ERROR on fork");
+		close(fd);
+		if (slot != OTP_METRICS_SHARED) otp_metrics_slot(slot)->inUse = 0;
+		return -1;
+	}
+
+	// In the child, serve the client and end; every other socket the parent holds belongs to the parent
+	if (pid == 0) {
+		sigprocmask(SIG_SETMASK, signals, NULL);
+		close(listenSocketFD);
+		for (i = 0; i < queueCount; i++) close(queued[(queueHead + i) % queueLimit].fd);
+		for (i = 0; i < drainCount; i++) close(draining[i].fd);
+		otp_metrics_adopt(slot);
+		otp_trace_adopt(slot);
+		otp_trace_record(OTP_PHASE_ACCEPT, 0, 0, acceptedAt);
+		OTP_COUNT(connections, 1);
+		handleClient(fd, service);
+		close(fd);
+		OTP_COUNT(connectionsClosed, 1);
+		otp_metrics_release();
+		if (printIoStats) otp_print_io_counters(service->name);
+		exit(0);
+	}
+
+	// Else we're in the parent, and can close the child connection
+	if (slot != OTP_METRICS_SHARED) otp_metrics_slot(slot)->pid = pid;
+	close(fd);
+	return 0;
+}
+
+// Accept connections and fork a child to serve each one. With --max-inflight, a connection that arrives while
+// that many children are serving waits in a queue of up to --backlog connections and is served in turn as children
+// finish; one that finds the queue full, or waits in it past --deadline, is answered BUSY by the parent instead.
+static void serveForking(int listenSocketFD, const struct otp_service *service)
+{
+	struct sockaddr_in clientAddress;
+	socklen_t sizeOfClientInfo;
+	struct sigaction childExit;
+	struct pollfd waiting[1 + DRAIN_MAX];
+	struct timespec patience = { 0, SWEEP_INTERVAL * 1000000L };
+	sigset_t childSignal, signals;
+	int children = 0;                   // children serving a client
+	int establishedConnectionFD;
+	uint64_t acceptedAt;
+	struct held next;
+	int i;
+	pid_t pid;
+
+	// Reap finished children ourselves, so they do not stay around as zombies and we know how many are left. A
+	// child exiting interrupts ppoll(), the only place SIGCHLD is let through, so no exit goes unnoticed.
+	memset(&childExit, 0, sizeof(childExit));
+	childExit.sa_handler = onChildExit;
+	childExit.sa_flags = SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &childExit, NULL);
+	sigemptyset(&childSignal);
+	sigaddset(&childSignal, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childSignal, &signals);
+	if (maxInflight > 0) {
+		queued = malloc(queueLimit * sizeof(*queued));
+		if (queued == NULL) error("ERROR allocating the accept queue");
+	}
+
+	// Keep the server open
+	while (1) {
+		dumpTraceIfRequested(service);
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) if (pid != statsPid) children--;
+
+		// Hand waiting connections to children as they free up, oldest first, and turn away those that waited too long
+		while (queueCount > 0) {
+			next = queued[queueHead];
+			if (children >= maxInflight && (deadline == 0 || milliseconds() - next.since <= (uint64_t)deadline)) break;
+			queueHead = (queueHead + 1) % queueLimit;
+			queueCount--;
+			if (children >= maxInflight) turnAwayBusy(next.fd);
+			else if (serveInChild(next.fd, next.acceptedAt, listenSocketFD, service, &signals) == 0) children++;
+		}
+
+		// Wait for a connection, and for busy clients to hang up
+		waiting[0].fd = listenSocketFD;
+		waiting[0].events = POLLIN;
+		for (i = 0; i < drainCount; i++) {
+			waiting[1 + i].fd = draining[i].fd;
+			waiting[1 + i].events = POLLIN;
+		}
+		if (ppoll(waiting, 1 + drainCount, drainCount > 0 || (queueCount > 0 && deadline > 0) ? &patience : NULL, &signals) < 0) {
+			if (errno == EINTR) continue;
+			error("ERROR in poll");
+		}
+		if (drainCount > 0) drainBusy(waiting + 1);
+		if (!(waiting[0].revents & POLLIN)) continue;
+
+		// Accept a connection
+		sizeOfClientInfo = sizeof(clientAddress);
+		establishedConnectionFD = accept(listenSocketFD, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
+		if (establishedConnectionFD < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			error("ERROR on accept");
+		}
+		acceptedAt = otp_trace_clock();
+
+		// Serve it now, or queue it if as many clients as we admit are being served already, or turn it away
+		if (maxInflight == 0 || children < maxInflight) {
+			if (serveInChild(establishedConnectionFD, acceptedAt, listenSocketFD, service, &signals) == 0) children++;
+		}
+		else if (queueCount < queueLimit) {
+			next.fd = establishedConnectionFD;
+			next.since = milliseconds();
+			next.acceptedAt = acceptedAt;
+			queued[(queueHead + queueCount++) % queueLimit] = next;
+		}
+		else turnAwayBusy(establishedConnectionFD);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// epoll mode
+
+// Where a connection is in the conversation
+#define STATE_HELLO 0                       // reading the client's hello
+#define STATE_READ_HEADER 1                 // reading the next frame header
+#define STATE_READ_PAYLOAD 2                // reading the text and key symbols of a chunk
+#define STATE_SEND 3                        // sending the ciphered chunk (or the END frame) back
+#define STATE_DRAIN 4                       // refused, discarding input until the client hangs up
+#define STATE_QUEUED 5                      // accepted while admitLimit clients are served, waiting for one to finish
+
+struct connection {
+	int fd;
+	int state;
+	int endOfRequest;                   // the frame being sent is an END frame
+	int refused;                        // the frame being sent is an ERROR frame, drain and hang up afterwards
+	uint32_t events;                    // what the connection is registered for in epoll
+	unsigned char *buffer;              // [header][text][key] for one chunk, ciphered in place
+	size_t capacity;
+	size_t done;                        // bytes of the current step transferred so far
+	size_t needed;                      // bytes the current step needs in total
+	size_t sendFrom;                    // where in buffer the frame being sent starts
+	uint32_t chunkLength;
+	uint32_t requestId;                 // id of the frame being handled
+	uint64_t phaseStart;                // when the current step began, for --trace
+	int admitted;                       // counts against admitLimit (not turned away busy)
+	int inRequest;                      // between the first frame of a request and its END
+	uint64_t since;                     // with --deadline: when the request (or the wait for one) began
+	struct connection *prev, *next;     // every open connection, for the --deadline sweep
+	struct connection *nextQueued;      // the queue of connections waiting to be admitted
+};
+
+static struct connection *connections;  // list of open connections
+static int admittedCount;               // connections being served, at most admitLimit
+static struct connection *queueFirst, *queueLast;       // waiting connections, oldest first
+static int queuedCount;                 // at most queueLimit
+
+// Restart the connection's --deadline clock
+static void startClock(struct connection *c)
+{
+	if (deadline > 0) c->since = milliseconds();
+}
+
+// Start serving the connection: the client speaks first, and its hello is usually there already
+static int admitConnection(int epollFD, struct connection *c)
+{
+	struct epoll_event event;
+
+	c->admitted = 1;
+	admittedCount++;
+	c->state = STATE_HELLO;
+	c->done = 0;
+	c->needed = OTP_HELLO_SIZE;
+	c->events = EPOLLIN;
+	startClock(c);
+	event.events = c->events;
+	event.data.ptr = c;
+	return epoll_ctl(epollFD, EPOLL_CTL_ADD, c->fd, &event);
+}
+
+// Answer BUSY straight away and hang up, without reading the hello
+static int turnAwayConnection(int epollFD, struct connection *c)
+{
+	struct epoll_event event;
+
+	OTP_COUNT(busyRejections, 1);
+	c->refused = 1;
+	c->requestId = OTP_HELLO_ID;
+	c->state = STATE_SEND;
+	c->done = 0;
+	c->sendFrom = 0;
+	c->needed = busyFrame(c->buffer);
+	c->events = EPOLLOUT;
+	startClock(c);
+	event.events = c->events;
+	event.data.ptr = c;
+	return epoll_ctl(epollFD, EPOLL_CTL_ADD, c->fd, &event);
+}
+
+static struct connection *dequeueConnection(void)
+{
+	struct connection *c = queueFirst;
+
+	queueFirst = c->nextQueued;
+	if (queueFirst == NULL) queueLast = NULL;
+	queuedCount--;
+	return c;
+}
+
+static void closeConnection(int epollFD, struct connection *c)
+{
+	OTP_COUNT(connectionsClosed, 1);
+	if (c->admitted) admittedCount--;
+	if (c->prev != NULL) c->prev->next = c->next;
+	else connections = c->next;
+	if (c->next != NULL) c->next->prev = c->prev;
+	epoll_ctl(epollFD, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->buffer);
+	free(c);
+}
+
+// Give the slots that freed up to the connections that have waited longest. Called between rounds of events, so
+// no connection is admitted (or closed) under a loop that walks them.
+static void admitWaiting(int epollFD)
+{
+	struct connection *c;
+
+	while (queueFirst != NULL && admittedCount < admitLimit) {
+		c = dequeueConnection();
+		if (admitConnection(epollFD, c) < 0) closeConnection(epollFD, c);
+	}
+}
+
+// Make sure the connection buffer can hold a frame of the given size (and always an ERROR frame)
+static int reserveFrame(struct connection *c, size_t frameLength)
+{
+	size_t wanted = frameLength > OTP_HEADER_SIZE + OTP_REASON_MAX ? frameLength : OTP_HEADER_SIZE + OTP_REASON_MAX;
+	unsigned char *bigger;
+
+	if (wanted <= c->capacity) return 0;
+	bigger = realloc(c->buffer, wanted);
+	if (bigger == NULL) return -1;
+	c->buffer = bigger;
+	c->capacity = wanted;
+	return 0;
+}
+
+// Advance the connection as far as the socket allows.
+// Returns 1 while the connection should stay open and 0 once it should be closed.
+static int driveConnection(struct connection *c, const struct otp_service *service)
+{
+	ssize_t nb;
+
+	while (1) {
+		switch (c->state) {
+		case STATE_HELLO:
+			nb = recv(c->fd, c->buffer + c->done, c->needed - c->done, 0);
+			otp_io.syscalls++;
+			if (nb <= 0) goto endOrBlock;
+			c->done += nb;
+			otp_io.bytesReceived += nb;
+			OTP_COUNT(bytesReceived, nb);
+			if (c->done == c->needed) {
+				const char *reason;
+				uint64_t announced;
+
+				// Turn away clients for the other daemon (or that want what we lack), telling them why
+				c->phaseStart = otp_trace_record(OTP_PHASE_HANDSHAKE_RECV, 0, OTP_HELLO_SIZE, c->phaseStart);
+				c->done = 0;
+				if (checkHello(c->buffer, service, &announced, &reason) < 0) {
+					c->refused = 1;
+					c->requestId = OTP_HELLO_ID;
+					c->state = STATE_SEND;
+					c->sendFrom = 0;
+					c->needed = refusalFrame(c->buffer, OTP_HELLO_ID, reason);
+					break;
+				}
+				c->state = STATE_READ_HEADER;
+				c->needed = OTP_HEADER_SIZE;
+				startClock(c);
+			}
+			break;
+
+		case STATE_READ_HEADER:
+			nb = recv(c->fd, c->buffer + c->done, c->needed - c->done, 0);
+			otp_io.syscalls++;
+			if (nb <= 0) goto endOrBlock;
+			c->done += nb;
+			if (!c->inRequest) {
+				c->inRequest = 1;
+				startClock(c);
+			}
+			otp_io.bytesReceived += nb;
+			OTP_COUNT(bytesReceived, nb);
+			if (c->done == c->needed) {
+				int frameType;
+
+				otp_get_header(c->buffer, &frameType, &c->requestId, &c->chunkLength);
+				c->phaseStart = otp_trace_record(OTP_PHASE_HEADER_READ, c->requestId, OTP_HEADER_SIZE, c->phaseStart);
+				if (frameType == OTP_FRAME_END) {
+					// Echo the END frame (the header we just read), then wait for the next request
+					c->endOfRequest = 1;
+					c->state = STATE_SEND;
+					c->done = 0;
+					c->sendFrom = 0;
+					c->needed = OTP_HEADER_SIZE;
+					break;
+				}
+				c->needed = frameSize(frameType, c->chunkLength);
+				if (c->needed == 0 || reserveFrame(c, c->needed) < 0) return 0;
+				c->state = STATE_READ_PAYLOAD;
+			}
+			break;
+
+		case STATE_READ_PAYLOAD:
+			if (c->done < c->needed) {
+				nb = recv(c->fd, c->buffer + c->done, c->needed - c->done, 0);
+				otp_io.syscalls++;
+				if (nb <= 0) goto endOrBlock;
+				c->done += nb;
+				otp_io.bytesReceived += nb;
+				OTP_COUNT(bytesReceived, nb);
+			}
+			if (c->done == c->needed) {
+				const char *reason;
+				size_t answerLength;
+				long answerAt;
+
+				c->phaseStart = otp_trace_record(OTP_PHASE_PAYLOAD_RECV, c->requestId, c->needed - OTP_HEADER_SIZE, c->phaseStart);
+				answerAt = answerFrame(c->buffer, service, &answerLength, &reason);
+				c->phaseStart = otp_trace_record(OTP_PHASE_CIPHER, c->requestId, c->chunkLength, c->phaseStart);
+
+				// Cipher in place and send the chunk back from the same buffer, or explain why not
+				c->state = STATE_SEND;
+				c->done = 0;
+				if (answerAt < 0) {
+					c->refused = 1;
+					c->sendFrom = 0;
+					c->needed = refusalFrame(c->buffer, c->requestId, reason);
+				}
+				else {
+					c->sendFrom = answerAt;
+					c->needed = answerLength;
+				}
+			}
+			break;
+
+		case STATE_SEND:
+			nb = send(c->fd, c->buffer + c->sendFrom + c->done, c->needed - c->done, MSG_NOSIGNAL);
+			otp_io.syscalls++;
+			if (nb < 0) goto wouldBlock;
+			c->done += nb;
+			otp_io.bytesSent += nb;
+			OTP_COUNT(bytesSent, nb);
+			if (c->done == c->needed) {
+				c->phaseStart = otp_trace_record(OTP_PHASE_RESPONSE_SEND, c->requestId, c->needed, c->phaseStart);
+				if (c->refused) {
+					// Closing with unread input would reset the connection and could lose the refusal
+					shutdown(c->fd, SHUT_WR);
+					c->state = STATE_DRAIN;
+					break;
+				}
+				if (c->endOfRequest) {
+					OTP_COUNT(requests, 1);
+					c->inRequest = 0;
+					startClock(c);
+				}
+				c->endOfRequest = 0;
+				c->state = STATE_READ_HEADER;
+				c->done = 0;
+				c->needed = OTP_HEADER_SIZE;
+			}
+			break;
+
+		case STATE_DRAIN:
+			nb = recv(c->fd, c->buffer, c->capacity, 0);
+			otp_io.syscalls++;
+			if (nb <= 0) goto endOrBlock;
+			break;
+		}
+	}
+
+endOrBlock:
+	if (nb == 0) return 0;              // the client hung up
+wouldBlock:
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 1;
+	if (c->state == STATE_SEND) OTP_COUNT(sendErrors, 1);
+	else OTP_COUNT(recvErrors, 1);
+	return 0;
+}
+
+// Register for reading or writing depending on what the connection is waiting for
+static int updateInterest(int epollFD, struct connection *c)
+{
+	struct epoll_event event;
+	uint32_t wanted = c->state == STATE_SEND ? EPOLLOUT : EPOLLIN;
+
+	if (wanted == c->events) return 0;
+	event.events = wanted;
+	event.data.ptr = c;
+	c->events = wanted;
+	return epoll_ctl(epollFD, EPOLL_CTL_MOD, c->fd, &event);
+}
+
+static void acceptConnections(int epollFD, int listenSocketFD)
+{
+	struct connection *c;
+	int fd, result;
+
+	// Take every connection that is waiting
+	while ((fd = accept4(listenSocketFD, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		uint64_t acceptedAt = otp_trace_clock();
+
+		c = calloc(1, sizeof(*c));
+		if (c == NULL || reserveFrame(c, 0) < 0) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->phaseStart = otp_trace_record(OTP_PHASE_ACCEPT, 0, 0, acceptedAt);
+		OTP_COUNT(connections, 1);
+		c->next = connections;
+		if (connections != NULL) connections->prev = c;
+		connections = c;
+
+		// Serve it now if we can; else it waits its turn (unregistered, its hello stays in the socket), or is
+		// turned away if too many are waiting already
+		if (admitLimit == 0 || (admittedCount < admitLimit && queueFirst == NULL)) result = admitConnection(epollFD, c);
+		else if (queuedCount < queueLimit) {
+			c->state = STATE_QUEUED;
+			startClock(c);
+			if (queueLast != NULL) queueLast->nextQueued = c;
+			else queueFirst = c;
+			queueLast = c;
+			queuedCount++;
+			result = 0;
+		}
+		else result = turnAwayConnection(epollFD, c);
+		if (result < 0) {
+			perror("SERVER: ERROR adding connection to epoll");
+			closeConnection(epollFD, c);
+		}
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+		perror("SERVER: ERROR on accept");
+}
+
+// Cut off every connection that has spent more than --deadline on one request or waiting for the next. A client
+// in the middle of a request is told so with an ERROR frame; one that is idle, or not reading what we send, is
+// hung up on. One that has waited that long to be admitted is turned away busy.
+static void sweepDeadlines(int epollFD)
+{
+	struct connection *c, *next;
+	uint64_t now = milliseconds();
+
+	while (queueFirst != NULL && now - queueFirst->since > (uint64_t)deadline) {
+		c = dequeueConnection();
+		if (turnAwayConnection(epollFD, c) < 0) closeConnection(epollFD, c);
+	}
+	for (c = connections; c != NULL; c = next) {
+		next = c->next;
+		if (c->state == STATE_QUEUED || now - c->since <= (uint64_t)deadline) continue;
+		if (c->state == STATE_DRAIN || c->state == STATE_SEND) {
+			if (!c->refused) OTP_COUNT(deadlineMisses, 1);
+			closeConnection(epollFD, c);
+			continue;
+		}
+		OTP_COUNT(deadlineMisses, 1);
+		if (c->state == STATE_READ_HEADER && !c->inRequest) {
+			closeConnection(epollFD, c);
+			continue;
+		}
+		c->needed = refusalFrame(c->buffer, c->state == STATE_HELLO ? OTP_HELLO_ID : c->requestId, "deadline exceeded");
+		c->refused = 1;
+		c->state = STATE_SEND;
+		c->done = 0;
+		c->sendFrom = 0;
+		c->since = now;
+		if (updateInterest(epollFD, c) < 0) closeConnection(epollFD, c);
+	}
+}
+
+static void serveEvents(int listenSocketFD, const struct otp_service *service)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event event;
+	uint64_t lastSweep = milliseconds();
+	int epollFD;
+	int count, i;
+
+	epollFD = epoll_create1(0);
+	if (epollFD < 0) error("ERROR creating epoll instance");
+
+	// The listening socket is the only entry with a NULL pointer. Pool workers may share it (on a Unix socket),
+	// so only one of them is woken per new connection.
+	event.events = EPOLLIN | EPOLLEXCLUSIVE;
+	event.data.ptr = NULL;
+	if (epoll_ctl(epollFD, EPOLL_CTL_ADD, listenSocketFD, &event) < 0) error("ERROR adding listener to epoll");
+
+	// Keep the server open
+	while (1) {
+		dumpTraceIfRequested(service);
+		count = epoll_wait(epollFD, events, MAX_EVENTS, deadline > 0 ? SWEEP_INTERVAL : -1);
+		if (count < 0) {
+			if (errno == EINTR) continue;
+			error("ERROR in epoll_wait");
+		}
+
+		for (i = 0; i < count; i++) {
+			struct connection *c = events[i].data.ptr;
+
+			if (c == NULL) {
+				acceptConnections(epollFD, listenSocketFD);
+				continue;
+			}
+
+			// Run the state machine, then hang up or wait for the next event it needs
+			if (!driveConnection(c, service) || updateInterest(epollFD, c) < 0) closeConnection(epollFD, c);
+		}
+
+		// Only once every event is handled, since the sweep may free connections the events point to
+		if (deadline > 0 && milliseconds() - lastSweep >= SWEEP_INTERVAL) {
+			sweepDeadlines(epollFD);
+			lastSweep = milliseconds();
+		}
+		if (queueFirst != NULL) admitWaiting(epollFD);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// pool mode
+
+static volatile sig_atomic_t reportRequested = 0;
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onReport(int signo) { (void)signo; reportRequested = 1; }
+static void onStop(int signo) { (void)signo; stopRequested = 1; }
+
+static void reportWorkers(const struct otp_service *service, struct worker *pool, int workers)
+{
+	unsigned long total = 0, requests;
+	int i;
+
+	for (i = 0; i < workers; i++) total += otp_metrics_slot(i + 1)->requests;
+	fprintf(stderr, "%s: %lu requests across %d workers\n", service->name, total, workers);
+	for (i = 0; i < workers; i++) {
+		requests = otp_metrics_slot(i + 1)->requests;
+		fprintf(stderr, "%s:   worker %d (pid %d, cpu %d): %lu requests (%.1f%%)\n", service->name, i,
+			(int)pool[i].pid, pool[i].cpu, requests, total ? 100.0 * requests / total : 0.0);
+	}
+}
+
+// Fork worker i onto its listener, pinning it first if asked to. Returns the child's pid.
+static pid_t startWorker(int i, int *listeners, int workers, struct worker *pool, const struct otp_service *service)
+{
+	pid_t pid = fork();
+	int j;
+
+	if (pid != 0) return pid;
+
+	// Workers start with default signal handling and only keep their own listener
+	signal(SIGUSR1, SIG_DFL);
+	signal(SIGUSR2, SIG_IGN);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	for (j = 0; j < workers; j++) if (listeners[j] != listeners[i]) close(listeners[j]);
+
+	if (pool[i].cpu >= 0) {
+		cpu_set_t mask;
+
+		CPU_ZERO(&mask);
+		CPU_SET(pool[i].cpu, &mask);
+		if (sched_setaffinity(0, sizeof(mask), &mask) < 0) perror("SERVER: ERROR pinning worker");
+	}
+
+	otp_metrics_adopt(i + 1);
+	otp_trace_adopt(i + 1);
+	serveEvents(listeners[i], service);
+	exit(0);
+}
+
+static void servePool(const char *address, int workers, int pin, const struct otp_service *service)
+{
+	struct worker *pool;
+	struct sigaction action;
+	cpu_set_t allowed;
+	int *listeners;
+	int cpu = -1;
+	int i;
+
+	// Every worker needs a metrics slot of its own, and admits its share of --max-inflight clients
+	if (workers >= OTP_METRICS_SHARED) workers = OTP_METRICS_SHARED - 1;
+	if (maxInflight > 0) {
+		admitLimit = (maxInflight + workers - 1) / workers;
+		queueLimit = (queueLimit + workers - 1) / workers;
+	}
+	pool = malloc(workers * sizeof(*pool));
+	listeners = malloc(workers * sizeof(*listeners));
+	if (pool == NULL || listeners == NULL) error("ERROR allocating worker pool");
+
+	// Bind every listener here so a port that is in use is reported once, before any worker starts
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0) pin = 0;
+	for (i = 0; i < workers; i++) {
+		// SO_REUSEPORT does not spread Unix socket connections, so there the workers share one listener
+		listeners[i] = otp_is_socket_path(address) && i > 0 ? listeners[0] : openListener(address, 1, 1);
+		pool[i].cpu = -1;
+
+		// Hand out the CPUs we are allowed to run on round robin
+		if (pin) {
+			do cpu = (cpu + 1) % CPU_SETSIZE; while (!CPU_ISSET(cpu, &allowed));
+			pool[i].cpu = cpu;
+		}
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onReport;
+	sigaction(SIGUSR1, &action, NULL);
+	action.sa_handler = onStop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	for (i = 0; i < workers; i++) {
+		pool[i].pid = startWorker(i, listeners, workers, pool, service);
+		if (pool[i].pid < 0) error("ERROR starting worker");
+	}
+
+	// Watch the workers: restart any that die, print the counters when asked
+	while (!stopRequested) {
+		int status;
+		pid_t pid = wait(&status);
+
+		if (reportRequested) {
+			reportRequested = 0;
+			reportWorkers(service, pool, workers);
+		}
+		dumpTraceIfRequested(service);
+		if (pid < 0) continue;
+
+		for (i = 0; i < workers; i++) {
+			if (pool[i].pid != pid || stopRequested) continue;
+			fprintf(stderr, "%s: worker %d exited, restarting it\n", service->name, i);
+			pool[i].pid = startWorker(i, listeners, workers, pool, service);
+		}
+	}
+
+	// Shut the workers (and the stats process) down and leave a final count behind
+	for (i = 0; i < workers; i++) kill(pool[i].pid, SIGTERM);
+	if (statsPid > 0) kill(statsPid, SIGTERM);
+	while (wait(NULL) > 0);
+	reportWorkers(service, pool, workers);
+	dumpRequested = otp_trace_on;           // only set in this process when --trace was given
+	dumpTraceIfRequested(service);
+	exit(0);
+}
+
+//////////////////////////////////////////////////////////////////////
+// entry point
+
+int otp_server_main(int argc, char *argv[], const struct otp_service *service)
+{
+	static const struct option longOptions[] = {
+		{ "epoll", no_argument, NULL, 'e' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "pin", no_argument, NULL, 'P' },
+		{ "zerocopy", no_argument, NULL, 'Z' },
+		{ "io-stats", no_argument, NULL, 'I' },
+		{ "pad", required_argument, NULL, 'k' },
+		{ "stats", required_argument, NULL, 's' },
+		{ "trace", required_argument, NULL, 'T' },
+		{ "cipher-threads", required_argument, NULL, 'C' },
+		{ "fastopen", no_argument, NULL, 'F' },
+		{ "backlog", required_argument, NULL, 'B' },
+		{ "max-inflight", required_argument, NULL, 'M' },
+		{ "deadline", required_argument, NULL, 'D' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *statsAddress = NULL;
+	const char *tracePath = NULL;
+	int mode = MODE_FORK;
+	int workers = 0;
+	int pin = 0;
+	int listenSocketFD;
+	int option;
+
+	// Read the options; the port is the one positional argument
+	while ((option = getopt_long(argc, argv, "ew:PZIk:s:T:C:FB:M:D:", longOptions, NULL)) != -1) {
+		switch (option) {
+		case 'e': mode = MODE_EPOLL; break;
+		case 'w': mode = MODE_POOL; workers = atoi(optarg); break;
+		case 'P': pin = 1; break;
+		case 'Z': useZeroCopy = 1; break;
+		case 'I': printIoStats = 1; break;
+		case 'k':
+			// Pads are given as ID:PATH
+			if (strchr(optarg, ':') == NULL) usage(argv[0]);
+			if (otp_padstore_add(strtoul(optarg, NULL, 10), strchr(optarg, ':') + 1, service->name) < 0) exit(1);
+			padsLoaded = 1;
+			break;
+		case 's': statsAddress = optarg; break;
+		case 'T': tracePath = optarg; break;
+		case 'C': cipherThreads = atoi(optarg); break;
+		case 'F': fastOpen = 1; break;
+		case 'B': backlog = atoi(optarg); break;
+		case 'M': maxInflight = atoi(optarg); break;
+		case 'D': deadline = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	// If there are not enough arguments
+	if (optind >= argc) usage(argv[0]);
+
+	// A client hanging up mid-send should not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	// Counters every serving process writes to, and the process that serves them if asked to
+	if (otp_metrics_init() < 0) error("ERROR allocating metrics");
+	if (statsAddress != NULL) {
+		statsPid = otp_metrics_serve(statsAddress, service->name);
+		if (statsPid < 0) exit(1);
+	}
+
+	// Phase tracing, dumped on SIGUSR2; the handler must interrupt accept() and friends rather than restart them
+	if (tracePath != NULL) {
+		struct sigaction action;
+
+		if (otp_trace_init(tracePath) < 0) error("ERROR allocating trace rings");
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = onDump;
+		sigaction(SIGUSR2, &action, NULL);
+	}
+
+	// Large requests are ciphered with one thread per core unless told otherwise (1 turns that off)
+	if (cipherThreads <= 0) cipherThreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	// Nonsense limits mean no limit
+	if (backlog <= 0) backlog = SOMAXCONN;
+	if (maxInflight < 0) maxInflight = 0;
+	if (deadline < 0) deadline = 0;
+	admitLimit = maxInflight;
+	queueLimit = backlog;
+
+	// Every waiting connection holds a descriptor, so never queue more than the descriptor limit leaves room for
+	if (maxInflight > 0) {
+		struct rlimit files;
+		long room;
+
+		if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur != RLIM_INFINITY) {
+			room = (long)files.rlim_cur - maxInflight - DRAIN_MAX - 64;
+			if (room < queueLimit) queueLimit = room > 1 ? room : 1;
+		}
+	}
+
+	// One worker per core unless a pool size was given
+	if (mode == MODE_POOL) {
+		if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (workers <= 0) workers = 1;
+		servePool(argv[optind], workers, pin, service);
+	}
+
+	listenSocketFD = openListener(argv[optind], mode == MODE_EPOLL, 0);
+	if (mode == MODE_EPOLL) {
+		otp_metrics_adopt(0);
+		serveEvents(listenSocketFD, service);
+	}
+	else serveForking(listenSocketFD, service);
+
+	// Don't do this since we want the connection to remain open
+	//close(listenSocketFD);
+	return 0;
+}
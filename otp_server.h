@@ -0,0 +1,19 @@
+// Description: Server side shared by otp_enc_d and otp_dec_d. The two daemons only differ in the handshake
+// character they expect and the direction they run the cipher in, so each one describes itself with an
+// otp_service and hands control to otp_server_main(), which parses the command line, opens the listening
+// socket and serves clients in the selected mode:
+//   fork  (default)  - accept() in the parent and handle each connection in its own child process
+//   epoll (--epoll)  - a single process drives every connection with a non-blocking state machine
+
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+struct otp_service {
+	const char *name;                   // program name used in messages, e.g. "otp_enc_d"
+	char tag;                           // tag the matching client's hello asks for, 't' or 'p'
+	int direction;                      // OTP_ENCRYPT or OTP_DECRYPT
+};
+
+int otp_server_main(int argc, char *argv[], const struct otp_service *service);
+
+#endif
@@ -0,0 +1,130 @@
+// Description: Implementation of the phase tracing declared in otp_trace.h.
+// Each ring is a count of records ever written followed by OTP_TRACE_RING_SIZE record slots. The writer fills
+// the slot at count % size and then publishes the new count with a release store. The dumper reads the count,
+// copies the newest records, and reads the count again: anything the writer may have overwritten while it was
+// copying, or may be overwriting right now, is thrown away, so no lock is needed on either side.
+// Sources: clock_gettime(2), mmap(2) MAP_NORESERVE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "otp_metrics.h"
+#include "otp_trace.h"
+
+#define RING_COUNT OTP_METRICS_SHARED      // one per metrics slot except the shared one
+
+struct ring {
+	uint64_t written;                   // records ever written, published after each record
+	char pad[64 - sizeof(uint64_t)];
+	struct otp_trace_record records[OTP_TRACE_RING_SIZE];
+};
+
+static const char *phaseNames[OTP_PHASE_COUNT] = {
+	"accept", "handshake_send", "handshake_recv", "header_read", "payload_recv", "cipher", "response_send"
+};
+
+static struct ring *rings;
+static struct ring *myRing;
+static int myRingIndex;
+static const char *dumpPath;
+
+int otp_trace_on;
+
+int otp_trace_init(const char *path)
+{
+	// Only the pages that get written are ever backed by memory
+	rings = mmap(NULL, RING_COUNT * sizeof(*rings), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (rings == MAP_FAILED) {
+		rings = NULL;
+		return -1;
+	}
+	dumpPath = path;
+	otp_trace_adopt(0);
+	return 0;
+}
+
+void otp_trace_adopt(int i)
+{
+	otp_trace_on = rings != NULL && i >= 0 && i < RING_COUNT;
+	myRing = otp_trace_on ? &rings[i] : NULL;
+	myRingIndex = i;
+}
+
+uint64_t otp_trace_clock(void)
+{
+	struct timespec ts;
+
+	if (!otp_trace_on) return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t otp_trace_record(int phase, uint32_t requestId, uint32_t bytes, uint64_t start)
+{
+	struct otp_trace_record *r;
+	uint64_t written;
+
+	if (!otp_trace_on) return 0;
+	written = myRing->written;
+	r = &myRing->records[written % OTP_TRACE_RING_SIZE];
+	r->start = start;
+	r->end = otp_trace_clock();
+	r->pid = getpid();
+	r->requestId = requestId;
+	r->phase = phase;
+	r->ring = myRingIndex;
+	r->bytes = bytes;
+	__atomic_store_n(&myRing->written, written + 1, __ATOMIC_RELEASE);
+	return r->end;
+}
+
+long otp_trace_dump(void)
+{
+	static struct otp_trace_record copy[OTP_TRACE_RING_SIZE];
+	struct otp_trace_header header;
+	char temporary[4096];
+	FILE *out;
+	long total = 0;
+	int i;
+
+	if (rings == NULL) return 0;
+
+	// Write to a temporary file and rename it, so readers never see half a dump
+	snprintf(temporary, sizeof(temporary), "%s.tmp", dumpPath);
+	out = fopen(temporary, "wb");
+	if (out == NULL) { perror("SERVER: ERROR opening trace dump"); return -1; }
+	memset(&header, 0, sizeof(header));
+	fwrite(&header, sizeof(header), 1, out);
+
+	for (i = 0; i < RING_COUNT; i++) {
+		uint64_t before = __atomic_load_n(&rings[i].written, __ATOMIC_ACQUIRE), after, copied, first, n;
+
+		if (before == 0) continue;
+		copied = before > OTP_TRACE_RING_SIZE ? before - OTP_TRACE_RING_SIZE : 0;
+		for (n = copied; n < before; n++) copy[n - copied] = rings[i].records[n % OTP_TRACE_RING_SIZE];
+
+		// Drop whatever the writer may have overwritten while we copied, including the slot it may be writing now
+		after = __atomic_load_n(&rings[i].written, __ATOMIC_ACQUIRE) + 1;
+		first = after > OTP_TRACE_RING_SIZE && after - OTP_TRACE_RING_SIZE > copied ? after - OTP_TRACE_RING_SIZE : copied;
+		if (first >= before) continue;
+		fwrite(copy + (first - copied), sizeof(copy[0]), before - first, out);
+		total += before - first;
+	}
+
+	memcpy(header.magic, OTP_TRACE_MAGIC, sizeof(header.magic));
+	header.version = OTP_TRACE_VERSION;
+	header.recordSize = sizeof(struct otp_trace_record);
+	header.count = total;
+	rewind(out);
+	fwrite(&header, sizeof(header), 1, out);
+	if (fclose(out) != 0 || rename(temporary, dumpPath) < 0) { perror("SERVER: ERROR writing trace dump"); return -1; }
+	return total;
+}
+
+const char *otp_trace_phase_name(int phase)
+{
+	return phase >= 0 && phase < OTP_PHASE_COUNT ? phaseNames[phase] : "unknown";
+}
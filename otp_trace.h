@@ -0,0 +1,67 @@
+// Description: Opt-in phase tracing for otp_enc_d and otp_dec_d.
+// Started with --trace PATH, a daemon timestamps every phase of every connection (accept, hello receive, frame
+// header read, payload receive, cipher, response send) with the monotonic clock and appends a
+// fixed-size record to a ring buffer. Each serving process writes to the ring that goes with its metrics slot
+// (see otp_metrics.h) and is the only writer of it, so recording is a couple of stores and an index bump with
+// no lock; once a ring is full the oldest records are overwritten.
+// The rings live in a shared mapping, so sending the daemon SIGUSR2 makes its main process copy every ring into
+// PATH, a binary dump that otp_tracedump turns into per-phase latency histograms or Chrome trace JSON. A pool
+// daemon also writes a final dump when it is stopped. Children sharing the overflow slot are not traced.
+//
+// Dump format (host byte order): a struct otp_trace_header, then header.count struct otp_trace_record.
+
+#ifndef OTP_TRACE_H
+#define OTP_TRACE_H
+
+#include <stdint.h>
+
+#define OTP_TRACE_MAGIC "OTPTRACE"
+#define OTP_TRACE_VERSION 1
+#define OTP_TRACE_RING_SIZE 8192            // records kept per serving process
+
+#define OTP_PHASE_ACCEPT 0                  // accept() returning until the connection starts being served
+#define OTP_PHASE_HANDSHAKE_SEND 1          // no longer recorded (the client speaks first), kept so old dumps still read
+#define OTP_PHASE_HANDSHAKE_RECV 2          // waiting for and reading the client's hello
+#define OTP_PHASE_HEADER_READ 3             // waiting for and reading a frame header
+#define OTP_PHASE_PAYLOAD_RECV 4
+#define OTP_PHASE_CIPHER 5
+#define OTP_PHASE_RESPONSE_SEND 6
+#define OTP_PHASE_COUNT 7
+
+struct otp_trace_header {
+	char magic[8];                      // OTP_TRACE_MAGIC
+	uint32_t version;
+	uint32_t recordSize;                // sizeof(struct otp_trace_record)
+	uint64_t count;
+};
+
+struct otp_trace_record {
+	uint64_t start;                     // CLOCK_MONOTONIC, ns
+	uint64_t end;
+	uint32_t pid;
+	uint32_t requestId;                 // 0 before the first frame of a connection
+	uint16_t phase;                     // OTP_PHASE_*
+	uint16_t ring;                      // which serving process slot recorded it
+	uint32_t bytes;                     // bytes moved or symbols ciphered in the phase
+};
+
+extern int otp_trace_on;                    // this process records phases
+
+// Allocate rings for every metrics slot and remember where dumps go. Returns 0 on success and -1 on failure.
+int otp_trace_init(const char *path);
+
+// Record into ring i from now on (the process' metrics slot); the overflow slot is not traced
+void otp_trace_adopt(int i);
+
+// Monotonic time in ns if tracing is on, otherwise 0 without reading the clock
+uint64_t otp_trace_clock(void);
+
+// Append a record for a phase that began at start and ends now. Returns now, where the next phase begins.
+uint64_t otp_trace_record(int phase, uint32_t requestId, uint32_t bytes, uint64_t start);
+
+// Copy every ring into the dump file. Returns the number of records written, or -1 with a message on stderr.
+long otp_trace_dump(void);
+
+const char *otp_trace_phase_name(int phase);
+
+#endif
@@ -0,0 +1,136 @@
+// Description: otp_tracedump reads a trace dump written by otp_enc_d / otp_dec_d --trace (see otp_trace.h) and
+// prints, for every phase, how many times it ran, its p50 / p99 / p999 / max latency and a latency histogram with
+// one row per power of two. With --chrome OUT.json it also writes the records as Chrome trace events, which
+// chrome://tracing and Perfetto show as one timeline per serving process.
+// The syntax is: otp_tracedump DUMP [--chrome OUT.json]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "otp_trace.h"
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "USAGE: %s DUMP [--chrome OUT.json]\n", program);
+	exit(1);
+}
+
+static int compareDurations(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t durationOf(const struct otp_trace_record *r)
+{
+	return r->end > r->start ? r->end - r->start : 0;
+}
+
+// Latencies of one phase, sorted, and what they add up to
+static void reportPhase(int phase, uint64_t *durations, size_t count)
+{
+	unsigned long rows[64];
+	unsigned long largest = 0;
+	int first = -1, last = -1, i;
+	size_t j;
+
+	if (count == 0) return;
+	qsort(durations, count, sizeof(durations[0]), compareDurations);
+	printf("%s: %zu records, p50 %.3f us  p99 %.3f us  p999 %.3f us  max %.3f us\n", otp_trace_phase_name(phase), count,
+		durations[(count - 1) / 2] / 1e3, durations[(size_t)((count - 1) * 0.99)] / 1e3,
+		durations[(size_t)((count - 1) * 0.999)] / 1e3, durations[count - 1] / 1e3);
+
+	// Row i holds the latencies in [2^i, 2^(i+1)) ns
+	memset(rows, 0, sizeof(rows));
+	for (j = 0; j < count; j++) rows[durations[j] == 0 ? 0 : 63 - __builtin_clzll(durations[j])]++;
+	for (i = 0; i < 64; i++) {
+		if (rows[i] == 0) continue;
+		if (first < 0) first = i;
+		last = i;
+		if (rows[i] > largest) largest = rows[i];
+	}
+	for (i = first; i <= last; i++) {
+		int bar = (int)(40.0 * rows[i] / largest + 0.5);
+
+		printf("    %12.3f - %12.3f us %10lu ", (double)(1ULL << i) / 1e3, (double)(2ULL << i) / 1e3, rows[i]);
+		while (bar-- > 0) putchar('#');
+		putchar('\n');
+	}
+}
+
+// Chrome's trace event format: one complete ("X") event per record, timestamps in microseconds
+static int writeChrome(const char *path, const struct otp_trace_record *records, size_t count)
+{
+	FILE *out = fopen(path, "w");
+	uint64_t origin = UINT64_MAX;
+	size_t i;
+
+	if (out == NULL) return -1;
+	for (i = 0; i < count; i++) if (records[i].start < origin) origin = records[i].start;
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i = 0; i < count; i++) {
+		const struct otp_trace_record *r = &records[i];
+
+		fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"otp\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u,"
+			"\"args\":{\"request\":%u,\"bytes\":%u,\"slot\":%u}}\n", i == 0 ? "" : ",", otp_trace_phase_name(r->phase),
+			(r->start - origin) / 1e3, durationOf(r) / 1e3, r->pid, r->pid, r->requestId, r->bytes, r->ring);
+	}
+	fprintf(out, "]}\n");
+	return fclose(out);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option longOptions[] = {
+		{ "chrome", required_argument, NULL, 'c' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct otp_trace_header header;
+	struct otp_trace_record *records;
+	uint64_t *durations;
+	const char *chromePath = NULL;
+	size_t count, i, n;
+	FILE *in;
+	int option, phase;
+
+	while ((option = getopt_long(argc, argv, "c:", longOptions, NULL)) != -1) {
+		switch (option) {
+		case 'c': chromePath = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc) usage(argv[0]);
+
+	// Read and check the dump
+	in = fopen(argv[optind], "rb");
+	if (in == NULL) { perror("TRACEDUMP: ERROR opening dump"); exit(1); }
+	if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, OTP_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != OTP_TRACE_VERSION || header.recordSize != sizeof(struct otp_trace_record)) {
+		fprintf(stderr, "TRACEDUMP: ERROR %s is not a trace dump this tool understands\n", argv[optind]);
+		exit(1);
+	}
+	count = header.count;
+	records = malloc((count ? count : 1) * sizeof(*records));
+	durations = malloc((count ? count : 1) * sizeof(*durations));
+	if (records == NULL || durations == NULL) { fprintf(stderr, "TRACEDUMP: ERROR out of memory\n"); exit(1); }
+	if (fread(records, sizeof(*records), count, in) != count) { fprintf(stderr, "TRACEDUMP: ERROR dump is truncated\n"); exit(1); }
+	fclose(in);
+
+	// One report per phase, in the order the phases happen
+	for (phase = 0; phase < OTP_PHASE_COUNT; phase++) {
+		for (i = 0, n = 0; i < count; i++) if (records[i].phase == phase) durations[n++] = durationOf(&records[i]);
+		reportPhase(phase, durations, n);
+	}
+
+	if (chromePath != NULL && writeChrome(chromePath, records, count) != 0) {
+		perror("TRACEDUMP: ERROR writing Chrome trace");
+		exit(1);
+	}
+
+	free(records);
+	free(durations);
+	return 0;
+}
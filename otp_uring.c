@@ -0,0 +1,113 @@
+// Description: Implementation of the io_uring wrapper declared in otp_uring.h.
+// Sources: io_uring_setup(2), io_uring_enter(2), https://kernel.dk/io_uring.pdf
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "otp_protocol.h"
+#include "otp_uring.h"
+
+static int enter(int fd, unsigned submit, unsigned wait)
+{
+	otp_io.syscalls++;
+	return syscall(__NR_io_uring_enter, fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+int otp_uring_init(struct otp_uring *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+	int fd;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+	fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0) return -1;
+
+	// Map the submission ring, the completion ring (shared with it on any kernel that can) and the entries
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP && ring->cqRingSize > ring->sqRingSize) ring->sqRingSize = ring->cqRingSize;
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	sq = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) { close(fd); return -1; }
+	if (params.features & IORING_FEAT_SINGLE_MMAP) cq = sq;
+	else {
+		cq = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) { munmap(sq, ring->sqRingSize); close(fd); return -1; }
+	}
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (cq != sq) munmap(cq, ring->cqRingSize);
+		munmap(sq, ring->sqRingSize);
+		close(fd);
+		return -1;
+	}
+
+	ring->fd = fd;
+	ring->entries = params.sq_entries;
+	ring->sqRing = sq;
+	ring->cqRing = cq;
+	ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+	ring->sqQueued = *ring->sqTail;
+	ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 0;
+}
+
+void otp_uring_exit(struct otp_uring *ring)
+{
+	munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+}
+
+struct io_uring_sqe *otp_uring_sqe(struct otp_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	// The kernel moves the head forward as it consumes entries
+	if (ring->sqQueued - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->entries) {
+		if (otp_uring_submit(ring, 0) < 0) return NULL;
+		if (ring->sqQueued - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->entries) return NULL;
+	}
+
+	// The index array maps ring slots to entries one to one
+	index = ring->sqQueued & *ring->sqMask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[index] = index;
+	ring->sqQueued++;
+	return sqe;
+}
+
+int otp_uring_submit(struct otp_uring *ring, unsigned wait)
+{
+	// Publish the new entries, then hand the kernel every one it has not consumed yet (and wait) in one call
+	__atomic_store_n(ring->sqTail, ring->sqQueued, __ATOMIC_RELEASE);
+	while (enter(ring->fd, ring->sqQueued - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE), wait) < 0)
+		if (errno != EINTR) return -1;
+	return 0;
+}
+
+struct io_uring_cqe *otp_uring_peek(struct otp_uring *ring)
+{
+	unsigned head = *ring->cqHead;
+
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return NULL;
+	return &ring->cqes[head & *ring->cqMask];
+}
+
+void otp_uring_seen(struct otp_uring *ring)
+{
+	__atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
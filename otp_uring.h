@@ -0,0 +1,44 @@
+// Description: Minimal io_uring wrapper used by the batch client (see otp_batch.h).
+// It talks to the kernel through the raw io_uring_setup() / io_uring_enter() system calls and the ring layout in
+// <linux/io_uring.h>, so liburing is not needed. One ring holds a submission queue, whose entries the caller fills
+// in and queues with otp_uring_sqe(), and a completion queue that otp_uring_submit() waits on and
+// otp_uring_peek() / otp_uring_seen() read from. The rings are shared with the kernel, so the head and tail
+// indices are read with acquire and published with release ordering.
+// Sources: io_uring_setup(2), io_uring_enter(2), https://kernel.dk/io_uring.pdf
+
+#ifndef OTP_URING_H
+#define OTP_URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct otp_uring {
+	int fd;
+	unsigned entries;                   // submission queue size
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned sqQueued;                  // our tail: entries handed out but not published to the kernel yet
+	struct io_uring_sqe *sqes;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+	void *sqRing, *cqRing;              // the mappings, for otp_uring_exit()
+	size_t sqRingSize, cqRingSize, sqesSize;
+};
+
+// Set up a ring with room for at least entries submissions. Returns 0 on success and -1 with errno set if the
+// kernel has no io_uring (or it is disabled).
+int otp_uring_init(struct otp_uring *ring, unsigned entries);
+void otp_uring_exit(struct otp_uring *ring);
+
+// A cleared submission queue entry to fill in. If the queue is full, what is queued is submitted first.
+// Returns NULL only if the kernel refuses to take any of it.
+struct io_uring_sqe *otp_uring_sqe(struct otp_uring *ring);
+
+// Submit everything queued and wait until at least wait completions are available.
+// Returns 0 on success and -1 with errno set on error.
+int otp_uring_submit(struct otp_uring *ring, unsigned wait);
+
+// The oldest completion not seen yet, or NULL; otp_uring_seen() hands its slot back to the kernel
+struct io_uring_cqe *otp_uring_peek(struct otp_uring *ring);
+void otp_uring_seen(struct otp_uring *ring);
+
+#endif